@@ -12,764 +12,7876 @@
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
+#include <assimp/IOSystem.hpp>
+#include <assimp/IOStream.hpp>
+#include <assimp/Logger.hpp>
+#include <assimp/DefaultLogger.hpp>
+#include <assimp/ProgressHandler.hpp>
 #include <sstream>
 #include <cstdarg>
 #include <unordered_map>
+#include <map>
+#include <set>
+#include <limits>
+#include <climits>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <functional>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#define EGL_NO_X11
+#define MESA_EGL_NO_X11_HEADERS
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#define USE_SSE
+#endif
 
 #define WIDTH 1024
 #define HEIGHT 768
 #define CAMERA_DIST 75.0f
+#define CAMERA_NEAR 0.1f
+#define CAMERA_FAR 500.0f
+#define SHADOW_PARTIAL_UPDATE true
+#define SHADOW_FIT true
+#define SHADOW_WIDTH 1024
+#define SHADOW_HEIGHT 1024
+#define SHADOW_FORMAT GL_DEPTH_COMPONENT24
+#define SHADOW_FILTER GL_LINEAR
+#define SHADOW_TAPS 1
+#define SHADOW_BIAS 0.00001f
+#define SHADOW_CASCADES 3
+#define SHADOW_CASCADE_LAMBDA 0.75f
+#define SHADOW_CASCADE_BIAS 0.0005f
+#define MAX_CASCADES 4
+#define OCCLUSION_CULLING true
+#define HIZ_WIDTH 512
+#define HIZ_HEIGHT 256
+#define GPU_DRIVEN false
+#define GPU_DRAW_DISTANCE 2000.0f
+// Goku's far LOD for GPU driven draws: vertex clustering on a grid of this
+// fraction of each mesh's diagonal, swapped in past LOD_DISTANCE
+#define LOD_CELL (1.0f / 24.0f)
+#define LOD_DISTANCE 150.0f
+// Off by default: the arrays copy textures that must stay resident, see MaterialSystem
+#define MATERIAL_ARRAYS false
+#define MATERIAL_UNIT 7
+#define TEXTURE_UPLOAD_SLOTS 4
+#define TEXTURE_UPLOAD_SLOT_BYTES (16 << 20)
+#define TEXTURE_UPLOADS_PER_FRAME 2
+#define TEXTURE_STREAMING false
+#define TEXTURE_BUDGET (32 << 20)
+#define TEXTURE_STREAM_MIN_SIZE 32
+#define TEXTURE_STREAM_UPLOADS 4
+#define ASSET_PACK "../Debug/assets.pack"
+#define ASSET_PACK_ALIGN 4096
+#define NATIVE_OBJ true
+// Tested with #if, so false compiles the profiler and its Assimp hooks out
+#define LOAD_PROFILING true
+#define LOAD_PROFILE "../Debug/load_profile.json"
+#define HOT_RELOAD true
+#define HOT_RELOAD_POLL_MS 250
+#define HEADLESS_FRAMES 300
+#define HEADLESS_REPORT "../Debug/headless.json"
+#define GPU_PASS_TIMING true
+#define GPU_TIMER_LATENCY 4
+#define GPU_TIMER_WINDOW 120
+#define GPU_TIMER_CSV "../Debug/gpu_passes.csv"
+#define MICRO_BENCH_SAMPLES 31
+#define MICRO_BENCH_BATCH_MS 20.0
+#define MICRO_BENCH_REPORT "../Debug/micro.json"
+// Tested with #if, so false leaves no trace of the zones in the build
+#define CPU_PROFILING true
+#define CPU_TRACE "../Debug/trace.json"
+#define CPU_TRACE_FRAMES 10
+#define CPU_TRACE_EVENTS (1 << 20)
+#define CPU_TRACE_BLOCK 1024
+// Also tested with #if, the capture hooks replace GL 1.1 calls by name, so
+// only turn it on for builds that record or replay traces
+#define GL_CAPTURE false
+#define GL_CAPTURE_FRAMES 60
+#define GL_CAPTURE_TRACE "../Debug/frames.trace"
+#define GL_REPLAY_REPORT "../Debug/replay.json"
+#define FRAME_STATS_WINDOW 600
+#define FRAME_STATS_BINS 1000
+#define FRAME_STATS_BIN_MS 0.1f
+#define FRAME_STATS_HITCH 2.0f
+#define FRAME_STATS_LATENCY 4
+#define FRAME_STATS_REPORT_SEC 1.0
+#define FRAME_STATS_LOG "../Debug/frame_stats.csv"
 
-struct Shader
-{
-	Shader(int n, ...) {
-		va_list vl;
-		va_start(vl, n);
-		char *path;
-		GLenum shaderType;
-		std::vector<GLuint> shaderIds;
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
 
-		GLuint sp = glCreateProgram();
+#if CPU_PROFILING
+// Zones for a Chrome trace (chrome://tracing or Perfetto) of the frames
+// asked for with capture(). Each thread appends to its own buffer without
+// locking; the mutex is only taken the first time a thread records.
+// Zone names must be string literals, only the pointer is kept.
+struct CpuProfiler {
 
-		for (int i = 0; i < n; ++i) {
-			path = va_arg(vl, char*);
-			shaderType = va_arg(vl, GLenum);
-			GLuint shaderId = loadShader(path, shaderType);
-			glAttachShader(sp, shaderId);
-			shaderIds.push_back(shaderId);
-		}
+	static CpuProfiler &get() {
+		static CpuProfiler profiler;
+		return profiler;
+	}
 
-		GLint success;
-		char infoLog[512];
-		glLinkProgram(sp);
-		glGetProgramiv(sp, GL_LINK_STATUS, &success);
-		if (!success) {
-			glGetProgramInfoLog(sp, 512, nullptr, infoLog);
-			std::cerr << "link: " << infoLog << std::endl;
-			throw false;
-		}
+	// Records count frames starting after skip more frameMark() calls.
+	// skip 0 starts now, so at startup the trace covers loading as well.
+	void capture(GLuint skip, GLuint count, const std::string &path) {
+		if (recording.load(std::memory_order_relaxed) || count == 0) return;
+		first = frame + skip;
+		last = first + count;
+		output = path;
+		pending = true;
+		if (skip == 0) begin();
+	}
 
-		for (GLuint i = 0; i < shaderIds.size(); ++i) {
-			glDeleteShader(shaderIds[i]);
+	bool isRecording() const {
+		return recording.load(std::memory_order_relaxed);
+	}
+
+	// Call on the main thread at the end of every frame
+	void frameMark() {
+		frame++;
+		if (!pending) return;
+		if (!isRecording() && frame == first) {
+			begin();
+		} else if (isRecording() && frame >= last) {
+			recording.store(false, std::memory_order_relaxed);
+			pending = false;
+			write();
 		}
+	}
 
-		progId = sp;
+	// ns since the profiler started
+	long long now() const {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
 	}
 
-  	void use() {
-		glUseProgram(progId);
+	void record(const char *name, long long from, long long to) {
+		ThreadBuffer *&buffer = threadBuffer();
+		if (!buffer) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (spare.empty()) {
+				buffer = new ThreadBuffer();
+				buffer->tid = buffers.size();
+				buffers.push_back(buffer);
+			} else {
+				buffer = spare.back();
+				spare.pop_back();
+			}
+			buffer->owner = std::this_thread::get_id();
+		}
+		// A buffer left from an earlier capture is reset by its own thread
+		GLuint current = generation.load(std::memory_order_acquire);
+		if (buffer->generation.load(std::memory_order_relaxed) != current) {
+			buffer->count.store(0, std::memory_order_relaxed);
+			buffer->tail = &buffer->first;
+			buffer->generation.store(current, std::memory_order_release);
+		}
+		GLuint i = buffer->count.load(std::memory_order_relaxed);
+		if (i >= CPU_TRACE_EVENTS) return;
+		if (i && i % CPU_TRACE_BLOCK == 0) {
+			if (!buffer->tail->next) buffer->tail->next = new Block();
+			buffer->tail = buffer->tail->next;
+		}
+		Event &e = buffer->tail->events[i % CPU_TRACE_BLOCK];
+		e.name = name;
+		e.from = from;
+		e.to = to;
+		buffer->count.store(i + 1, std::memory_order_release);
 	}
 
-	GLuint getProgId() {
-		return progId;
+	// Hands the calling thread's buffer to the next thread that records, so
+	// short lived threads reuse buffers instead of adding one each. Its
+	// zones so far still go in the trace, on the same track as the next
+	// owner's.
+	void releaseThread() {
+		ThreadBuffer *&buffer = threadBuffer();
+		if (!buffer) return;
+		std::lock_guard<std::mutex> lock(mutex);
+		spare.push_back(buffer);
+		buffer = NULL;
 	}
 
 private:
-	GLuint progId;
+	struct Event {
+		const char *name;
+		long long from, to;
+	};
 
-	GLuint loadShader(const char *path, GLenum shaderType) {
-		std::ifstream sFile(path);
-		if (!sFile.is_open()) {
-			std::cerr << path << " not found" << std::endl;
-			throw false;
-		}
-		std::string sStr(
-			(std::istreambuf_iterator<char>(sFile)),
-			std::istreambuf_iterator<char>()
-			);
-		const char* sChar = sStr.c_str();
-	
-		GLuint shaderId;
-		shaderId = glCreateShader(shaderType);
-		glShaderSource(shaderId, 1, &sChar, nullptr);
-		glCompileShader(shaderId);
-		
-		GLint success;
-		char infoLog[512];
-		glGetShaderiv(shaderId, GL_COMPILE_STATUS, &success);
-		if (!success) {
-			glGetShaderInfoLog(shaderId, 512, nullptr, infoLog);
-			std::cerr << path << " " << infoLog << std::endl;
-			throw false;
-		}
+	struct Block {
+		Block() : next(NULL) {}
+		Event events[CPU_TRACE_BLOCK];
+		Block *next;
+	};
 
-		return shaderId;
-	}
-};
+	// Written by its thread only, read once recording stops
+	struct ThreadBuffer {
+		ThreadBuffer() : tid(0), generation(0), count(0), tail(&first) {}
+		GLuint tid;
+		std::thread::id owner;
+		std::atomic<GLuint> generation;
+		std::atomic<GLuint> count;
+		Block first;
+		Block *tail;
+	};
 
-struct Camera {
+	std::chrono::high_resolution_clock::time_point start;
+	std::atomic<bool> recording;
+	std::atomic<GLuint> generation;
+	GLuint frame, first, last;
+	bool pending;
+	std::string output;
+	std::thread::id mainThread;
+	std::mutex mutex;
+	std::vector<ThreadBuffer*> buffers;
+	std::vector<ThreadBuffer*> spare;
 
-	glm::vec3 lookFrom, lookAt, lookUp;
+	CpuProfiler() : start(std::chrono::high_resolution_clock::now()), recording(false), generation(0),
+		frame(0), first(0), last(0), pending(false), mainThread(std::this_thread::get_id()) {}
 
-	Camera() : lookFrom(0.0f, 0.0f, CAMERA_DIST), 
-			   lookAt(0.0f, 0.0f, 0.0f), 
-			   lookUp(0.0f, 1.0f, 0.0f),
-			   persp(glm::perspective(glm::radians(55.0f), (float)WIDTH/(float)HEIGHT, 0.1f, 500.0f)) {}
+	static ThreadBuffer *&threadBuffer() {
+		static THREAD_LOCAL ThreadBuffer *buffer = NULL;
+		return buffer;
+	}
 
-	void preDraw(Shader shader, bool removeTranslate) {
-		glUniform3fv(glGetUniformLocation(shader.getProgId(), "viewerPos"),
-			1, glm::value_ptr(lookFrom));
-		glUniformMatrix4fv(glGetUniformLocation(shader.getProgId(), "view"),
-			1, GL_FALSE, glm::value_ptr(getViewMatrix(removeTranslate)));
-		glUniformMatrix4fv(glGetUniformLocation(shader.getProgId(), "proj"),
-			1, GL_FALSE, glm::value_ptr(persp));
+	void begin() {
+		generation.fetch_add(1, std::memory_order_release);
+		recording.store(true, std::memory_order_relaxed);
+		std::lock_guard<std::mutex> lock(mutex);
+		mainThread = std::this_thread::get_id();
 	}
-	
-	glm::mat4 getViewMatrix(bool removeTranslate) {
-		glm::mat4 m = glm::lookAt(lookFrom, lookAt, lookUp);
-		if (removeTranslate) {
-			m[3][0] = 0.0f;
-			m[3][1] = 0.0f;
-			m[3][2] = 0.0f;
+
+	// Zones still open when recording stopped are left out
+	void write() {
+		std::ofstream out(output.c_str());
+		if (!out.is_open()) {
+			std::cerr << "can't write " << output << std::endl;
+			return;
 		}
-		return m;
+		GLuint current = generation.load(std::memory_order_acquire);
+		GLuint events = 0;
+		std::lock_guard<std::mutex> lock(mutex);
+		out << "{\"traceEvents\": [";
+		out << "\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"a1\"}}";
+		for (GLuint b = 0; b < buffers.size(); ++b) {
+			ThreadBuffer *buffer = buffers[b];
+			if (buffer->generation.load(std::memory_order_acquire) != current) continue;
+			GLuint count = buffer->count.load(std::memory_order_acquire);
+			out << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer->tid
+				<< ", \"args\": {\"name\": \"";
+			if (buffer->owner == mainThread) out << "main\"}}";
+			else out << "thread " << buffer->tid << "\"}}";
+			const Block *block = &buffer->first;
+			for (GLuint i = 0; i < count; ++i) {
+				if (i && i % CPU_TRACE_BLOCK == 0) block = block->next;
+				const Event &e = block->events[i % CPU_TRACE_BLOCK];
+				out << ",\n{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->tid
+					<< ", \"ts\": " << e.from / 1000.0 << ", \"dur\": " << (e.to - e.from) / 1000.0 << "}";
+			}
+			events += count;
+		}
+		out << "\n]}\n";
+		std::cout << output << ": " << events << " zones over " << last - first << " frames" << std::endl;
 	}
-
-	const glm::mat4 persp;
 };
 
-//////////////////////////////////////////////////////////////
-//////////////////////////////////////////////////////////////
-// Modified Assimp wrappers "Vertex, Texture, Mesh, Model" from
-// http://learnopengl.com/
-// For loading models (eg. obj files)
+// Times its scope as a zone while a capture is recording
+struct ProfileZone {
+	ProfileZone(const char *name)
+		: name(name), from(CpuProfiler::get().isRecording() ? CpuProfiler::get().now() : -1) {}
 
-struct Vertex {
-    glm::vec3 Position;
-    glm::vec3 Normal;
-    glm::vec3 TexCoords;
+	~ProfileZone() {
+		if (from >= 0) CpuProfiler::get().record(name, from, CpuProfiler::get().now());
+	}
+
+private:
+	const char *name;
+	long long from;
 };
 
-struct Texture {
-    GLuint id;
-    std::string type;
-	aiString path;
-}; 
+// Releases the thread's buffer when the thread function returns, put it
+// first in the function a short lived thread runs
+struct ProfileThread {
+	~ProfileThread() {
+		CpuProfiler::get().releaseThread();
+	}
+};
 
-struct EdgeKeyValue {
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profileZone, __LINE__)(name)
+#define PROFILE_FRAME() CpuProfiler::get().frameMark()
+#define PROFILE_THREAD() ProfileThread profileThread
+#else
+#define PROFILE_ZONE(name)
+#define PROFILE_FRAME()
+#define PROFILE_THREAD()
+#endif
 
-	EdgeKeyValue() : state(0), a((GLuint)-1), b((GLuint)-1) {}
-	EdgeKeyValue(GLuint a, GLuint b) : state(0), a(a), b(b) {}
+#if LOAD_PROFILING
+// Where load time goes, written as JSON to LOAD_PROFILE once startup is
+// done. Per asset (a file, shader program or cube map) it keeps the summed
+// ms of each labelled timer, bytes read, vertex/index counts and, for
+// Assimp imports, the progress callbacks. Timers nest: a model's "parse"
+// covers "assimp ReadFile", which covers the Assimp steps.
+struct LoadProfiler {
 
-	void insert(GLuint val) {
-		if (state == 0) {
-			a = val;
-			state++;
-		} else if (state == 1) {
-			b = val;
-			state++;
-		}
+	static LoadProfiler &get() {
+		static LoadProfiler profiler;
+		return profiler;
 	}
 
-	inline GLuint getA() const { return a; }
-	inline GLuint getB() const { return b; }
-
-private:
-	long a, b;
-	GLuint state;
-};
-
-template<> struct std::hash<EdgeKeyValue> {
-	std::size_t operator()(EdgeKeyValue const& e) const {
-		GLuint a, b;
-		if (e.getA() < e.getB()) {
-			a = e.getA();
-			b = e.getB();
-		} else {
-			a = e.getB();
-			b = e.getA();
-		}
-		std::size_t h1 = std::hash<GLuint>()(a);
-		std::size_t h2 = std::hash<GLuint>()(b);
-		return h1 ^ (h2 << 1);
+	// Charges timers on this thread that name no asset to name
+	void setThreadAsset(const std::string &name) {
+		std::lock_guard<std::mutex> lock(mutex);
+		threadAssets[std::this_thread::get_id()] = name;
 	}
-};
 
-template<> struct std::equal_to<EdgeKeyValue> {
-	bool operator()(const EdgeKeyValue &x, const EdgeKeyValue &y) {
-		return (x.getA() == y.getA() && x.getB() == y.getB()) || (x.getA() == y.getB() && x.getB() == y.getA());
+	std::string threadAsset() {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::map<std::thread::id, std::string>::iterator t = threadAssets.find(std::this_thread::get_id());
+		return t == threadAssets.end() ? std::string("startup") : t->second;
 	}
-};
-	
-class Mesh {
-public:
-    std::vector<Vertex> vertices;
-    std::vector<GLuint> indices;
-    std::vector<Texture> textures;
 
-	Mesh() {}
+	// ms since the profiler started
+	double now() const {
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
 
-    Mesh(std::vector<Vertex> vertices, std::vector<GLuint> indices, std::vector<Texture> textures) {
-		this->vertices = vertices;
-		this->computeAdjacency(indices);
-		this->textures = textures;
-		this->setupMesh();
+	// from and to are now() values
+	void add(const std::string &asset, const std::string &label, double from, double to) {
+		std::lock_guard<std::mutex> lock(mutex);
+		Asset &a = find(asset);
+		a.first = std::min(a.first, from);
+		a.last = std::max(a.last, to);
+		accumulate(a, label, to - from);
 	}
-	
-    void Draw(Shader shader, Camera &camera, glm::mat4 &modelMatrix, bool isColor) {
-		if (vertices.size() == 0) return;
-		GLuint diffuseNr = 1;
-		GLuint specularNr = 1;
-		glUniform1ui(glGetUniformLocation(shader.getProgId(), "isColor"), isColor ? 1 : 0);
-		glUniformMatrix4fv(glGetUniformLocation(shader.getProgId(), "model"), 1, GL_FALSE, glm::value_ptr(modelMatrix));
-		glUniformMatrix4fv(glGetUniformLocation(shader.getProgId(), "normalModel"), 
-			1, GL_FALSE, glm::value_ptr(glm::transpose(glm::inverse(modelMatrix))));
-		for (GLuint i = 0; i < this->textures.size(); i++)
-		{
-			glActiveTexture(GL_TEXTURE0 + i);
-			std::stringstream ss;
-			std::string number;
-			std::string name = this->textures[i].type;
-			if(name == "texture_diffuse")
-				ss << diffuseNr++;
-			else if(name == "texture_specular")
-				ss << specularNr++;
-			number = ss.str(); 
-			glUniform1i(glGetUniformLocation(shader.getProgId(), ("material." + name + number).c_str()), i);
- 			glBindTexture(GL_TEXTURE_2D, this->textures[i].id);
-		}
-		glActiveTexture(GL_TEXTURE0);
 
-		glBindVertexArray(this->VAO);
-		camera.preDraw(shader, false);
-		glDrawElements(GL_TRIANGLES_ADJACENCY, this->indices.size(), GL_UNSIGNED_INT, 0);
-		glBindVertexArray(0);
+	// For work timed elsewhere, with no place on the timeline
+	void addMs(const std::string &asset, const std::string &label, double ms) {
+		std::lock_guard<std::mutex> lock(mutex);
+		accumulate(find(asset), label, ms);
 	}
 
-	void computeAdjacency(std::vector<GLuint> indices) {
-		std::unordered_map<EdgeKeyValue, EdgeKeyValue> dict;
+	void addCounts(const std::string &asset, size_t bytes, size_t vertices, size_t indices) {
+		std::lock_guard<std::mutex> lock(mutex);
+		Asset &a = find(asset);
+		a.bytes += bytes;
+		a.vertices += vertices;
+		a.indices += indices;
+	}
 
-		for (GLuint i = 0; i < indices.size(); i += 3) {
-			EdgeKeyValue ek1(indices[i], indices[i + 1]);
-			EdgeKeyValue ek2(indices[i + 1], indices[i + 2]);
-			EdgeKeyValue ek3(indices[i + 2], indices[i]);
+	void addProgress(float percentage) {
+		std::string asset = threadAsset();
+		std::lock_guard<std::mutex> lock(mutex);
+		find(asset).progress.push_back(std::make_pair(now(), percentage));
+	}
 
-			dict[ek1].insert(indices[i + 2]);
-			dict[ek2].insert(indices[i]);
-			dict[ek3].insert(indices[i + 1]);
+	// Assimp logs "<Step> begin" and "<Step> finished ..." around every
+	// post-processing step, and the import between "Load <file>" and
+	// "Entering post processing pipeline"
+	void assimpMessage(const char *message) {
+		std::string text(message);
+		std::string step = text.substr(0, text.find(' '));
+		std::string rest = text.substr(step.size());
+		std::string asset = threadAsset();
+		std::pair<std::thread::id, std::string> key(std::this_thread::get_id(), step);
+		if (step == "Load") {
+			key.second = "import";
+			std::lock_guard<std::mutex> lock(mutex);
+			openSteps[key] = now();
+		} else if (rest == " begin") {
+			std::lock_guard<std::mutex> lock(mutex);
+			openSteps[key] = now();
+		} else if (rest.compare(0, 9, " finished") == 0 || text.compare(0, 33, "Entering post processing pipeline") == 0) {
+			if (rest.compare(0, 9, " finished") != 0) key.second = "import";
+			double from;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				std::map<std::pair<std::thread::id, std::string>, double>::iterator s = openSteps.find(key);
+				if (s == openSteps.end()) return;
+				from = s->second;
+				openSteps.erase(s);
+			}
+			add(asset, "assimp " + key.second, from, now());
 		}
+	}
 
-		for (GLuint i = 0; i < indices.size(); i += 3) {
-			GLuint places[3][3] = {
-				i, i + 1, i + 2,
-				i + 1, i + 2, i,
-				i + 2, i, i + 1
-			};
-			for (GLuint j = 0; j < 3; ++j) {
-				EdgeKeyValue ek1(
-					indices[places[j][0]],
-					indices[places[j][1]]
-				);
-				EdgeKeyValue result = dict[ek1];
-				this->indices.push_back(indices[places[j][0]]);
-				GLuint middle = indices[places[j][2]] == result.getA() ? result.getB() : result.getA();
-				this->indices.push_back(middle == (GLuint)-1 ? indices[places[j][0]] : middle);
+	bool write(const std::string &path) {
+		std::ofstream out(path.c_str());
+		if (!out.is_open()) {
+			std::cerr << "can't write " << path << std::endl;
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		out << "{\n  \"startup_ms\": " << now() << ",\n  \"assets\": [";
+		for (GLuint i = 0; i < assets.size(); ++i) {
+			const Asset &a = assets[i];
+			bool timed = a.first <= a.last;
+			out << (i ? "," : "") << "\n    {\"name\": \"" << escape(a.name) << "\", \"start_ms\": ";
+			if (timed) out << a.first << ", \"end_ms\": " << a.last;
+			else out << "null, \"end_ms\": null";
+			out << ", \"bytes\": " << a.bytes << ", \"vertices\": " << a.vertices
+				<< ", \"indices\": " << a.indices << ",\n     \"ms\": {";
+			for (GLuint j = 0; j < a.timings.size(); ++j) {
+				out << (j ? ", " : "") << "\"" << escape(a.timings[j].first) << "\": " << a.timings[j].second;
+			}
+			out << "}";
+			if (!a.progress.empty()) {
+				out << ",\n     \"progress\": [";
+				for (GLuint j = 0; j < a.progress.size(); ++j) {
+					out << (j ? ", " : "") << "[" << a.progress[j].first << ", " << a.progress[j].second << "]";
+				}
+				out << "]";
 			}
+			out << "}";
 		}
+		out << "\n  ]\n}\n";
+		return true;
 	}
 
-    void setupMesh() {
-		glGenVertexArrays(1, &this->VAO);
-		glGenBuffers(1, &this->VBO);
-		glGenBuffers(1, &this->EBO);
-  
-		glBindVertexArray(this->VAO);
-		glBindBuffer(GL_ARRAY_BUFFER, this->VBO);
-		glBufferData(GL_ARRAY_BUFFER, this->vertices.size() * sizeof(Vertex), 
-						&this->vertices[0], GL_STATIC_DRAW);  
+private:
+	struct Asset {
+		std::string name;
+		double first, last;
+		unsigned long long bytes, vertices, indices;
+		// (label, ms) in first use order
+		std::vector<std::pair<std::string, double> > timings;
+		// (ms, percentage) per progress callback
+		std::vector<std::pair<double, float> > progress;
+	};
 
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->EBO);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, this->indices.size() * sizeof(GLuint), 
-						&this->indices[0], GL_STATIC_DRAW);
+	std::chrono::high_resolution_clock::time_point start;
+	std::mutex mutex;
+	std::vector<Asset> assets;
+	std::unordered_map<std::string, GLuint> assetIndex;
+	std::map<std::thread::id, std::string> threadAssets;
+	std::map<std::pair<std::thread::id, std::string>, double> openSteps;
 
-		glEnableVertexAttribArray(0);	
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 
-								(GLvoid*)0);
+	LoadProfiler() : start(std::chrono::high_resolution_clock::now()) {}
 
-		glEnableVertexAttribArray(1);	
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 
-								(GLvoid*)offsetof(Vertex, Normal));
+	Asset &find(const std::string &name) {
+		std::unordered_map<std::string, GLuint>::iterator i = assetIndex.find(name);
+		if (i != assetIndex.end()) return assets[i->second];
+		assetIndex[name] = assets.size();
+		Asset a;
+		a.name = name;
+		a.first = std::numeric_limits<double>::max();
+		a.last = 0.0;
+		a.bytes = a.vertices = a.indices = 0;
+		assets.push_back(a);
+		return assets.back();
+	}
 
-		glEnableVertexAttribArray(2);	
-		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 
-								(GLvoid*)offsetof(Vertex, TexCoords));
+	static void accumulate(Asset &a, const std::string &label, double ms) {
+		for (GLuint i = 0; i < a.timings.size(); ++i) {
+			if (a.timings[i].first == label) {
+				a.timings[i].second += ms;
+				return;
+			}
+		}
+		a.timings.push_back(std::make_pair(label, ms));
+	}
 
-		glBindVertexArray(0);
+	static std::string escape(const std::string &s) {
+		std::string out;
+		for (GLuint i = 0; i < s.size(); ++i) {
+			if (s[i] == '"' || s[i] == '\\') out += '\\';
+			out += s[i];
+		}
+		return out;
 	}
-	
-private:
-    GLuint VAO, VBO, EBO;
+};
 
-}; 
+// Charges the time until the end of the scope to label on asset, or on the
+// thread's asset when none is given
+struct LoadTimer {
+	LoadTimer(const char *label, const std::string &asset = std::string())
+		: label(label), asset(asset), from(LoadProfiler::get().now())
+#if CPU_PROFILING
+		, zone(label)
+#endif
+	{}
 
-GLint TextureFromFile(const char* path, std::string directory)
-{
-    std::string filename = std::string(path);
-    filename = directory + '/' + filename;
-    GLuint textureID;
-    glGenTextures(1, &textureID);
-    int width, height;
-    unsigned char* image = SOIL_load_image(filename.c_str(), &width, &height, 0, SOIL_LOAD_RGB);
- 
-    glBindTexture(GL_TEXTURE_2D, textureID);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-    glGenerateMipmap(GL_TEXTURE_2D);	
-
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glBindTexture(GL_TEXTURE_2D, 0);
-    SOIL_free_image_data(image);
-
-    return textureID;
-}
+	~LoadTimer() {
+		LoadProfiler &profiler = LoadProfiler::get();
+		profiler.add(asset.empty() ? profiler.threadAsset() : asset, label, from, profiler.now());
+	}
 
-class Model 
-{
+private:
+	const char *label;
+	std::string asset;
+	double from;
+#if CPU_PROFILING
+	// Every loading step shows up in the trace too
+	ProfileZone zone;
+#endif
+};
+
+// Feeds Assimp's verbose log to LoadProfiler, warnings and errors go to std::cerr
+class ProfileLogger : public Assimp::Logger {
 public:
-	glm::mat4 modelMatrix;
+	ProfileLogger() : Assimp::Logger(Assimp::Logger::VERBOSE) {}
 
-    Model(GLchar* path, bool flipWinding)
-		: modelMatrix(1.0f), flipWinding(flipWinding)
-    {
-        this->loadModel(path);
-    }
+	bool attachStream(Assimp::LogStream *, unsigned int) {
+		return false;
+	}
 
-    void Draw(Shader shader, Camera &camera) {
-		for (GLuint i = 0; i < this->meshes.size(); i++)
-			this->meshes[i].Draw(shader, camera, modelMatrix, false);
+	bool detatchStream(Assimp::LogStream *, unsigned int) {
+		return false;
 	}
 
 private:
+	void OnDebug(const char *message) {
+		LoadProfiler::get().assimpMessage(message);
+	}
+
+	void OnInfo(const char *message) {
+		LoadProfiler::get().assimpMessage(message);
+	}
+
+	void OnWarn(const char *message) {
+		std::cerr << "assimp: " << message << std::endl;
+	}
+
+	void OnError(const char *message) {
+		std::cerr << "assimp: " << message << std::endl;
+	}
+};
+
+// The importer deletes it
+class ProfileProgress : public Assimp::ProgressHandler {
+public:
+	bool Update(float percentage) {
+		LoadProfiler::get().addProgress(percentage);
+		return true;
+	}
+};
+
+#define LOAD_TIMER(label) LoadTimer loadTimer(label)
+#define LOAD_ASSET_TIMER(label, asset) LoadTimer loadTimer(label, asset)
+#define LOAD_PROFILER(call) LoadProfiler::get().call
+#else
+// The timers stay zones in the CPU trace
+#define LOAD_TIMER(label) PROFILE_ZONE(label)
+#define LOAD_ASSET_TIMER(label, asset) PROFILE_ZONE(label)
+#define LOAD_PROFILER(call)
+#endif
+
+#if GL_CAPTURE
+// GL calls the renderer makes, by argument kind: i 32 bit integer or enum,
+// f float, p pointer sized offset, loc uniform location, and the object
+// names buf, tex, fbo, rbo, vao, qry, prg and shd, which replay maps to
+// the names it creates. Calls taking or returning data are written out
+// by hand below. glGetString, the shader and program logs, texture
+// parameter and framebuffer status queries aren't recorded, replay needs
+// none of their answers.
+#define GL_TRACE_CORE_CALLS \
+	GL_TRACE_1(Clear, i, GLbitfield) \
+	GL_TRACE_4(Viewport, i, GLint, i, GLint, i, GLsizei, i, GLsizei) \
+	GL_TRACE_1(Enable, i, GLenum) \
+	GL_TRACE_1(Disable, i, GLenum) \
+	GL_TRACE_3(TexParameteri, i, GLenum, i, GLenum, i, GLint) \
+	GL_TRACE_2(BindTexture, i, GLenum, tex, GLuint) \
+	GL_TRACE_1(DepthFunc, i, GLenum) \
+	GL_TRACE_4(ClearColor, f, GLclampf, f, GLclampf, f, GLclampf, f, GLclampf) \
+	GL_TRACE_0(Finish) \
+	GL_TRACE_4(Scissor, i, GLint, i, GLint, i, GLsizei, i, GLsizei) \
+	GL_TRACE_1(DrawBuffer, i, GLenum) \
+	GL_TRACE_1(ReadBuffer, i, GLenum) \
+	GL_TRACE_4(DrawElements, i, GLenum, i, GLsizei, i, GLenum, p, const void *)
+
+#define GL_TRACE_GLEW_CALLS \
+	GL_TRACE_2(BindFramebuffer, i, GLenum, fbo, GLuint) \
+	GL_TRACE_1(EnableVertexAttribArray, i, GLuint) \
+	GL_TRACE_1(DisableVertexAttribArray, i, GLuint) \
+	GL_TRACE_1(BindVertexArray, vao, GLuint) \
+	GL_TRACE_6(VertexAttribPointer, i, GLuint, i, GLint, i, GLenum, i, GLboolean, i, GLsizei, p, const void *) \
+	GL_TRACE_5(VertexAttribIPointer, i, GLuint, i, GLint, i, GLenum, i, GLsizei, p, const void *) \
+	GL_TRACE_2(VertexAttribDivisor, i, GLuint, i, GLuint) \
+	GL_TRACE_5(VertexAttribI4ui, i, GLuint, i, GLuint, i, GLuint, i, GLuint, i, GLuint) \
+	GL_TRACE_2(Uniform1i, loc, GLint, i, GLint) \
+	GL_TRACE_2(Uniform1ui, loc, GLint, i, GLuint) \
+	GL_TRACE_2(Uniform1f, loc, GLint, f, GLfloat) \
+	GL_TRACE_1(ActiveTexture, i, GLenum) \
+	GL_TRACE_3(BindBufferBase, i, GLenum, i, GLuint, buf, GLuint) \
+	GL_TRACE_5(TexStorage2D, i, GLenum, i, GLsizei, i, GLenum, i, GLsizei, i, GLsizei) \
+	GL_TRACE_6(TexStorage3D, i, GLenum, i, GLsizei, i, GLenum, i, GLsizei, i, GLsizei, i, GLsizei) \
+	GL_TRACE_1(GenerateMipmap, i, GLenum) \
+	GL_TRACE_2(BeginQuery, i, GLenum, qry, GLuint) \
+	GL_TRACE_1(EndQuery, i, GLenum) \
+	GL_TRACE_2(QueryCounter, qry, GLuint, i, GLenum) \
+	GL_TRACE_1(MemoryBarrier, i, GLbitfield) \
+	GL_TRACE_3(DispatchCompute, i, GLuint, i, GLuint, i, GLuint) \
+	GL_TRACE_2(BindRenderbuffer, i, GLenum, rbo, GLuint) \
+	GL_TRACE_4(RenderbufferStorage, i, GLenum, i, GLenum, i, GLsizei, i, GLsizei) \
+	GL_TRACE_5(FramebufferTexture2D, i, GLenum, i, GLenum, i, GLenum, tex, GLuint, i, GLint) \
+	GL_TRACE_5(FramebufferTextureLayer, i, GLenum, i, GLenum, tex, GLuint, i, GLint, i, GLint) \
+	GL_TRACE_4(FramebufferRenderbuffer, i, GLenum, i, GLenum, i, GLenum, rbo, GLuint) \
+	GL_TRACE_2(AttachShader, prg, GLuint, shd, GLuint) \
+	GL_TRACE_1(CompileShader, shd, GLuint) \
+	GL_TRACE_1(LinkProgram, prg, GLuint) \
+	GL_TRACE_1(DeleteShader, shd, GLuint) \
+	GL_TRACE_1(DeleteProgram, prg, GLuint) \
+	GL_TRACE_5(DrawElementsInstanced, i, GLenum, i, GLsizei, i, GLenum, p, const void *, i, GLsizei) \
+	GL_TRACE_3(DrawElementsIndirect, i, GLenum, i, GLenum, p, const void *) \
+	GL_TRACE_5(MultiDrawElementsIndirect, i, GLenum, i, GLenum, p, const void *, i, GLsizei, i, GLsizei) \
+	GL_TRACE_5(CopyBufferSubData, i, GLenum, i, GLenum, p, GLintptr, p, GLintptr, p, GLsizeiptr) \
+	GL_TRACE_7(BindImageTexture, i, GLuint, tex, GLuint, i, GLint, i, GLboolean, i, GLint, i, GLenum, i, GLenum)
+
+// glGen* and glDelete* pairs with the kind of name they make
+#define GL_TRACE_CORE_NAMES \
+	GL_TRACE_NAMES(GenTextures, DeleteTextures, GL_NAME_TEXTURE)
+
+#define GL_TRACE_GLEW_NAMES \
+	GL_TRACE_NAMES(GenBuffers, DeleteBuffers, GL_NAME_BUFFER) \
+	GL_TRACE_NAMES(GenFramebuffers, DeleteFramebuffers, GL_NAME_FRAMEBUFFER) \
+	GL_TRACE_NAMES(GenRenderbuffers, DeleteRenderbuffers, GL_NAME_RENDERBUFFER) \
+	GL_TRACE_NAMES(GenVertexArrays, DeleteVertexArrays, GL_NAME_VERTEX_ARRAY) \
+	GL_TRACE_NAMES(GenQueries, DeleteQueries, GL_NAME_QUERY)
+
+#define GL_TRACE_CORE_SPECIAL \
+	GL_TRACE_SPECIAL(PixelStorei) \
+	GL_TRACE_SPECIAL(TexParameterfv) \
+	GL_TRACE_SPECIAL(TexImage2D) \
+	GL_TRACE_SPECIAL(TexSubImage2D) \
+	GL_TRACE_SPECIAL(ReadPixels)
+
+#define GL_TRACE_GLEW_SPECIAL \
+	GL_TRACE_SPECIAL(BindBuffer) \
+	GL_TRACE_SPECIAL(UseProgram) \
+	GL_TRACE_SPECIAL(CreateShader) \
+	GL_TRACE_SPECIAL(CreateProgram) \
+	GL_TRACE_SPECIAL(ShaderSource) \
+	GL_TRACE_SPECIAL(GetUniformLocation) \
+	GL_TRACE_SPECIAL(Uniform3fv) \
+	GL_TRACE_SPECIAL(Uniform4fv) \
+	GL_TRACE_SPECIAL(UniformMatrix4fv) \
+	GL_TRACE_SPECIAL(VertexAttrib3fv) \
+	GL_TRACE_SPECIAL(VertexAttrib4fv) \
+	GL_TRACE_SPECIAL(BufferData) \
+	GL_TRACE_SPECIAL(BufferSubData) \
+	GL_TRACE_SPECIAL(BufferStorage) \
+	GL_TRACE_SPECIAL(MapBufferRange) \
+	GL_TRACE_SPECIAL(UnmapBuffer) \
+	GL_TRACE_SPECIAL(GetBufferSubData) \
+	GL_TRACE_SPECIAL(TexImage3D) \
+	GL_TRACE_SPECIAL(CompressedTexImage2D) \
+	GL_TRACE_SPECIAL(CompressedTexSubImage2D) \
+	GL_TRACE_SPECIAL(CopyImageSubData) \
+	GL_TRACE_SPECIAL(FenceSync) \
+	GL_TRACE_SPECIAL(ClientWaitSync) \
+	GL_TRACE_SPECIAL(DeleteSync) \
+	GL_TRACE_SPECIAL(GetQueryObjectiv) \
+	GL_TRACE_SPECIAL(GetQueryObjectui64v)
+
+// GLEW calls left out on purpose, any other one made while recording
+// fails the capture
+#define GL_TRACE_GLEW_SKIPPED \
+	GL_TRACE_SKIPPED(GetShaderiv) \
+	GL_TRACE_SKIPPED(GetShaderInfoLog) \
+	GL_TRACE_SKIPPED(GetProgramiv) \
+	GL_TRACE_SKIPPED(GetProgramInfoLog) \
+	GL_TRACE_SKIPPED(CheckFramebufferStatus)
+
+#define GL_TRACE_0(fn) GL_OP_##fn,
+#define GL_TRACE_1(fn, ...) GL_OP_##fn,
+#define GL_TRACE_2(fn, ...) GL_OP_##fn,
+#define GL_TRACE_3(fn, ...) GL_OP_##fn,
+#define GL_TRACE_4(fn, ...) GL_OP_##fn,
+#define GL_TRACE_5(fn, ...) GL_OP_##fn,
+#define GL_TRACE_6(fn, ...) GL_OP_##fn,
+#define GL_TRACE_7(fn, ...) GL_OP_##fn,
+#define GL_TRACE_NAMES(gen, del, kind) GL_OP_##gen, GL_OP_##del,
+#define GL_TRACE_SPECIAL(fn) GL_OP_##fn,
+enum GlOp {
+	GL_OP_FRAME,
+	GL_TRACE_CORE_CALLS GL_TRACE_GLEW_CALLS
+	GL_TRACE_CORE_NAMES GL_TRACE_GLEW_NAMES
+	GL_TRACE_CORE_SPECIAL GL_TRACE_GLEW_SPECIAL
+	GL_OP_COUNT
+};
+#undef GL_TRACE_0
+#undef GL_TRACE_1
+#undef GL_TRACE_2
+#undef GL_TRACE_3
+#undef GL_TRACE_4
+#undef GL_TRACE_5
+#undef GL_TRACE_6
+#undef GL_TRACE_7
+#undef GL_TRACE_NAMES
+#undef GL_TRACE_SPECIAL
+
+enum GlNameKind {
+	GL_NAME_BUFFER, GL_NAME_TEXTURE, GL_NAME_FRAMEBUFFER, GL_NAME_RENDERBUFFER,
+	GL_NAME_VERTEX_ARRAY, GL_NAME_QUERY, GL_NAME_PROGRAM, GL_NAME_SHADER, GL_NAME_KINDS
+};
+
+// Bytes a glTexImage, glTexSubImage or glReadPixels call covers in client
+// memory, rows padded to alignment but not the last one
+size_t glImageBytes(GLsizei width, GLsizei height, GLsizei depth, GLenum format, GLenum type, GLint alignment) {
+	size_t components = format == GL_RGBA || format == GL_BGRA ? 4 : format == GL_RGB || format == GL_BGR ? 3 :
+		format == GL_RG ? 2 : 1;
+	size_t bytes = type == GL_FLOAT || type == GL_UNSIGNED_INT || type == GL_INT ? 4 :
+		type == GL_UNSIGNED_SHORT || type == GL_SHORT || type == GL_HALF_FLOAT ? 2 : 1;
+	size_t row = (size_t)width * components * bytes;
+	size_t stride = (row + alignment - 1) / alignment * alignment;
+	size_t rows = (size_t)height * depth;
+	return rows ? stride * (rows - 1) + row : 0;
+}
+
+// Records the GL calls made between start() and stop(), with the buffer
+// and texture data they read, to a trace for a1.exe --replay. A call is
+// its opcode and arguments in native byte order; frame() ends a segment,
+// the first being the setup the frames draw with. Only the GL thread
+// records, so there's no locking.
+struct GlCapture {
+	static bool recording;
+
+	static GlCapture &get() {
+		static GlCapture capture;
+		return capture;
+	}
+
+	// Points the GLEW entry points at the recording ones, so call after glewInit
+	bool start(const std::string &path);
+
+	// ms is what the segment took when captured, replay paces by it
+	void frame(float ms) {
+		if (!recording) return;
+		op(GL_OP_FRAME);
+		put_f(ms);
+		frames++;
+	}
+
+	bool stop() {
+		if (!recording) return false;
+		recording = false;
+		flush();
+		GLuint segments = frames;
+		out.seekp(8);
+		out.write((const char*)&segments, 4);
+		out.close();
+		std::cout << path << ": " << (segments ? segments - 1 : 0) << " frames, " << bytes / 1024 << " KB" << std::endl;
+		return !out.fail() && unlisted.empty();
+	}
+
+	// Every GLEW call goes through here while recording, fn being the
+	// entry point it's about to call
+	void check(const void *fn, const char *name) {
+		if (hooked.count(fn) || !unlisted.insert(name).second) return;
+		std::cerr << "gl" << name + 6 << " isn't in the capture lists, " << path << " won't replay" << std::endl;
+	}
+
+	void op(GLushort code) {
+		put(&code, 2);
+	}
+
+	void put_i(GLuint v) {
+		put(&v, 4);
+	}
+
+	void put_f(GLfloat v) {
+		put(&v, 4);
+	}
+
+	void put_p(const void *v) {
+		put_u64((unsigned long long)(size_t)v);
+	}
+
+	void put_p(GLintptr v) {
+		put_u64((unsigned long long)v);
+	}
+
+	void put_u64(unsigned long long v) {
+		put(&v, 8);
+	}
+
+	void put_loc(GLint v) { put_i(v); }
+	void put_buf(GLuint v) { put_i(v); }
+	void put_tex(GLuint v) { put_i(v); }
+	void put_fbo(GLuint v) { put_i(v); }
+	void put_rbo(GLuint v) { put_i(v); }
+	void put_vao(GLuint v) { put_i(v); }
+	void put_qry(GLuint v) { put_i(v); }
+	void put_prg(GLuint v) { put_i(v); }
+	void put_shd(GLuint v) { put_i(v); }
+
+	void put_data(const void *data, size_t size) {
+		put_u64(size);
+		put(data, size);
+	}
+
+	// Pixels for an upload: none, an offset into the bound unpack buffer or the bytes
+	void put_pixels(const void *pixels, size_t size) {
+		unsigned char mode = !pixels ? 0 : unpackBuffer ? 1 : 2;
+		put(&mode, 1);
+		if (mode == 1) put_p(pixels);
+		if (mode == 2) put_data(pixels, size);
+	}
+
+	// State the payload sizes depend on, tracked whether recording or not
+	GLuint unpackBuffer;
+	GLint unpackAlignment, packAlignment;
+	std::map<GLenum, std::pair<void*, GLsizeiptr> > mapped;
+
+private:
+	std::string path;
+	std::ofstream out;
+	std::vector<char> buffer;
+	GLuint frames;
+	unsigned long long bytes;
+	// Entry points recorded or skipped, and the unlisted ones seen
+	std::set<const void*> hooked;
+	std::set<std::string> unlisted;
+
+	GlCapture() : unpackBuffer(0), unpackAlignment(4), packAlignment(4), frames(0), bytes(0) {}
+
+	void put(const void *data, size_t size) {
+		buffer.insert(buffer.end(), (const char*)data, (const char*)data + size);
+		bytes += size;
+		if (buffer.size() >= (1 << 20)) flush();
+	}
+
+	void flush() {
+		if (!buffer.empty()) out.write(&buffer[0], buffer.size());
+		buffer.clear();
+	}
+};
+
+bool GlCapture::recording = false;
+
+#define GL_TRACE_0(fn) decltype(&gl##fn) real##fn = &gl##fn;
+#define GL_TRACE_1(fn, ...) GL_TRACE_0(fn)
+#define GL_TRACE_2(fn, ...) GL_TRACE_0(fn)
+#define GL_TRACE_3(fn, ...) GL_TRACE_0(fn)
+#define GL_TRACE_4(fn, ...) GL_TRACE_0(fn)
+#define GL_TRACE_5(fn, ...) GL_TRACE_0(fn)
+#define GL_TRACE_6(fn, ...) GL_TRACE_0(fn)
+#define GL_TRACE_7(fn, ...) GL_TRACE_0(fn)
+#define GL_TRACE_NAMES(gen, del, kind) GL_TRACE_0(gen) GL_TRACE_0(del)
+#define GL_TRACE_SPECIAL(fn) GL_TRACE_0(fn)
+GL_TRACE_CORE_CALLS GL_TRACE_CORE_NAMES GL_TRACE_CORE_SPECIAL
+#undef GL_TRACE_0
+#define GL_TRACE_0(fn) decltype(__glew##fn) real##fn = NULL;
+GL_TRACE_GLEW_CALLS GL_TRACE_GLEW_NAMES GL_TRACE_GLEW_SPECIAL
+#undef GL_TRACE_0
+#undef GL_TRACE_1
+#undef GL_TRACE_2
+#undef GL_TRACE_3
+#undef GL_TRACE_4
+#undef GL_TRACE_5
+#undef GL_TRACE_6
+#undef GL_TRACE_7
+#undef GL_TRACE_NAMES
+#undef GL_TRACE_SPECIAL
+
+#define GL_TRACE_RECORD(fn, puts) \
+	if (GlCapture::recording) { \
+		GlCapture &c = GlCapture::get(); \
+		c.op(GL_OP_##fn); \
+		puts \
+	}
+#define GL_TRACE_0(fn) \
+	void GLAPIENTRY trace##fn() { \
+		GL_TRACE_RECORD(fn, ) \
+		real##fn(); \
+	}
+#define GL_TRACE_1(fn, k1, t1) \
+	void GLAPIENTRY trace##fn(t1 a1) { \
+		GL_TRACE_RECORD(fn, c.put_##k1(a1);) \
+		real##fn(a1); \
+	}
+#define GL_TRACE_2(fn, k1, t1, k2, t2) \
+	void GLAPIENTRY trace##fn(t1 a1, t2 a2) { \
+		GL_TRACE_RECORD(fn, c.put_##k1(a1); c.put_##k2(a2);) \
+		real##fn(a1, a2); \
+	}
+#define GL_TRACE_3(fn, k1, t1, k2, t2, k3, t3) \
+	void GLAPIENTRY trace##fn(t1 a1, t2 a2, t3 a3) { \
+		GL_TRACE_RECORD(fn, c.put_##k1(a1); c.put_##k2(a2); c.put_##k3(a3);) \
+		real##fn(a1, a2, a3); \
+	}
+#define GL_TRACE_4(fn, k1, t1, k2, t2, k3, t3, k4, t4) \
+	void GLAPIENTRY trace##fn(t1 a1, t2 a2, t3 a3, t4 a4) { \
+		GL_TRACE_RECORD(fn, c.put_##k1(a1); c.put_##k2(a2); c.put_##k3(a3); c.put_##k4(a4);) \
+		real##fn(a1, a2, a3, a4); \
+	}
+#define GL_TRACE_5(fn, k1, t1, k2, t2, k3, t3, k4, t4, k5, t5) \
+	void GLAPIENTRY trace##fn(t1 a1, t2 a2, t3 a3, t4 a4, t5 a5) { \
+		GL_TRACE_RECORD(fn, c.put_##k1(a1); c.put_##k2(a2); c.put_##k3(a3); c.put_##k4(a4); c.put_##k5(a5);) \
+		real##fn(a1, a2, a3, a4, a5); \
+	}
+#define GL_TRACE_6(fn, k1, t1, k2, t2, k3, t3, k4, t4, k5, t5, k6, t6) \
+	void GLAPIENTRY trace##fn(t1 a1, t2 a2, t3 a3, t4 a4, t5 a5, t6 a6) { \
+		GL_TRACE_RECORD(fn, c.put_##k1(a1); c.put_##k2(a2); c.put_##k3(a3); c.put_##k4(a4); c.put_##k5(a5); \
+			c.put_##k6(a6);) \
+		real##fn(a1, a2, a3, a4, a5, a6); \
+	}
+#define GL_TRACE_7(fn, k1, t1, k2, t2, k3, t3, k4, t4, k5, t5, k6, t6, k7, t7) \
+	void GLAPIENTRY trace##fn(t1 a1, t2 a2, t3 a3, t4 a4, t5 a5, t6 a6, t7 a7) { \
+		GL_TRACE_RECORD(fn, c.put_##k1(a1); c.put_##k2(a2); c.put_##k3(a3); c.put_##k4(a4); c.put_##k5(a5); \
+			c.put_##k6(a6); c.put_##k7(a7);) \
+		real##fn(a1, a2, a3, a4, a5, a6, a7); \
+	}
+// New names are recorded after the call that made them
+#define GL_TRACE_NAMES(gen, del, kind) \
+	void GLAPIENTRY trace##gen(GLsizei n, GLuint *names) { \
+		real##gen(n, names); \
+		GL_TRACE_RECORD(gen, c.put_i(n); for (GLsizei i = 0; i < n; ++i) c.put_i(names[i]);) \
+	} \
+	void GLAPIENTRY trace##del(GLsizei n, const GLuint *names) { \
+		GL_TRACE_RECORD(del, c.put_i(n); for (GLsizei i = 0; i < n; ++i) c.put_i(names[i]);) \
+		real##del(n, names); \
+	}
+GL_TRACE_CORE_CALLS GL_TRACE_GLEW_CALLS
+GL_TRACE_CORE_NAMES GL_TRACE_GLEW_NAMES
+#undef GL_TRACE_0
+#undef GL_TRACE_1
+#undef GL_TRACE_2
+#undef GL_TRACE_3
+#undef GL_TRACE_4
+#undef GL_TRACE_5
+#undef GL_TRACE_6
+#undef GL_TRACE_7
+#undef GL_TRACE_NAMES
+
+void GLAPIENTRY tracePixelStorei(GLenum pname, GLint param) {
+	GlCapture &capture = GlCapture::get();
+	if (pname == GL_UNPACK_ALIGNMENT) capture.unpackAlignment = param;
+	if (pname == GL_PACK_ALIGNMENT) capture.packAlignment = param;
+	GL_TRACE_RECORD(PixelStorei, c.put_i(pname); c.put_i(param);)
+	realPixelStorei(pname, param);
+}
+
+void GLAPIENTRY traceTexParameterfv(GLenum target, GLenum pname, const GLfloat *params) {
+	GL_TRACE_RECORD(TexParameterfv, c.put_i(target); c.put_i(pname);
+		c.put_data(params, (pname == GL_TEXTURE_BORDER_COLOR ? 4 : 1) * sizeof(GLfloat));)
+	realTexParameterfv(target, pname, params);
+}
+
+void GLAPIENTRY traceTexImage2D(GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height,
+	GLint border, GLenum format, GLenum type, const void *pixels) {
+	GL_TRACE_RECORD(TexImage2D, c.put_i(target); c.put_i(level); c.put_i(internalformat); c.put_i(width);
+		c.put_i(height); c.put_i(border); c.put_i(format); c.put_i(type);
+		c.put_pixels(pixels, glImageBytes(width, height, 1, format, type, c.unpackAlignment));)
+	realTexImage2D(target, level, internalformat, width, height, border, format, type, pixels);
+}
+
+void GLAPIENTRY traceTexSubImage2D(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width,
+	GLsizei height, GLenum format, GLenum type, const void *pixels) {
+	GL_TRACE_RECORD(TexSubImage2D, c.put_i(target); c.put_i(level); c.put_i(xoffset); c.put_i(yoffset);
+		c.put_i(width); c.put_i(height); c.put_i(format); c.put_i(type);
+		c.put_pixels(pixels, glImageBytes(width, height, 1, format, type, c.unpackAlignment));)
+	realTexSubImage2D(target, level, xoffset, yoffset, width, height, format, type, pixels);
+}
+
+// Replay reads the pixels back too, so a capture that waits on them still does
+void GLAPIENTRY traceReadPixels(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type, void *pixels) {
+	GL_TRACE_RECORD(ReadPixels, c.put_i(x); c.put_i(y); c.put_i(width); c.put_i(height); c.put_i(format); c.put_i(type);)
+	realReadPixels(x, y, width, height, format, type, pixels);
+}
+
+void GLAPIENTRY traceBindBuffer(GLenum target, GLuint buffer) {
+	if (target == GL_PIXEL_UNPACK_BUFFER) GlCapture::get().unpackBuffer = buffer;
+	GL_TRACE_RECORD(BindBuffer, c.put_i(target); c.put_buf(buffer);)
+	realBindBuffer(target, buffer);
+}
+
+void GLAPIENTRY traceUseProgram(GLuint program) {
+	GL_TRACE_RECORD(UseProgram, c.put_prg(program);)
+	realUseProgram(program);
+}
+
+GLuint GLAPIENTRY traceCreateShader(GLenum type) {
+	GLuint shader = realCreateShader(type);
+	GL_TRACE_RECORD(CreateShader, c.put_i(type); c.put_shd(shader);)
+	return shader;
+}
+
+GLuint GLAPIENTRY traceCreateProgram() {
+	GLuint program = realCreateProgram();
+	GL_TRACE_RECORD(CreateProgram, c.put_prg(program);)
+	return program;
+}
+
+void GLAPIENTRY traceShaderSource(GLuint shader, GLsizei count, const GLchar *const *strings, const GLint *lengths) {
+	GL_TRACE_RECORD(ShaderSource, c.put_shd(shader); c.put_i(count);
+		for (GLsizei i = 0; i < count; ++i) {
+			c.put_data(strings[i], lengths && lengths[i] >= 0 ? lengths[i] : std::strlen(strings[i]));
+		})
+	realShaderSource(shader, count, strings, lengths);
+}
+
+// Replay looks the name up again and maps the location it gets
+GLint GLAPIENTRY traceGetUniformLocation(GLuint program, const GLchar *name) {
+	GLint location = realGetUniformLocation(program, name);
+	GL_TRACE_RECORD(GetUniformLocation, c.put_prg(program); c.put_data(name, std::strlen(name)); c.put_i(location);)
+	return location;
+}
+
+void GLAPIENTRY traceUniform3fv(GLint location, GLsizei count, const GLfloat *value) {
+	GL_TRACE_RECORD(Uniform3fv, c.put_loc(location); c.put_i(count); c.put_data(value, count * 3 * sizeof(GLfloat));)
+	realUniform3fv(location, count, value);
+}
+
+void GLAPIENTRY traceUniform4fv(GLint location, GLsizei count, const GLfloat *value) {
+	GL_TRACE_RECORD(Uniform4fv, c.put_loc(location); c.put_i(count); c.put_data(value, count * 4 * sizeof(GLfloat));)
+	realUniform4fv(location, count, value);
+}
+
+void GLAPIENTRY traceUniformMatrix4fv(GLint location, GLsizei count, GLboolean transpose, const GLfloat *value) {
+	GL_TRACE_RECORD(UniformMatrix4fv, c.put_loc(location); c.put_i(count); c.put_i(transpose);
+		c.put_data(value, count * 16 * sizeof(GLfloat));)
+	realUniformMatrix4fv(location, count, transpose, value);
+}
+
+void GLAPIENTRY traceVertexAttrib3fv(GLuint index, const GLfloat *v) {
+	GL_TRACE_RECORD(VertexAttrib3fv, c.put_i(index); c.put_data(v, 3 * sizeof(GLfloat));)
+	realVertexAttrib3fv(index, v);
+}
+
+void GLAPIENTRY traceVertexAttrib4fv(GLuint index, const GLfloat *v) {
+	GL_TRACE_RECORD(VertexAttrib4fv, c.put_i(index); c.put_data(v, 4 * sizeof(GLfloat));)
+	realVertexAttrib4fv(index, v);
+}
+
+void GLAPIENTRY traceBufferData(GLenum target, GLsizeiptr size, const void *data, GLenum usage) {
+	GL_TRACE_RECORD(BufferData, c.put_i(target); c.put_p(size); c.put_i(usage);
+		c.put_data(data, data ? size : 0);)
+	realBufferData(target, size, data, usage);
+}
+
+void GLAPIENTRY traceBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, const void *data) {
+	GL_TRACE_RECORD(BufferSubData, c.put_i(target); c.put_p(offset); c.put_data(data, size);)
+	realBufferSubData(target, offset, size, data);
+}
+
+void GLAPIENTRY traceBufferStorage(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags) {
+	GL_TRACE_RECORD(BufferStorage, c.put_i(target); c.put_p(size); c.put_i(flags);
+		c.put_data(data, data ? size : 0);)
+	realBufferStorage(target, size, data, flags);
+}
+
+// What the caller writes through the pointer is recorded at the unmap.
+// Writes to a persistent mapping never are, so keep them out of captures.
+void *GLAPIENTRY traceMapBufferRange(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access) {
+	void *p = realMapBufferRange(target, offset, length, access);
+	GlCapture::get().mapped[target] = std::make_pair((access & GL_MAP_WRITE_BIT) ? p : NULL, length);
+	GL_TRACE_RECORD(MapBufferRange, c.put_i(target); c.put_p(offset); c.put_p(length); c.put_i(access);)
+	return p;
+}
+
+GLboolean GLAPIENTRY traceUnmapBuffer(GLenum target) {
+	GlCapture &capture = GlCapture::get();
+	std::pair<void*, GLsizeiptr> range = capture.mapped[target];
+	capture.mapped.erase(target);
+	GL_TRACE_RECORD(UnmapBuffer, c.put_i(target); c.put_data(range.first, range.first ? range.second : 0);)
+	return realUnmapBuffer(target);
+}
+
+void GLAPIENTRY traceGetBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, void *data) {
+	GL_TRACE_RECORD(GetBufferSubData, c.put_i(target); c.put_p(offset); c.put_p(size);)
+	realGetBufferSubData(target, offset, size, data);
+}
+
+void GLAPIENTRY traceTexImage3D(GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height,
+	GLsizei depth, GLint border, GLenum format, GLenum type, const void *pixels) {
+	GL_TRACE_RECORD(TexImage3D, c.put_i(target); c.put_i(level); c.put_i(internalformat); c.put_i(width);
+		c.put_i(height); c.put_i(depth); c.put_i(border); c.put_i(format); c.put_i(type);
+		c.put_pixels(pixels, glImageBytes(width, height, depth, format, type, c.unpackAlignment));)
+	realTexImage3D(target, level, internalformat, width, height, depth, border, format, type, pixels);
+}
+
+void GLAPIENTRY traceCompressedTexImage2D(GLenum target, GLint level, GLenum internalformat, GLsizei width,
+	GLsizei height, GLint border, GLsizei imageSize, const void *data) {
+	GL_TRACE_RECORD(CompressedTexImage2D, c.put_i(target); c.put_i(level); c.put_i(internalformat);
+		c.put_i(width); c.put_i(height); c.put_i(border); c.put_i(imageSize); c.put_pixels(data, imageSize);)
+	realCompressedTexImage2D(target, level, internalformat, width, height, border, imageSize, data);
+}
+
+void GLAPIENTRY traceCompressedTexSubImage2D(GLenum target, GLint level, GLint xoffset, GLint yoffset,
+	GLsizei width, GLsizei height, GLenum format, GLsizei imageSize, const void *data) {
+	GL_TRACE_RECORD(CompressedTexSubImage2D, c.put_i(target); c.put_i(level); c.put_i(xoffset);
+		c.put_i(yoffset); c.put_i(width); c.put_i(height); c.put_i(format); c.put_i(imageSize);
+		c.put_pixels(data, imageSize);)
+	realCompressedTexSubImage2D(target, level, xoffset, yoffset, width, height, format, imageSize, data);
+}
+
+// The names are textures unless the target says renderbuffer
+void GLAPIENTRY traceCopyImageSubData(GLuint srcName, GLenum srcTarget, GLint srcLevel, GLint srcX, GLint srcY,
+	GLint srcZ, GLuint dstName, GLenum dstTarget, GLint dstLevel, GLint dstX, GLint dstY, GLint dstZ,
+	GLsizei srcWidth, GLsizei srcHeight, GLsizei srcDepth) {
+	GLint args[] = {
+		(GLint)srcName, (GLint)srcTarget, srcLevel, srcX, srcY, srcZ,
+		(GLint)dstName, (GLint)dstTarget, dstLevel, dstX, dstY, dstZ, srcWidth, srcHeight, srcDepth
+	};
+	GL_TRACE_RECORD(CopyImageSubData, for (GLuint i = 0; i < 15; ++i) c.put_i(args[i]);)
+	realCopyImageSubData(srcName, srcTarget, srcLevel, srcX, srcY, srcZ,
+		dstName, dstTarget, dstLevel, dstX, dstY, dstZ, srcWidth, srcHeight, srcDepth);
+}
+
+GLsync GLAPIENTRY traceFenceSync(GLenum condition, GLbitfield flags) {
+	GLsync sync = realFenceSync(condition, flags);
+	GL_TRACE_RECORD(FenceSync, c.put_i(condition); c.put_i(flags); c.put_u64((unsigned long long)(size_t)sync);)
+	return sync;
+}
+
+GLenum GLAPIENTRY traceClientWaitSync(GLsync sync, GLbitfield flags, GLuint64 timeout) {
+	GL_TRACE_RECORD(ClientWaitSync, c.put_u64((unsigned long long)(size_t)sync); c.put_i(flags); c.put_u64(timeout);)
+	return realClientWaitSync(sync, flags, timeout);
+}
+
+void GLAPIENTRY traceDeleteSync(GLsync sync) {
+	GL_TRACE_RECORD(DeleteSync, c.put_u64((unsigned long long)(size_t)sync);)
+	realDeleteSync(sync);
+}
+
+void GLAPIENTRY traceGetQueryObjectiv(GLuint id, GLenum pname, GLint *params) {
+	GL_TRACE_RECORD(GetQueryObjectiv, c.put_qry(id); c.put_i(pname);)
+	realGetQueryObjectiv(id, pname, params);
+}
+
+void GLAPIENTRY traceGetQueryObjectui64v(GLuint id, GLenum pname, GLuint64 *params) {
+	GL_TRACE_RECORD(GetQueryObjectui64v, c.put_qry(id); c.put_i(pname);)
+	realGetQueryObjectui64v(id, pname, params);
+}
+
+bool GlCapture::start(const std::string &path) {
+	out.open(path.c_str(), std::ios::binary);
+	if (!out.is_open()) {
+		std::cerr << "can't write " << path << std::endl;
+		return false;
+	}
+	this->path = path;
+	GLuint header[] = {0, 1, 0};
+	std::memcpy(header, "A1GL", 4);
+	out.write((const char*)header, sizeof(header));
+#define GL_TRACE_0(fn) real##fn = __glew##fn; __glew##fn = trace##fn; hooked.insert((const void*)trace##fn);
+#define GL_TRACE_1(fn, ...) GL_TRACE_0(fn)
+#define GL_TRACE_2(fn, ...) GL_TRACE_0(fn)
+#define GL_TRACE_3(fn, ...) GL_TRACE_0(fn)
+#define GL_TRACE_4(fn, ...) GL_TRACE_0(fn)
+#define GL_TRACE_5(fn, ...) GL_TRACE_0(fn)
+#define GL_TRACE_6(fn, ...) GL_TRACE_0(fn)
+#define GL_TRACE_7(fn, ...) GL_TRACE_0(fn)
+#define GL_TRACE_NAMES(gen, del, kind) GL_TRACE_0(gen) GL_TRACE_0(del)
+#define GL_TRACE_SPECIAL(fn) GL_TRACE_0(fn)
+#define GL_TRACE_SKIPPED(fn) hooked.insert((const void*)__glew##fn);
+	GL_TRACE_GLEW_CALLS GL_TRACE_GLEW_NAMES GL_TRACE_GLEW_SPECIAL GL_TRACE_GLEW_SKIPPED
+#undef GL_TRACE_SKIPPED
+#undef GL_TRACE_0
+#undef GL_TRACE_1
+#undef GL_TRACE_2
+#undef GL_TRACE_3
+#undef GL_TRACE_4
+#undef GL_TRACE_5
+#undef GL_TRACE_6
+#undef GL_TRACE_7
+#undef GL_TRACE_NAMES
+#undef GL_TRACE_SPECIAL
+	recording = true;
+	return true;
+}
+
+// GL 1.1 calls are plain functions rather than GLEW pointers, so they are
+// routed through the recording ones by name from here on
+#define glClear(...) traceClear(__VA_ARGS__)
+#define glViewport(...) traceViewport(__VA_ARGS__)
+#define glEnable(...) traceEnable(__VA_ARGS__)
+#define glDisable(...) traceDisable(__VA_ARGS__)
+#define glTexParameteri(...) traceTexParameteri(__VA_ARGS__)
+#define glBindTexture(...) traceBindTexture(__VA_ARGS__)
+#define glDepthFunc(...) traceDepthFunc(__VA_ARGS__)
+#define glClearColor(...) traceClearColor(__VA_ARGS__)
+#define glFinish() traceFinish()
+#define glScissor(...) traceScissor(__VA_ARGS__)
+#define glDrawBuffer(...) traceDrawBuffer(__VA_ARGS__)
+#define glReadBuffer(...) traceReadBuffer(__VA_ARGS__)
+#define glDrawElements(...) traceDrawElements(__VA_ARGS__)
+#define glGenTextures(...) traceGenTextures(__VA_ARGS__)
+#define glDeleteTextures(...) traceDeleteTextures(__VA_ARGS__)
+#define glPixelStorei(...) tracePixelStorei(__VA_ARGS__)
+#define glTexParameterfv(...) traceTexParameterfv(__VA_ARGS__)
+#define glTexImage2D(...) traceTexImage2D(__VA_ARGS__)
+#define glTexSubImage2D(...) traceTexSubImage2D(__VA_ARGS__)
+#define glReadPixels(...) traceReadPixels(__VA_ARGS__)
+
+// GLEW calls already go through the pointers, checked against the lists
+// here. GL 1.1 calls outside the ones above can't be caught, glGetString
+// and the texture parameter queries are the only ones made.
+#undef GLEW_GET_FUN
+#define GLEW_GET_FUN(x) ((GlCapture::recording ? GlCapture::get().check((const void*)x, #x) : (void)0), x)
+#endif
+
+std::string canonicalPath(const std::string &path) {
+#ifdef _WIN32
+	char buf[_MAX_PATH];
+	if (_fullpath(buf, path.c_str(), _MAX_PATH)) {
+		std::string s(buf);
+		std::replace(s.begin(), s.end(), '\\', '/');
+		std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+		return s;
+	}
+#else
+	char *resolved = realpath(path.c_str(), NULL);
+	if (resolved) {
+		std::string s(resolved);
+		free(resolved);
+		return s;
+	}
+#endif
+	return path;
+}
+
+#define MAX_SHADER_STAGES 4
+
+// Shaders are passed around by value, so the stage paths are kept as the
+// literals they were given as
+struct Shader
+{
+	Shader(int n, ...) {
+		va_list vl;
+		va_start(vl, n);
+		stages = std::min(n, MAX_SHADER_STAGES);
+		for (int i = 0; i < stages; ++i) {
+			paths[i] = va_arg(vl, char*);
+			types[i] = va_arg(vl, GLenum);
+		}
+		va_end(vl);
+		progId = link();
+	}
+
+  	void use() {
+		glUseProgram(progId);
+	}
+
+	GLuint getProgId() {
+		return progId;
+	}
+
+	// Whether canonical is the canonicalPath of one of the stages
+	bool uses(const std::string &canonical) const {
+		for (int i = 0; i < stages; ++i) {
+			if (canonicalPath(paths[i]) == canonical) return true;
+		}
+		return false;
+	}
+
+	// Rebuilds from the files, keeping the current program if they don't
+	// compile or link. Uniform locations of the old program are stale after.
+	bool reload() {
+		try {
+			GLuint sp = link();
+			glDeleteProgram(progId);
+			progId = sp;
+			return true;
+		} catch (bool) {
+			return false;
+		}
+	}
+
+private:
+	GLuint progId;
+	int stages;
+	const char *paths[MAX_SHADER_STAGES];
+	GLenum types[MAX_SHADER_STAGES];
+
+	GLuint link() {
+		std::vector<GLuint> shaderIds;
+		std::string name;
+
+		GLuint sp = glCreateProgram();
+
+		for (int i = 0; i < stages; ++i) {
+			GLuint shaderId = loadShader(paths[i], types[i]);
+			glAttachShader(sp, shaderId);
+			shaderIds.push_back(shaderId);
+			name += (i ? "+" : "") + std::string(paths[i]);
+		}
+
+		GLint success;
+		char infoLog[512];
+		LOAD_ASSET_TIMER("link", name);
+		glLinkProgram(sp);
+		glGetProgramiv(sp, GL_LINK_STATUS, &success);
+		for (GLuint i = 0; i < shaderIds.size(); ++i) {
+			glDeleteShader(shaderIds[i]);
+		}
+		if (!success) {
+			glGetProgramInfoLog(sp, 512, nullptr, infoLog);
+			std::cerr << "link: " << infoLog << std::endl;
+			glDeleteProgram(sp);
+			throw false;
+		}
+
+		return sp;
+	}
+
+	GLuint loadShader(const char *path, GLenum shaderType) {
+		LOAD_ASSET_TIMER("compile", path);
+		std::ifstream sFile(path);
+		if (!sFile.is_open()) {
+			std::cerr << path << " not found" << std::endl;
+			throw false;
+		}
+		std::string sStr(
+			(std::istreambuf_iterator<char>(sFile)),
+			std::istreambuf_iterator<char>()
+			);
+		const char* sChar = sStr.c_str();
+		LOAD_PROFILER(addCounts(path, sStr.size(), 0, 0));
+	
+		GLuint shaderId;
+		shaderId = glCreateShader(shaderType);
+		glShaderSource(shaderId, 1, &sChar, nullptr);
+		glCompileShader(shaderId);
+		
+		GLint success;
+		char infoLog[512];
+		glGetShaderiv(shaderId, GL_COMPILE_STATUS, &success);
+		if (!success) {
+			glGetShaderInfoLog(shaderId, 512, nullptr, infoLog);
+			std::cerr << path << " " << infoLog << std::endl;
+			throw false;
+		}
+
+		return shaderId;
+	}
+};
+
+struct Camera {
+
+	glm::vec3 lookFrom, lookAt, lookUp;
+
+	Camera() : lookFrom(0.0f, 0.0f, CAMERA_DIST), 
+			   lookAt(0.0f, 0.0f, 0.0f), 
+			   lookUp(0.0f, 1.0f, 0.0f),
+			   persp(glm::perspective(glm::radians(55.0f), (float)WIDTH/(float)HEIGHT, CAMERA_NEAR, CAMERA_FAR)) {}
+
+	void preDraw(Shader shader, bool removeTranslate) {
+		glUniform3fv(glGetUniformLocation(shader.getProgId(), "viewerPos"),
+			1, glm::value_ptr(lookFrom));
+		glUniformMatrix4fv(glGetUniformLocation(shader.getProgId(), "view"),
+			1, GL_FALSE, glm::value_ptr(getViewMatrix(removeTranslate)));
+		glUniformMatrix4fv(glGetUniformLocation(shader.getProgId(), "proj"),
+			1, GL_FALSE, glm::value_ptr(persp));
+	}
+	
+	glm::mat4 getViewMatrix(bool removeTranslate) {
+		glm::mat4 m = glm::lookAt(lookFrom, lookAt, lookUp);
+		if (removeTranslate) {
+			m[3][0] = 0.0f;
+			m[3][1] = 0.0f;
+			m[3][2] = 0.0f;
+		}
+		return m;
+	}
+
+	glm::mat4 persp;
+};
+
+// Planes of a view-projection matrix, stored per component so four
+// bounds can be tested against a plane in one SSE op
+struct Frustum {
+	float nx[6], ny[6], nz[6], d[6];
+
+	Frustum(const glm::mat4 &m) {
+		for (int i = 0; i < 6; ++i) {
+			int row = i / 2;
+			float sign = (i & 1) ? -1.0f : 1.0f;
+			glm::vec4 p(
+				m[0][3] + sign * m[0][row],
+				m[1][3] + sign * m[1][row],
+				m[2][3] + sign * m[2][row],
+				m[3][3] + sign * m[3][row]);
+			p /= glm::length(glm::vec3(p));
+			nx[i] = p.x;
+			ny[i] = p.y;
+			nz[i] = p.z;
+			d[i] = p.w;
+		}
+	}
+
+	// Keeps the planes a light at position is inside of and opens the rest,
+	// leaving a volume that holds whatever can shadow this one. The light
+	// has to be inside as a direction too, for the cascades' directional one.
+	Frustum towardsLight(glm::vec3 position) const {
+		Frustum f = *this;
+		glm::vec3 dir = glm::normalize(position);
+		for (int i = 0; i < 6; ++i) {
+			glm::vec3 n(nx[i], ny[i], nz[i]);
+			if (glm::dot(n, position) + d[i] < 0.0f || glm::dot(n, dir) < 0.0f) {
+				f.nx[i] = f.ny[i] = f.nz[i] = 0.0f;
+				f.d[i] = 1.0f;
+			}
+		}
+		return f;
+	}
+};
+
+// Boxes given as centre and half extents, visible[i] is set to 0 or 1
+void cullBoxes(const Frustum &f, const float *cx, const float *cy, const float *cz,
+	const float *ex, const float *ey, const float *ez, size_t n, unsigned char *visible) {
+	size_t i = 0;
+#ifdef USE_SSE
+	__m128 zero = _mm_setzero_ps();
+	__m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	for (; i + 4 <= n; i += 4) {
+		__m128 x = _mm_loadu_ps(cx + i), y = _mm_loadu_ps(cy + i), z = _mm_loadu_ps(cz + i);
+		__m128 hx = _mm_loadu_ps(ex + i), hy = _mm_loadu_ps(ey + i), hz = _mm_loadu_ps(ez + i);
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (int p = 0; p < 6; ++p) {
+			__m128 px = _mm_set1_ps(f.nx[p]), py = _mm_set1_ps(f.ny[p]), pz = _mm_set1_ps(f.nz[p]);
+			__m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, x), _mm_mul_ps(py, y)),
+				_mm_add_ps(_mm_mul_ps(pz, z), _mm_set1_ps(f.d[p])));
+			__m128 rad = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(_mm_and_ps(px, absMask), hx),
+				_mm_mul_ps(_mm_and_ps(py, absMask), hy)),
+				_mm_mul_ps(_mm_and_ps(pz, absMask), hz));
+			inside = _mm_and_ps(inside, _mm_cmpgt_ps(_mm_add_ps(dist, rad), zero));
+		}
+		int mask = _mm_movemask_ps(inside);
+		visible[i] = mask & 1;
+		visible[i + 1] = (mask >> 1) & 1;
+		visible[i + 2] = (mask >> 2) & 1;
+		visible[i + 3] = (mask >> 3) & 1;
+	}
+#endif
+	for (; i < n; ++i) {
+		unsigned char in = 1;
+		for (int p = 0; p < 6 && in; ++p) {
+			float dist = f.nx[p] * cx[i] + f.ny[p] * cy[i] + f.nz[p] * cz[i] + f.d[p];
+			float rad = std::abs(f.nx[p]) * ex[i] + std::abs(f.ny[p]) * ey[i] + std::abs(f.nz[p]) * ez[i];
+			in = dist + rad > 0.0f;
+		}
+		visible[i] = in;
+	}
+}
+
+void cullSpheres(const Frustum &f, const float *cx, const float *cy, const float *cz,
+	const float *r, size_t n, unsigned char *visible) {
+	size_t i = 0;
+#ifdef USE_SSE
+	for (; i + 4 <= n; i += 4) {
+		__m128 x = _mm_loadu_ps(cx + i), y = _mm_loadu_ps(cy + i), z = _mm_loadu_ps(cz + i);
+		__m128 negR = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(r + i));
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (int p = 0; p < 6; ++p) {
+			__m128 dist = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(_mm_set1_ps(f.nx[p]), x), _mm_mul_ps(_mm_set1_ps(f.ny[p]), y)),
+				_mm_add_ps(_mm_mul_ps(_mm_set1_ps(f.nz[p]), z), _mm_set1_ps(f.d[p])));
+			inside = _mm_and_ps(inside, _mm_cmpgt_ps(dist, negR));
+		}
+		int mask = _mm_movemask_ps(inside);
+		visible[i] = mask & 1;
+		visible[i + 1] = (mask >> 1) & 1;
+		visible[i + 2] = (mask >> 2) & 1;
+		visible[i + 3] = (mask >> 3) & 1;
+	}
+#endif
+	for (; i < n; ++i) {
+		unsigned char in = 1;
+		for (int p = 0; p < 6 && in; ++p) {
+			in = f.nx[p] * cx[i] + f.ny[p] * cy[i] + f.nz[p] * cz[i] + f.d[p] > -r[i];
+		}
+		visible[i] = in;
+	}
+}
+
+//////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////
+// Modified Assimp wrappers "Vertex, Texture, Mesh, Model" from
+// http://learnopengl.com/
+// For loading models (eg. obj files)
+
+struct Vertex {
+    glm::vec3 Position;
+    glm::vec3 Normal;
+    glm::vec3 TexCoords;
+};
+
+struct Texture {
+    GLuint id;
+    std::string type;
+	aiString path;
+}; 
+
+struct EdgeKeyValue {
+
+	EdgeKeyValue() : state(0), a((GLuint)-1), b((GLuint)-1) {}
+	EdgeKeyValue(GLuint a, GLuint b) : state(0), a(a), b(b) {}
+
+	void insert(GLuint val) {
+		if (state == 0) {
+			a = val;
+			state++;
+		} else if (state == 1) {
+			b = val;
+			state++;
+		}
+	}
+
+	inline GLuint getA() const { return a; }
+	inline GLuint getB() const { return b; }
+
+private:
+	long a, b;
+	GLuint state;
+};
+
+template<> struct std::hash<EdgeKeyValue> {
+	std::size_t operator()(EdgeKeyValue const& e) const {
+		GLuint a, b;
+		if (e.getA() < e.getB()) {
+			a = e.getA();
+			b = e.getB();
+		} else {
+			a = e.getB();
+			b = e.getA();
+		}
+		std::size_t h1 = std::hash<GLuint>()(a);
+		std::size_t h2 = std::hash<GLuint>()(b);
+		return h1 ^ (h2 << 1);
+	}
+};
+
+template<> struct std::equal_to<EdgeKeyValue> {
+	bool operator()(const EdgeKeyValue &x, const EdgeKeyValue &y) const {
+		return (x.getA() == y.getA() && x.getB() == y.getB()) || (x.getA() == y.getB() && x.getB() == y.getA());
+	}
+};
+	
+// A whole file mapped read only
+struct MappedFile {
+
+	const unsigned char *data;
+	size_t size;
+
+	MappedFile() : data(NULL), size(0) {
+#ifdef _WIN32
+		file = INVALID_HANDLE_VALUE;
+		mapping = NULL;
+#endif
+	}
+
+	~MappedFile() {
+		close();
+	}
+
+	bool open(const std::string &path) {
+		close();
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(file, &fileSize);
+		size = (size_t)fileSize.QuadPart;
+		mapping = size ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+		data = mapping ? (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		fstat(fd, &st);
+		size = st.st_size;
+		void *p = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+		::close(fd);
+		data = p == MAP_FAILED ? NULL : (const unsigned char*)p;
+		// Read the whole file ahead in one sequential pass
+		if (data) madvise((void*)data, size, MADV_WILLNEED);
+#endif
+		if (!data) close();
+		return data != NULL;
+	}
+
+	void close() {
+#ifdef _WIN32
+		if (data) UnmapViewOfFile(data);
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data) munmap((void*)data, size);
+#endif
+		data = NULL;
+		size = 0;
+	}
+
+private:
+#ifdef _WIN32
+	HANDLE file, mapping;
+#endif
+
+	MappedFile(const MappedFile &);
+	MappedFile &operator=(const MappedFile &);
+};
+
+// Every asset in one file at ASSET_PACK_ALIGN aligned offsets, written by
+// a1.exe --pack. The whole file is mapped once and entries are found by
+// file name, so "../Debug/Goku.obj" and "Goku.obj" are the same entry.
+// Layout: "A1PK", entry count, index offset (8 bytes), the entries, then
+// per entry the name length, name, offset and size (8 bytes each).
+struct AssetPack {
+
+	static AssetPack &get() {
+		static AssetPack pack;
+		return pack;
+	}
+
+	// False when path is missing or not a pack
+	bool open(const std::string &path) {
+		entries.clear();
+		if (!file.open(path)) return false;
+		if (!parseIndex()) {
+			std::cerr << path << " is not an asset pack" << std::endl;
+			entries.clear();
+			file.close();
+			return false;
+		}
+		return true;
+	}
+
+	bool find(const std::string &path, const unsigned char *&data, size_t &length) const {
+		if (entries.empty()) return false;
+		std::unordered_map<std::string, std::pair<size_t, size_t> >::const_iterator e = entries.find(entryName(path));
+		if (e == entries.end()) return false;
+		data = file.data + e->second.first;
+		length = e->second.second;
+		return true;
+	}
+
+	bool contains(const std::string &path) const {
+		const unsigned char *data;
+		size_t length;
+		return find(path, data, length);
+	}
+
+	static std::string entryName(const std::string &path) {
+		std::string name = path.substr(path.find_last_of("/\\") + 1);
+		std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+		return name;
+	}
+
+private:
+	MappedFile file;
+	std::unordered_map<std::string, std::pair<size_t, size_t> > entries;
+
+	AssetPack() {}
+
+	bool parseIndex() {
+		const unsigned char *base = file.data;
+		size_t size = file.size;
+		if (size < 16 || memcmp(base, "A1PK", 4) != 0) return false;
+		GLuint count;
+		unsigned long long at;
+		memcpy(&count, base + 4, 4);
+		memcpy(&at, base + 8, 8);
+		for (GLuint i = 0; i < count; ++i) {
+			GLuint length;
+			unsigned long long offset, bytes;
+			if (at + 4 > size) return false;
+			memcpy(&length, base + at, 4);
+			if (at + 4 + length + 16 > size) return false;
+			std::string name((const char*)base + at + 4, length);
+			memcpy(&offset, base + at + 4 + length, 8);
+			memcpy(&bytes, base + at + 12 + length, 8);
+			if (offset + bytes > size) return false;
+			entries[name] = std::make_pair((size_t)offset, (size_t)bytes);
+			at += 20 + length;
+		}
+		return true;
+	}
+};
+
+// The bytes of a file, pointing into AssetPack when it has the file and
+// into storage otherwise
+struct AssetData {
+	const unsigned char *data;
+	size_t size;
+	std::vector<unsigned char> storage;
+};
+
+bool readAsset(const std::string &path, AssetData &out) {
+	if (AssetPack::get().find(path, out.data, out.size)) return true;
+	std::ifstream file(path.c_str(), std::ios::binary);
+	out.storage.assign((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	out.data = out.storage.empty() ? NULL : &out.storage[0];
+	out.size = out.storage.size();
+	return file.good() || !out.storage.empty();
+}
+
+bool assetExists(const std::string &path) {
+	return AssetPack::get().contains(path) || std::ifstream(path.c_str()).good();
+}
+
+// RGBA8 pixels, top row first like SOIL returns them
+struct Image {
+	int width, height;
+	std::vector<unsigned char> pixels;
+};
+
+// Packed BGR (or BGRA with alpha) rows to RGBA. SSE2 does four pixels a
+// step from one 16 byte load, BGR ones shifted down into their own lanes.
+void convertBgrRow(const unsigned char *src, unsigned char *dst, int width, bool alpha) {
+	int stride = alpha ? 4 : 3;
+	int i = 0;
+#ifdef USE_SSE
+	const __m128i green = _mm_set1_epi32(0x0000ff00);
+	const __m128i low = _mm_set1_epi32(0x000000ff);
+	const __m128i high = _mm_set1_epi32(0xff000000);
+	if (alpha) {
+		for (; i + 4 <= width; i += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + i * 4));
+			__m128i rb = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), low), _mm_slli_epi32(_mm_and_si128(v, low), 16));
+			_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(rb, _mm_and_si128(v, _mm_or_si128(green, high))));
+		}
+	} else {
+		// 16 bytes are loaded for 12, so stop before that runs off the row
+		for (; i + 6 <= width; i += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + i * 3));
+			__m128i p01 = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3));
+			__m128i p23 = _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9));
+			v = _mm_unpacklo_epi64(p01, p23);
+			__m128i rb = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), low), _mm_slli_epi32(_mm_and_si128(v, low), 16));
+			_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(_mm_or_si128(rb, _mm_and_si128(v, green)), high));
+		}
+	}
+#endif
+	for (; i < width; ++i) {
+		dst[i * 4] = src[i * stride + 2];
+		dst[i * 4 + 1] = src[i * stride + 1];
+		dst[i * 4 + 2] = src[i * stride];
+		dst[i * 4 + 3] = alpha ? src[i * stride + 3] : 255;
+	}
+}
+
+// Scales RGBA pixels' colour by their alpha in place, rounded like c * a / 255
+void premultiplyRow(unsigned char *rgba, int width) {
+	int i = 0;
+#ifdef USE_SSE
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i half = _mm_set1_epi16(128);
+	const __m128i high = _mm_set1_epi32(0xff000000);
+	for (; i + 4 <= width; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(rgba + i * 4));
+		__m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+		__m128i aLo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		__m128i aHi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		lo = _mm_add_epi16(_mm_mullo_epi16(lo, aLo), half);
+		hi = _mm_add_epi16(_mm_mullo_epi16(hi, aHi), half);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+		__m128i out = _mm_packus_epi16(lo, hi);
+		out = _mm_or_si128(_mm_andnot_si128(high, out), _mm_and_si128(v, high));
+		_mm_storeu_si128((__m128i*)(rgba + i * 4), out);
+	}
+#endif
+	for (; i < width; ++i) {
+		unsigned char *p = rgba + i * 4;
+		for (int c = 0; c < 3; ++c) {
+			int t = p[c] * p[3] + 128;
+			p[c] = (unsigned char)((t + (t >> 8)) >> 8);
+		}
+	}
+}
+
+// The stb_image SOIL is built on. SOIL_load_image_from_memory wraps it but
+// keeps its result string in a global, these decode with no shared state
+// beyond stb's failure reason, which is copied out per thread right away.
+extern "C" {
+unsigned char *stbi_load_from_memory(const unsigned char *buffer, int len, int *x, int *y, int *comp, int req_comp);
+const char *stbi_failure_reason(void);
+void stbi_image_free(void *retval_from_stbi_load);
+}
+
+static THREAD_LOCAL const char *decodeFailure = NULL;
+
+// Why the calling thread's last decodeImage returned false
+const char *decodeError() {
+	return decodeFailure ? decodeFailure : "unknown";
+}
+
+// Uncompressed 24 and 32 bit BMPs are converted here, row by row with the
+// bottom up ones flipped on the way, everything else goes through stb_image.
+// premultiply scales colour by alpha in images that have an alpha channel.
+bool decodeImage(const unsigned char *data, size_t size, Image &out, bool premultiply = false) {
+	if (size >= 54 && data[0] == 'B' && data[1] == 'M') {
+		GLuint offset, compression;
+		int width, height;
+		unsigned short bpp;
+		memcpy(&offset, data + 10, 4);
+		memcpy(&width, data + 18, 4);
+		memcpy(&height, data + 22, 4);
+		memcpy(&bpp, data + 28, 2);
+		memcpy(&compression, data + 30, 4);
+		bool bottomUp = height > 0;
+		height = std::abs(height);
+		size_t pitch = ((size_t)width * (bpp / 8) + 3) & ~(size_t)3;
+		if ((bpp == 24 || bpp == 32) && compression == 0 && width > 0
+			&& offset + pitch * height <= size) {
+			out.width = width;
+			out.height = height;
+			out.pixels.resize((size_t)width * height * 4);
+			for (int y = 0; y < height; ++y) {
+				const unsigned char *row = data + offset + pitch * (bottomUp ? height - 1 - y : y);
+				convertBgrRow(row, &out.pixels[(size_t)y * width * 4], width, bpp == 32);
+				if (premultiply && bpp == 32) premultiplyRow(&out.pixels[(size_t)y * width * 4], width);
+			}
+			return true;
+		}
+	}
+	int channels;
+	unsigned char *image = size ? stbi_load_from_memory(data, (int)size, &out.width, &out.height, &channels, 4) : NULL;
+	if (!image) {
+		decodeFailure = size ? stbi_failure_reason() : "empty file";
+		return false;
+	}
+	out.pixels.assign(image, image + (size_t)out.width * out.height * 4);
+	stbi_image_free(image);
+	if (premultiply && (channels == 2 || channels == 4)) {
+		premultiplyRow(&out.pixels[0], out.width * out.height);
+	}
+	return true;
+}
+
+// Box filters RGBA pixels down one mip level
+std::vector<unsigned char> halveImage(const std::vector<unsigned char> &pixels, int width, int height) {
+	int w = std::max(width / 2, 1), h = std::max(height / 2, 1);
+	std::vector<unsigned char> out((size_t)w * h * 4);
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			int x0 = std::min(x * 2, width - 1), x1 = std::min(x * 2 + 1, width - 1);
+			int y0 = std::min(y * 2, height - 1), y1 = std::min(y * 2 + 1, height - 1);
+			for (int c = 0; c < 4; ++c) {
+				int sum = pixels[((size_t)y0 * width + x0) * 4 + c] + pixels[((size_t)y0 * width + x1) * 4 + c]
+					+ pixels[((size_t)y1 * width + x0) * 4 + c] + pixels[((size_t)y1 * width + x1) * 4 + c];
+				out[((size_t)y * w + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+			}
+		}
+	}
+	return out;
+}
+
+bool decodeImageFile(const std::string &path, Image &out) {
+	AssetData asset;
+	readAsset(path, asset);
+	return decodeImage(asset.data, asset.size, out);
+}
+
+// Decoded images shared by canonical path while anyone holds them, so a
+// file listed for several cube faces is read and decoded once
+struct ImageCache {
+
+	static ImageCache &get() {
+		static ImageCache cache;
+		return cache;
+	}
+
+	// Null entries for files that failed to decode. Distinct files not
+	// already held are decoded in parallel.
+	std::vector<std::shared_ptr<Image> > loadAll(const std::vector<std::string> &paths) {
+		std::vector<std::string> keys(paths.size());
+		std::vector<std::string> missing;
+		std::unordered_map<std::string, std::shared_ptr<Image> > found;
+		for (GLuint i = 0; i < paths.size(); ++i) {
+			keys[i] = canonicalPath(paths[i]);
+			if (found.count(keys[i])) continue;
+			std::shared_ptr<Image> image = images[keys[i]].lock();
+			found[keys[i]] = image;
+			if (!image) missing.push_back(keys[i]);
+		}
+
+		std::vector<Image> decoded(missing.size());
+		std::vector<char> ok(missing.size());
+		std::vector<std::thread> workers;
+		for (GLuint i = 0; i < missing.size(); ++i) {
+			workers.push_back(std::thread(decodeInto, missing[i], &decoded[i], &ok[i]));
+		}
+		for (GLuint i = 0; i < workers.size(); ++i) {
+			workers[i].join();
+			if (!ok[i]) continue;
+			std::shared_ptr<Image> image(new Image());
+			std::swap(*image, decoded[i]);
+			images[missing[i]] = image;
+			found[missing[i]] = image;
+		}
+
+		std::vector<std::shared_ptr<Image> > result(paths.size());
+		for (GLuint i = 0; i < paths.size(); ++i) result[i] = found[keys[i]];
+		return result;
+	}
+
+private:
+	std::unordered_map<std::string, std::weak_ptr<Image> > images;
+
+	static void decodeInto(std::string path, Image *image, char *ok) {
+		PROFILE_THREAD();
+		PROFILE_ZONE("decodeImageFile");
+		*ok = decodeImageFile(path, *image);
+	}
+};
+
+// A block compressed image from a DDS file. data holds every face's
+// levels back to back, levelSizes the size of one face's levels.
+struct CompressedImage {
+	GLenum format;
+	int width, height, faces;
+	std::vector<GLuint> levelSizes;
+	std::vector<unsigned char> data;
+};
+
+static GLuint fourCC(const char *s) {
+	return s[0] | (s[1] << 8) | (s[2] << 16) | (s[3] << 24);
+}
+
+// Reads BC1 (DXT1), BC3 (DXT5) and, through the DX10 header, BC7 files
+bool readDds(const unsigned char *file, size_t fileSize, CompressedImage &out) {
+	if (fileSize < 128 || memcmp(file, "DDS ", 4) != 0) return false;
+	GLuint h[31];
+	memcpy(h, &file[4], sizeof(h));
+	size_t offset = 128;
+	GLuint blockBytes = 16;
+	if (h[20] == fourCC("DXT1")) {
+		out.format = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+		blockBytes = 8;
+	} else if (h[20] == fourCC("DXT5")) {
+		out.format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+	} else if (h[20] == fourCC("DX10") && fileSize >= 148) {
+		GLuint dxgi;
+		memcpy(&dxgi, &file[128], sizeof(dxgi));
+		offset = 148;
+		if (dxgi == 71 || dxgi == 72) {
+			out.format = dxgi == 71 ? GL_COMPRESSED_RGBA_S3TC_DXT1_EXT : GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT;
+			blockBytes = 8;
+		} else if (dxgi == 77 || dxgi == 78) {
+			out.format = dxgi == 77 ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT;
+		} else if (dxgi == 98 || dxgi == 99) {
+			out.format = dxgi == 98 ? GL_COMPRESSED_RGBA_BPTC_UNORM : GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM;
+		} else {
+			return false;
+		}
+	} else {
+		return false;
+	}
+
+	out.width = h[3];
+	out.height = h[2];
+	out.faces = (h[27] & 0x200) ? 6 : 1;
+	GLuint levels = (h[1] & 0x20000) && h[6] ? h[6] : 1;
+	out.levelSizes.clear();
+	size_t total = 0;
+	for (GLuint l = 0; l < levels; ++l) {
+		GLuint bw = std::max(((out.width >> l) + 3) / 4, 1), bh = std::max(((out.height >> l) + 3) / 4, 1);
+		out.levelSizes.push_back(bw * bh * blockBytes);
+		total += out.levelSizes.back();
+	}
+	total *= out.faces;
+	if (offset + total > fileSize) return false;
+	out.data.assign(file + offset, file + offset + total);
+	return true;
+}
+
+bool readDdsFile(const std::string &path, CompressedImage &out) {
+	AssetData asset;
+	readAsset(path, asset);
+	return readDds(asset.data, asset.size, out);
+}
+
+// The .dds next to path when a1.exe --encode has made one, otherwise path
+std::string compressedSibling(const std::string &path) {
+	size_t dot = path.find_last_of('.');
+	if (dot == std::string::npos || dot < path.find_last_of("/\\") + 1) return path;
+	std::string dds = path.substr(0, dot) + ".dds";
+	return assetExists(dds) ? dds : path;
+}
+
+// Decodes textures to RGBA on worker threads and uploads them from the GL
+// thread into immutable RGBA8 textures, through a ring of pixel buffer
+// slots that stays mapped when ARB_buffer_storage is there. DDS files skip
+// the decode and go up block compressed with their own mips.
+// With streaming on, every mip stays in memory and the GL texture behind
+// a name only holds the levels from the finest one requested down. Names
+// then map to the texture holding the current levels through resolve. Until a texture
+// is resident, resolve hands out a 1x1 placeholder in its place.
+struct TextureLoader {
+
+	struct Info {
+		double decodeMs;
+		size_t bytes;
+	};
+
+	static TextureLoader &get() {
+		static TextureLoader loader;
+		return loader;
+	}
+
+	~TextureLoader() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		jobReady.notify_all();
+		for (GLuint i = 0; i < workers.size(); ++i) {
+			workers[i].join();
+		}
+	}
+
+	// Takes over the encoded file in asset and returns the texture name it
+	// will be uploaded to. Pack backed assets are decoded in place. With
+	// premultiply, colour is scaled by alpha, reloads included.
+	GLuint load(AssetData &asset, bool premultiply = false) {
+		init();
+		GLuint id;
+		glGenTextures(1, &id);
+		pending[id] = ++serial;
+		if (premultiply) premultiplied.insert(id);
+		queue(id, asset);
+		return id;
+	}
+
+	// Decodes a new file for texture id, which keeps its old image until
+	// update() swaps the new one in behind the same name
+	void reload(GLuint id, AssetData &asset) {
+		init();
+		reloading[id] = ++serial;
+		queue(id, asset);
+	}
+
+	// True once after reloads were swapped in
+	bool takeReloaded() {
+		bool any = reloaded;
+		reloaded = false;
+		return any;
+	}
+
+	GLuint resolve(GLuint id) const {
+		if (!streamed.empty()) {
+			std::unordered_map<GLuint, Streamed>::const_iterator t = streamed.find(id);
+			if (t != streamed.end()) return t->second.physical;
+		}
+		if (!replaced.empty()) {
+			std::unordered_map<GLuint, GLuint>::const_iterator t = replaced.find(id);
+			if (t != replaced.end()) return t->second;
+		}
+		return pending.empty() || !pending.count(id) ? id : placeholder;
+	}
+
+	// Call before the first load. budget is in bytes of resident levels.
+	void setStreaming(bool enabled, size_t budget) {
+		streaming = enabled;
+		this->budget = budget;
+	}
+
+	// Asks for the level whose size matches a texture covering about pixels
+	// on screen. Levels coarser than asked stay resident anyway.
+	void request(GLuint id, float pixels) {
+		std::unordered_map<GLuint, Streamed>::iterator i = streamed.find(id);
+		if (i == streamed.end()) return;
+		Streamed &t = i->second;
+		GLint level = 0;
+		float size = (float)std::max(t.width, t.height);
+		while (level + 1 < (GLint)t.levels.size() && size * 0.5f >= pixels) {
+			size *= 0.5f;
+			level++;
+		}
+		t.wanted = t.lastUsed == frame ? std::min(t.wanted, level) : level;
+		t.lastUsed = frame;
+	}
+
+	// Uploads up to TEXTURE_STREAM_UPLOADS requested levels per call, making
+	// room by dropping the finest levels of the least recently requested
+	// textures. Textures requested this frame are never evicted, so when
+	// they alone fill the budget the finer levels wait.
+	void stream() {
+		GLuint uploads = 0;
+		for (std::unordered_map<GLuint, Streamed>::iterator i = streamed.begin();
+			i != streamed.end() && uploads < TEXTURE_STREAM_UPLOADS; ++i) {
+			Streamed &t = i->second;
+			if (t.lastUsed != frame || t.wanted >= t.base) continue;
+			size_t extra = levelBytes(t, t.wanted) - levelBytes(t, t.base);
+			while (residentBytes + extra > budget && evictOne());
+			if (residentBytes + extra > budget) continue;
+			makeResident(t, t.wanted);
+			uploads++;
+		}
+		while (residentBytes > budget && evictOne());
+		frame++;
+	}
+
+	size_t getResidentBytes() const {
+		return residentBytes;
+	}
+
+	bool isIdle() const {
+		return pending.empty() && reloading.empty();
+	}
+
+	// Uploads up to TEXTURE_UPLOADS_PER_FRAME decoded textures, returns how many
+	GLuint update() {
+		GLuint n = 0;
+		Result r;
+		while (n < TEXTURE_UPLOADS_PER_FRAME && pop(r, false)) {
+			n += upload(r) ? 1 : 0;
+		}
+		return n;
+	}
+
+	// Blocks until every texture is resident
+	void finish() {
+		Result r;
+		while (!pending.empty() && pop(r, true)) {
+			upload(r);
+		}
+	}
+
+	// Deletes the texture, a decode still in flight is dropped
+	void release(GLuint id) {
+		pending.erase(id);
+		reloading.erase(id);
+		premultiplied.erase(id);
+		forget(id);
+		std::unordered_map<GLuint, GLuint>::iterator r = replaced.find(id);
+		if (r != replaced.end()) {
+			glDeleteTextures(1, &r->second);
+			replaced.erase(r);
+		}
+		glDeleteTextures(1, &id);
+	}
+
+	// Zero until the texture is resident
+	Info getInfo(GLuint id) const {
+		std::unordered_map<GLuint, Info>::const_iterator i = info.find(id);
+		if (i != info.end()) return i->second;
+		Info none = { 0.0, 0 };
+		return none;
+	}
+
+	const Info &getTotals() const {
+		return totals;
+	}
+
+private:
+	struct Job {
+		GLuint id;
+		unsigned serial;
+		bool premultiply;
+		AssetData asset;
+	};
+
+	void queue(GLuint id, AssetData &asset) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			jobs.push_back(Job());
+			jobs.back().id = id;
+			jobs.back().serial = serial;
+			jobs.back().premultiply = premultiplied.count(id) > 0;
+			swapAsset(jobs.back().asset, asset);
+		}
+		jobReady.notify_one();
+	}
+
+	// Drops the streamed levels and the accounting of texture id
+	void forget(GLuint id) {
+		std::unordered_map<GLuint, Streamed>::iterator t = streamed.find(id);
+		if (t != streamed.end()) {
+			residentBytes -= levelBytes(t->second, t->second.base);
+			glDeleteTextures(1, &t->second.physical);
+			streamed.erase(t);
+		}
+		std::unordered_map<GLuint, Info>::iterator i = info.find(id);
+		if (i != info.end()) {
+			totals.bytes -= i->second.bytes;
+			info.erase(i);
+		}
+	}
+
+	// Swapping storage keeps data pointing into it
+	static void swapAsset(AssetData &a, AssetData &b) {
+		std::swap(a.data, b.data);
+		std::swap(a.size, b.size);
+		a.storage.swap(b.storage);
+	}
+
+	// format is 0 for RGBA8 pixels, else the compressed format of levelSizes.
+	// RGBA8 results have levelSizes only when streaming.
+	struct Result {
+		GLuint id;
+		unsigned serial;
+		int width, height;
+		double decodeMs;
+		GLenum format;
+		std::vector<GLuint> levelSizes;
+		std::vector<unsigned char> pixels;
+	};
+
+	// Every level kept in memory, levels base and down live in physical
+	struct Streamed {
+		GLuint physical;
+		GLenum format;
+		int width, height;
+		std::vector<std::vector<unsigned char> > levels;
+		GLint base, coarsest, wanted;
+		unsigned lastUsed;
+	};
+
+	std::vector<std::thread> workers;
+	bool streaming;
+	std::mutex mutex;
+	std::condition_variable jobReady, resultReady;
+	std::deque<Job> jobs;
+	std::deque<Result> results;
+	bool quit;
+
+	// GL thread only from here on
+	std::unordered_map<GLuint, unsigned> pending, reloading;
+	std::set<GLuint> premultiplied;
+	// Reloaded textures, by the name everyone holds
+	std::unordered_map<GLuint, GLuint> replaced;
+	bool reloaded;
+	std::unordered_map<GLuint, Info> info;
+	Info totals;
+	unsigned serial;
+	GLuint placeholder, pbo;
+	unsigned char *mapped;
+	std::vector<GLsync> fences;
+	GLuint nextSlot;
+	std::unordered_map<GLuint, Streamed> streamed;
+	size_t budget, residentBytes;
+	unsigned frame;
+
+	TextureLoader() : streaming(false), quit(false), reloaded(false), serial(0), placeholder(0), pbo(0), mapped(NULL), nextSlot(0),
+		budget(0), residentBytes(0), frame(0) {
+		totals.decodeMs = 0.0;
+		totals.bytes = 0;
+	}
+
+	void init() {
+		if (placeholder) return;
+		const unsigned char grey[4] = { 128, 128, 128, 255 };
+		glGenTextures(1, &placeholder);
+		glBindTexture(GL_TEXTURE_2D, placeholder);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, 1, 1);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		GLsizeiptr size = (GLsizeiptr)TEXTURE_UPLOAD_SLOTS * TEXTURE_UPLOAD_SLOT_BYTES;
+		glGenBuffers(1, &pbo);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+		bool persistent = GLEW_ARB_buffer_storage != 0;
+#if GL_CAPTURE
+		// A capture can't see writes through a persistent mapping
+		if (GlCapture::recording) persistent = false;
+#endif
+		if (persistent) {
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+			mapped = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+		} else {
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		fences.assign(TEXTURE_UPLOAD_SLOTS, (GLsync)0);
+
+		GLuint n = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+		for (GLuint i = 0; i < n; ++i) {
+			workers.push_back(std::thread(&TextureLoader::work, this));
+		}
+	}
+
+	void work() {
+		for (;;) {
+			Job job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				while (!quit && jobs.empty()) jobReady.wait(lock);
+				if (quit) return;
+				job.id = jobs.front().id;
+				job.serial = jobs.front().serial;
+				swapAsset(job.asset, jobs.front().asset);
+				jobs.pop_front();
+			}
+			PROFILE_ZONE("decode texture");
+			Result r;
+			r.id = job.id;
+			r.serial = job.serial;
+			r.width = r.height = 0;
+			r.format = 0;
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			CompressedImage dds;
+			if (readDds(job.asset.data, job.asset.size, dds)) {
+				r.width = dds.width;
+				r.height = dds.height;
+				r.format = dds.format;
+				r.levelSizes.swap(dds.levelSizes);
+				r.pixels.swap(dds.data);
+			} else {
+				Image image;
+				if (decodeImage(job.asset.data, job.asset.size, image, job.premultiply)) {
+					r.width = image.width;
+					r.height = image.height;
+					r.pixels.swap(image.pixels);
+				} else {
+					std::cerr << "can't decode texture " << job.id << ": " << decodeError() << std::endl;
+				}
+				// Streaming needs every level up front, one after another
+				if (streaming && r.width) {
+					std::vector<unsigned char> level = r.pixels;
+					int w = r.width, h = r.height;
+					r.levelSizes.push_back(level.size());
+					while (w > 1 || h > 1) {
+						level = halveImage(level, w, h);
+						w = std::max(w / 2, 1);
+						h = std::max(h / 2, 1);
+						r.levelSizes.push_back(level.size());
+						r.pixels.insert(r.pixels.end(), level.begin(), level.end());
+					}
+				}
+			}
+			r.decodeMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				results.push_back(Result());
+				std::swap(results.back(), r);
+			}
+			resultReady.notify_one();
+		}
+	}
+
+	bool pop(Result &r, bool wait) {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (wait && results.empty()) resultReady.wait(lock);
+		if (results.empty()) return false;
+		std::swap(r, results.front());
+		results.pop_front();
+		return true;
+	}
+
+	// False for textures released while they were decoding and for reloads
+	// that failed to decode, which keep the image they had
+	bool upload(const Result &r) {
+		std::unordered_map<GLuint, unsigned>::iterator p = pending.find(r.id);
+		bool reload = p == pending.end() || p->second != r.serial;
+		if (reload) {
+			p = reloading.find(r.id);
+			if (p == reloading.end() || p->second != r.serial) return false;
+			reloading.erase(p);
+			if (!r.width) return false;
+			forget(r.id);
+			reloaded = true;
+		} else {
+			pending.erase(p);
+		}
+		if (streaming && r.width) {
+			addStreamed(r);
+			return true;
+		}
+
+		const unsigned char grey[4] = { 128, 128, 128, 255 };
+		bool compressed = r.format != 0 && r.width;
+		GLsizei width = r.width ? r.width : 1, height = r.height ? r.height : 1;
+		const unsigned char *pixels = r.width ? &r.pixels[0] : grey;
+		size_t size = r.width ? r.pixels.size() : 4;
+		GLint levels = 1;
+		if (compressed) {
+			levels = r.levelSizes.size();
+		} else {
+			while ((width | height) >> levels) levels++;
+		}
+
+		// Storage is immutable, so a reload goes into a new texture
+		GLuint target = r.id;
+		if (reload) glGenTextures(1, &target);
+		glBindTexture(GL_TEXTURE_2D, target);
+		glTexStorage2D(GL_TEXTURE_2D, levels, compressed ? r.format : GL_RGBA8, width, height);
+		GLint slot;
+		const unsigned char *src = stage(pixels, size, slot);
+		if (compressed) {
+			for (GLint l = 0; l < levels; ++l) {
+				glCompressedTexSubImage2D(GL_TEXTURE_2D, l, 0, 0, std::max(width >> l, 1), std::max(height >> l, 1),
+					r.format, r.levelSizes[l], src);
+				src += r.levelSizes[l];
+			}
+		} else {
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, src);
+		}
+		unstage(slot);
+		if (!compressed) {
+			glGenerateMipmap(GL_TEXTURE_2D);
+		}
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		if (reload) {
+			GLuint &alias = replaced[r.id];
+			if (alias) glDeleteTextures(1, &alias);
+			alias = target;
+		}
+
+		// Compressed files carry their mips, otherwise add a third for them
+		Info i = { r.decodeMs, compressed ? size : size * 4 / 3 };
+		info[r.id] = i;
+		totals.decodeMs += i.decodeMs;
+		totals.bytes += i.bytes;
+		return true;
+	}
+
+	// Copies pixels into the next pbo slot, binds the pbo and returns the
+	// offset to pass as pixels. Pixels that do not fit a slot come back as
+	// they are with slot -1.
+	const unsigned char *stage(const unsigned char *pixels, size_t size, GLint &slot) {
+		slot = -1;
+		if (size > TEXTURE_UPLOAD_SLOT_BYTES) return pixels;
+		slot = nextSlot;
+		nextSlot = (nextSlot + 1) % TEXTURE_UPLOAD_SLOTS;
+		if (fences[slot]) {
+			while (glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+			glDeleteSync(fences[slot]);
+		}
+		GLintptr offset = (GLintptr)slot * TEXTURE_UPLOAD_SLOT_BYTES;
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+		if (mapped) {
+			memcpy(mapped + offset, pixels, size);
+		} else {
+			void *dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, offset, size,
+				GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+			memcpy(dst, pixels, size);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		return (const unsigned char*)offset;
+	}
+
+	// Fences the slot once the uploads reading it are issued
+	void unstage(GLint slot) {
+		if (slot < 0) return;
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	void addStreamed(const Result &r) {
+		Streamed t;
+		t.physical = 0;
+		t.format = r.format;
+		t.width = r.width;
+		t.height = r.height;
+		size_t offset = 0, total = 0;
+		t.levels.resize(r.levelSizes.size());
+		for (GLuint l = 0; l < r.levelSizes.size(); ++l) {
+			t.levels[l].assign(r.pixels.begin() + offset, r.pixels.begin() + offset + r.levelSizes[l]);
+			offset += r.levelSizes[l];
+			total += r.levelSizes[l];
+		}
+		// Start from the first level no larger than TEXTURE_STREAM_MIN_SIZE
+		t.coarsest = 0;
+		while (t.coarsest + 1 < (GLint)t.levels.size()
+			&& std::max(t.width >> t.coarsest, t.height >> t.coarsest) > TEXTURE_STREAM_MIN_SIZE) {
+			t.coarsest++;
+		}
+		t.base = t.levels.size();
+		t.wanted = t.coarsest;
+		t.lastUsed = frame;
+		Streamed &added = streamed[r.id];
+		std::swap(added, t);
+		makeResident(added, added.coarsest);
+
+		Info i = { r.decodeMs, total };
+		info[r.id] = i;
+		totals.decodeMs += i.decodeMs;
+		totals.bytes += i.bytes;
+	}
+
+	static size_t levelBytes(const Streamed &t, GLint base) {
+		size_t bytes = 0;
+		for (GLuint l = base; l < t.levels.size(); ++l) bytes += t.levels[l].size();
+		return bytes;
+	}
+
+	// Replaces the texture behind t by one holding levels base and down
+	void makeResident(Streamed &t, GLint base) {
+		GLint count = t.levels.size() - base;
+		GLsizei width = std::max(t.width >> base, 1), height = std::max(t.height >> base, 1);
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexStorage2D(GL_TEXTURE_2D, count, t.format ? t.format : GL_RGBA8, width, height);
+		// All the levels go through one slot
+		std::vector<unsigned char> pixels;
+		for (GLint l = 0; l < count; ++l) {
+			pixels.insert(pixels.end(), t.levels[base + l].begin(), t.levels[base + l].end());
+		}
+		GLint slot;
+		const unsigned char *src = stage(&pixels[0], pixels.size(), slot);
+		for (GLint l = 0; l < count; ++l) {
+			GLsizei w = std::max(width >> l, 1), h = std::max(height >> l, 1);
+			GLsizei size = t.levels[base + l].size();
+			if (t.format) {
+				glCompressedTexSubImage2D(GL_TEXTURE_2D, l, 0, 0, w, h, t.format, size, src);
+			} else {
+				glTexSubImage2D(GL_TEXTURE_2D, l, 0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, src);
+			}
+			src += size;
+		}
+		unstage(slot);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, count > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		if (t.physical) glDeleteTextures(1, &t.physical);
+		residentBytes += levelBytes(t, base);
+		residentBytes -= levelBytes(t, t.base);
+		t.physical = texture;
+		t.base = base;
+	}
+
+	// Drops the finest level of the least recently requested texture not
+	// requested this frame, false when there is none
+	bool evictOne() {
+		Streamed *victim = NULL;
+		for (std::unordered_map<GLuint, Streamed>::iterator i = streamed.begin(); i != streamed.end(); ++i) {
+			Streamed &t = i->second;
+			if (t.lastUsed == frame || t.base >= t.coarsest) continue;
+			if (!victim || t.lastUsed < victim->lastUsed) victim = &t;
+		}
+		if (!victim) return false;
+		makeResident(*victim, victim->base + 1);
+		return true;
+	}
+};
+
+// Per instance vertex attributes 3-11 (model matrix, tint, normal matrix,
+// material layer). Only gpu culling writes material, other draws set the
+// layer of the mesh as a constant attribute.
+struct InstanceData {
+	glm::mat4 model;
+	glm::vec4 tint;
+	glm::vec4 normal[3];
+	GLuint material[4];
+
+	static InstanceData make(const glm::mat4 &model, glm::vec4 tint) {
+		InstanceData d;
+		d.model = model;
+		d.tint = tint;
+		glm::mat3 n = glm::transpose(glm::inverse(glm::mat3(model)));
+		for (int i = 0; i < 3; ++i) {
+			d.normal[i] = glm::vec4(n[i], 0.0f);
+		}
+		d.material[0] = d.material[1] = d.material[2] = d.material[3] = 0;
+		return d;
+	}
+};
+
+// Copies the diffuse textures of registered meshes into one
+// GL_TEXTURE_2D_ARRAY per size and format. A mesh then draws with the array
+// of its size bound to MATERIAL_UNIT and its layer in vertex attribute 11,
+// so meshes with different textures can share a bind or a multi draw.
+// The source textures stay resident: a reload rebuilds the arrays from
+// them, and their GL names are the handles TextureCache shares and
+// TextureLoader reloads behind, so deleting one would let GL hand the
+// name to the next texture while meshes still hold it. Enabling
+// MATERIAL_ARRAYS therefore roughly doubles texture memory.
+struct MaterialSystem {
+
+	MaterialSystem() {}
+
+	~MaterialSystem() {
+		if (!arrays.empty()) glDeleteTextures(arrays.size(), &arrays[0]);
+	}
+
+	// Returns the material index of texture, valid once build has run
+	GLint add(GLuint texture) {
+		std::unordered_map<GLuint, GLint>::iterator it = index.find(texture);
+		if (it != index.end()) return it->second;
+		Material m = { texture, 0, 0, 0, 0, 0, 0 };
+		index[texture] = materials.size();
+		materials.push_back(m);
+		return materials.size() - 1;
+	}
+
+	// Forgets every material, for adding them all again before a build
+	void clear() {
+		materials.clear();
+		index.clear();
+	}
+
+	// The textures have to be resident, see TextureLoader
+	void build() {
+		if (!arrays.empty()) glDeleteTextures(arrays.size(), &arrays[0]);
+		arrays.clear();
+		std::map<std::pair<std::pair<GLint, GLint>, std::pair<GLint, GLint> >, GLuint> groups;
+		std::vector<GLuint> layers;
+		for (GLuint i = 0; i < materials.size(); ++i) {
+			Material &m = materials[i];
+			glBindTexture(GL_TEXTURE_2D, TextureLoader::get().resolve(m.texture));
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &m.width);
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &m.height);
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &m.format);
+			glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_IMMUTABLE_LEVELS, &m.levels);
+			glBindTexture(GL_TEXTURE_2D, 0);
+			std::pair<std::pair<GLint, GLint>, std::pair<GLint, GLint> > key(
+				std::make_pair(m.width, m.height), std::make_pair(m.format, m.levels));
+			if (!groups.count(key)) {
+				groups[key] = layers.size();
+				layers.push_back(0);
+			}
+			m.group = groups[key];
+			m.layer = layers[m.group]++;
+		}
+
+		arrays.resize(layers.size());
+		if (arrays.empty()) return;
+		glGenTextures(arrays.size(), &arrays[0]);
+		for (GLuint g = 0; g < arrays.size(); ++g) {
+			const Material *first = NULL;
+			for (GLuint i = 0; i < materials.size() && !first; ++i) {
+				if (materials[i].group == g) first = &materials[i];
+			}
+			GLint levels = std::max(first->levels, 1);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, arrays[g]);
+			glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, first->format, first->width, first->height, layers[g]);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			for (GLuint i = 0; i < materials.size(); ++i) {
+				const Material &m = materials[i];
+				if (m.group != g) continue;
+				for (GLint l = 0; l < levels; ++l) {
+					glCopyImageSubData(TextureLoader::get().resolve(m.texture), GL_TEXTURE_2D, l, 0, 0, 0,
+						arrays[g], GL_TEXTURE_2D_ARRAY, l, 0, 0, m.layer,
+						std::max(m.width >> l, 1), std::max(m.height >> l, 1), 1);
+				}
+			}
+		}
+		glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	}
+
+	bool isBuilt(GLint material) const {
+		return material >= 0 && (GLuint)material < materials.size() && !arrays.empty();
+	}
+
+	GLuint getArray(GLint material) const {
+		return arrays[materials[material].group];
+	}
+
+	GLuint getLayer(GLint material) const {
+		return materials[material].layer;
+	}
+
+	GLuint getArrayCount() const {
+		return arrays.size();
+	}
+
+	void bind(Shader shader, GLint material) const {
+		glActiveTexture(GL_TEXTURE0 + MATERIAL_UNIT);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, getArray(material));
+		glActiveTexture(GL_TEXTURE0);
+		glUniform1i(glGetUniformLocation(shader.getProgId(), "materialArray"), MATERIAL_UNIT);
+		glUniform1ui(glGetUniformLocation(shader.getProgId(), "useMaterialArray"), 1);
+		glVertexAttribI4ui(11, getLayer(material), 0, 0, 0);
+	}
+
+private:
+	struct Material {
+		GLuint texture;
+		GLint width, height, format, levels;
+		GLuint group, layer;
+	};
+
+	std::vector<Material> materials;
+	std::unordered_map<GLuint, GLint> index;
+	std::vector<GLuint> arrays;
+};
+
+class Mesh {
+public:
+    std::vector<Vertex> vertices;
+    std::vector<GLuint> indices;
+    std::vector<Texture> textures;
+	// Object space; the sphere sizes texture requests in TextureLoader
+	glm::vec3 boundsMin, boundsMax, sphereCenter;
+	float sphereRadius;
+	// Set by Model::setMaterials, otherwise textures are bound directly
+	const MaterialSystem *materials;
+	GLint material;
+
+	Mesh() : boundsMin(0.0f), boundsMax(0.0f), sphereCenter(0.0f), sphereRadius(0.0f),
+		materials(NULL), material(-1) {}
+
+    Mesh(std::vector<Vertex> vertices, std::vector<GLuint> indices, std::vector<Texture> textures)
+		: materials(NULL), material(-1) {
+		this->vertices = vertices;
+		this->computeAdjacency(indices);
+		this->textures = textures;
+		this->computeBounds();
+		this->setupMesh();
+	}
+
+	void computeBounds() {
+		boundsMin = glm::vec3(std::numeric_limits<float>::max());
+		boundsMax = glm::vec3(-std::numeric_limits<float>::max());
+		for (GLuint i = 0; i < vertices.size(); ++i) {
+			boundsMin = glm::min(boundsMin, vertices[i].Position);
+			boundsMax = glm::max(boundsMax, vertices[i].Position);
+		}
+		sphereCenter = (boundsMin + boundsMax) * 0.5f;
+		sphereRadius = 0.0f;
+		for (GLuint i = 0; i < vertices.size(); ++i) {
+			sphereRadius = std::max(sphereRadius, glm::length(vertices[i].Position - sphereCenter));
+		}
+	}
+	
+	// indirect >= 0 draws with that command of the bound GL_DRAW_INDIRECT_BUFFER
+    void Draw(Shader shader, Camera &camera, glm::mat4 &modelMatrix, bool isColor, GLint indirect = -1) {
+		Draw(shader, camera, InstanceData::make(modelMatrix, glm::vec4(1.0f)), isColor, indirect);
+	}
+
+	// The instance attributes are left disabled here, so the shaders read
+	// the transform and tint from these constant attribute values
+    void Draw(Shader shader, Camera &camera, const InstanceData &instance, bool isColor, GLint indirect = -1) {
+		PROFILE_ZONE("Mesh::Draw");
+		if (vertices.size() == 0) return;
+		bindTextures(shader, isColor);
+		setInstanceAttribs(instance);
+
+		glBindVertexArray(this->VAO);
+		camera.preDraw(shader, false);
+		if (indirect < 0) {
+			glDrawElements(GL_TRIANGLES_ADJACENCY, this->indices.size(), GL_UNSIGNED_INT, 0);
+		} else {
+			glDrawElementsIndirect(GL_TRIANGLES_ADJACENCY, GL_UNSIGNED_INT,
+				(GLvoid*)(indirect * 5 * sizeof(GLuint)));
+		}
+		glBindVertexArray(0);
+	}
+
+	// One draw for every instance in vbo, which holds count InstanceData
+	void DrawInstanced(Shader shader, Camera &camera, GLuint vbo, GLsizei count) {
+		PROFILE_ZONE("Mesh::DrawInstanced");
+		if (vertices.size() == 0 || count == 0) return;
+		bindTextures(shader, false);
+
+		glBindVertexArray(this->VAO);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		for (GLuint i = 0; i < 4; ++i) {
+			glEnableVertexAttribArray(3 + i);
+			glVertexAttribPointer(3 + i, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+				(GLvoid*)(offsetof(InstanceData, model) + i * sizeof(glm::vec4)));
+			glVertexAttribDivisor(3 + i, 1);
+		}
+		glEnableVertexAttribArray(7);
+		glVertexAttribPointer(7, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (GLvoid*)offsetof(InstanceData, tint));
+		glVertexAttribDivisor(7, 1);
+		for (GLuint i = 0; i < 3; ++i) {
+			glEnableVertexAttribArray(8 + i);
+			glVertexAttribPointer(8 + i, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+				(GLvoid*)(offsetof(InstanceData, normal) + i * sizeof(glm::vec4)));
+			glVertexAttribDivisor(8 + i, 1);
+		}
+
+		camera.preDraw(shader, false);
+		glDrawElementsInstanced(GL_TRIANGLES_ADJACENCY, this->indices.size(), GL_UNSIGNED_INT, 0, count);
+
+		for (GLuint i = 3; i < 11; ++i) {
+			glDisableVertexAttribArray(i);
+		}
+		glBindVertexArray(0);
+	}
+
+	void bindTextures(Shader shader, bool isColor) {
+		GLuint diffuseNr = 1;
+		GLuint specularNr = 1;
+		glUniform1ui(glGetUniformLocation(shader.getProgId(), "isColor"), isColor ? 1 : 0);
+		if (materials && materials->isBuilt(material)) {
+			materials->bind(shader, material);
+			return;
+		}
+		glUniform1ui(glGetUniformLocation(shader.getProgId(), "useMaterialArray"), 0);
+		for (GLuint i = 0; i < this->textures.size(); i++)
+		{
+			glActiveTexture(GL_TEXTURE0 + i);
+			std::stringstream ss;
+			std::string number;
+			std::string name = this->textures[i].type;
+			if(name == "texture_diffuse")
+				ss << diffuseNr++;
+			else if(name == "texture_specular")
+				ss << specularNr++;
+			number = ss.str(); 
+			glUniform1i(glGetUniformLocation(shader.getProgId(), ("material." + name + number).c_str()), i);
+ 			glBindTexture(GL_TEXTURE_2D, TextureLoader::get().resolve(this->textures[i].id));
+		}
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	static void setInstanceAttribs(const InstanceData &instance) {
+		for (GLuint i = 0; i < 4; ++i) {
+			glVertexAttrib4fv(3 + i, glm::value_ptr(instance.model[i]));
+		}
+		glVertexAttrib4fv(7, glm::value_ptr(instance.tint));
+		for (GLuint i = 0; i < 3; ++i) {
+			glVertexAttrib3fv(8 + i, glm::value_ptr(instance.normal[i]));
+		}
+	}
+
+	void computeAdjacency(std::vector<GLuint> indices) {
+		std::unordered_map<EdgeKeyValue, EdgeKeyValue> dict;
+
+		for (GLuint i = 0; i < indices.size(); i += 3) {
+			EdgeKeyValue ek1(indices[i], indices[i + 1]);
+			EdgeKeyValue ek2(indices[i + 1], indices[i + 2]);
+			EdgeKeyValue ek3(indices[i + 2], indices[i]);
+
+			dict[ek1].insert(indices[i + 2]);
+			dict[ek2].insert(indices[i]);
+			dict[ek3].insert(indices[i + 1]);
+		}
+
+		for (GLuint i = 0; i < indices.size(); i += 3) {
+			GLuint places[3][3] = {
+				i, i + 1, i + 2,
+				i + 1, i + 2, i,
+				i + 2, i, i + 1
+			};
+			for (GLuint j = 0; j < 3; ++j) {
+				EdgeKeyValue ek1(
+					indices[places[j][0]],
+					indices[places[j][1]]
+				);
+				EdgeKeyValue result = dict[ek1];
+				this->indices.push_back(indices[places[j][0]]);
+				GLuint middle = indices[places[j][2]] == result.getA() ? result.getB() : result.getA();
+				this->indices.push_back(middle == (GLuint)-1 ? indices[places[j][0]] : middle);
+			}
+		}
+	}
+
+    void setupMesh() {
+		glGenVertexArrays(1, &this->VAO);
+		glGenBuffers(1, &this->VBO);
+		glGenBuffers(1, &this->EBO);
+  
+		glBindVertexArray(this->VAO);
+		glBindBuffer(GL_ARRAY_BUFFER, this->VBO);
+		glBufferData(GL_ARRAY_BUFFER, this->vertices.size() * sizeof(Vertex), 
+						&this->vertices[0], GL_STATIC_DRAW);  
+
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->EBO);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, this->indices.size() * sizeof(GLuint), 
+						&this->indices[0], GL_STATIC_DRAW);
+
+		glEnableVertexAttribArray(0);	
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 
+								(GLvoid*)0);
+
+		glEnableVertexAttribArray(1);	
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 
+								(GLvoid*)offsetof(Vertex, Normal));
+
+		glEnableVertexAttribArray(2);	
+		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 
+								(GLvoid*)offsetof(Vertex, TexCoords));
+
+		glBindVertexArray(0);
+	}
+
+	// Deletes the GL buffers, setupMesh has to run again before drawing
+	void release() {
+		glDeleteVertexArrays(1, &this->VAO);
+		glDeleteBuffers(1, &this->VBO);
+		glDeleteBuffers(1, &this->EBO);
+		this->VAO = this->VBO = this->EBO = 0;
+	}
+	
+private:
+    GLuint VAO, VBO, EBO;
+
+}; 
+
+// Process wide cache of 2D textures keyed by canonical path and by a hash
+// of the file contents, so the same image is decoded and uploaded once
+// however many models or paths refer to it. Every acquire needs a release.
+struct TextureCache {
+
+	struct Stats {
+		GLuint hits, misses;
+		double decodeMs, savedDecodeMs;
+		size_t bytes, savedBytes;
+	};
+
+	static TextureCache &get() {
+		static TextureCache cache;
+		return cache;
+	}
+
+	// A premultiplied texture is cached apart from the same file without
+	GLuint acquire(const std::string &path, bool premultiply = false) {
+		std::string canonical = canonicalPath(path), key = premultiply ? canonical + "|premultiplied" : canonical;
+		std::unordered_map<std::string, unsigned long long>::iterator p = byPath.find(key);
+		if (p != byPath.end()) {
+			return hit(entries[p->second]);
+		}
+
+		AssetData data;
+		readAsset(canonical, data);
+		unsigned long long hash = fnv1a(data.data, data.size) ^ (premultiply ? 1 : 0);
+		byPath[key] = hash;
+		std::unordered_map<unsigned long long, Entry>::iterator e = entries.find(hash);
+		if (e != entries.end()) {
+			return hit(e->second);
+		}
+
+		if (!data.size) {
+			std::cerr << path << " not found" << std::endl;
+		}
+		LOAD_PROFILER(addCounts(canonical, data.size, 0, 0));
+		Entry entry = { TextureLoader::get().load(data, premultiply), 1, 0, canonical };
+		entries[hash] = entry;
+		byId[entry.id] = hash;
+		stats.misses++;
+		return entry.id;
+	}
+
+	// Decodes the file at canonical path again if a texture was made from it
+	// and its contents changed. The texture keeps its name.
+	bool reload(const std::string &canonical) {
+		bool plain = reload(canonical, canonical, false);
+		return reload(canonical + "|premultiplied", canonical, true) || plain;
+	}
+
+	// Deletes the texture once nothing holds it any more
+	void release(GLuint id) {
+		std::unordered_map<GLuint, unsigned long long>::iterator i = byId.find(id);
+		if (i == byId.end()) return;
+		unsigned long long hash = i->second;
+		Entry &e = entries[hash];
+		if (--e.refs > 0) return;
+		TextureLoader::Info info = TextureLoader::get().getInfo(e.id);
+		stats.savedDecodeMs += e.hits * info.decodeMs;
+		stats.savedBytes += e.hits * info.bytes;
+		TextureLoader::get().release(e.id);
+		entries.erase(hash);
+		byId.erase(i);
+		for (std::unordered_map<std::string, unsigned long long>::iterator p = byPath.begin(); p != byPath.end();) {
+			if (p->second == hash) p = byPath.erase(p);
+			else ++p;
+		}
+	}
+
+#if LOAD_PROFILING
+	// Decode times of every texture and what its cache hits saved, call
+	// once TextureLoader is idle
+	void addToProfile() const {
+		for (std::unordered_map<unsigned long long, Entry>::const_iterator e = entries.begin(); e != entries.end(); ++e) {
+			double ms = TextureLoader::get().getInfo(e->second.id).decodeMs;
+			LoadProfiler::get().addMs(e->second.path, "decode", ms);
+			if (e->second.hits) LoadProfiler::get().addMs(e->second.path, "decode saved by cache", e->second.hits * ms);
+		}
+	}
+#endif
+
+	// Hits are charged what their texture cost once it has loaded, so
+	// a hit on a texture still in flight counts in full when it lands
+	Stats getStats() const {
+		Stats s = stats;
+		s.decodeMs = TextureLoader::get().getTotals().decodeMs;
+		s.bytes = TextureLoader::get().getTotals().bytes;
+		for (std::unordered_map<unsigned long long, Entry>::const_iterator e = entries.begin(); e != entries.end(); ++e) {
+			TextureLoader::Info info = TextureLoader::get().getInfo(e->second.id);
+			s.savedDecodeMs += e->second.hits * info.decodeMs;
+			s.savedBytes += e->second.hits * info.bytes;
+		}
+		return s;
+	}
+
+	void printStats() const {
+		Stats s = getStats();
+		std::cout << "texture cache: " << s.hits << " hits, " << s.misses << " misses, saved "
+			<< s.savedDecodeMs << " ms decode, " << s.savedBytes / 1024 << " KB VRAM" << std::endl;
+	}
+
+private:
+	struct Entry {
+		GLuint id, refs, hits;
+		std::string path;
+	};
+
+	std::unordered_map<std::string, unsigned long long> byPath;
+	std::unordered_map<unsigned long long, Entry> entries;
+	std::unordered_map<GLuint, unsigned long long> byId;
+	Stats stats;
+
+	TextureCache() {
+		Stats s = { 0, 0, 0.0, 0.0, 0, 0 };
+		stats = s;
+	}
+
+	// One of the textures made from canonical, cached under key
+	bool reload(const std::string &key, const std::string &canonical, bool premultiply) {
+		std::unordered_map<std::string, unsigned long long>::iterator p = byPath.find(key);
+		if (p == byPath.end()) return false;
+		AssetData data;
+		readAsset(canonical, data);
+		unsigned long long old = p->second, hash = fnv1a(data.data, data.size) ^ (premultiply ? 1 : 0);
+		if (!data.size || hash == old) return false;
+		Entry entry = entries[old];
+		// Content matching another texture stays under its old hash
+		if (!entries.count(hash)) {
+			entries.erase(old);
+			entries[hash] = entry;
+			byId[entry.id] = hash;
+			for (p = byPath.begin(); p != byPath.end(); ++p) {
+				if (p->second == old) p->second = hash;
+			}
+		}
+		TextureLoader::get().reload(entry.id, data);
+		return true;
+	}
+
+	GLuint hit(Entry &e) {
+		e.refs++;
+		e.hits++;
+		stats.hits++;
+		return e.id;
+	}
+
+	static unsigned long long fnv1a(const unsigned char *data, size_t size) {
+		unsigned long long h = 14695981039346656037ULL;
+		for (size_t i = 0; i < size; ++i) {
+			h = (h ^ data[i]) * 1099511628211ULL;
+		}
+		return h;
+	}
+};
+
+// Returns a texture from TextureCache, release it with TextureCache::get().release.
+// Bind it through TextureLoader::get().resolve while it may still be loading.
+GLint TextureFromFile(const char* path, std::string directory, bool premultiply = false)
+{
+    std::string filename = std::string(path);
+    filename = compressedSibling(directory + '/' + filename);
+	LOAD_ASSET_TIMER("TextureFromFile", canonicalPath(filename));
+    return TextureCache::get().acquire(filename, premultiply);
+}
+
+struct InstanceBuffer {
+	std::vector<InstanceData> instances;
+
+	InstanceBuffer() : vbo(0), version(0) {}
+
+	~InstanceBuffer() {
+		if (vbo) glDeleteBuffers(1, &vbo);
+	}
+
+	void add(const glm::mat4 &model, glm::vec4 tint) {
+		instances.push_back(InstanceData::make(model, tint));
+	}
+
+	void upload() {
+		if (!vbo) glGenBuffers(1, &vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(InstanceData),
+			instances.empty() ? NULL : &instances[0], GL_STATIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		version++;
+	}
+
+	GLuint getVbo() const {
+		return vbo;
+	}
+
+	unsigned getVersion() const {
+		return version;
+	}
+
+private:
+	GLuint vbo;
+	unsigned version;
+};
+
+// Matches MeshBounds in occlusion.comp (std430)
+struct MeshBoundsGPU {
+	glm::vec4 center, extents;
+	GLuint info[4];
+};
+
+// Native OBJ/MTL loader, used by Model for .obj files when NATIVE_OBJ is
+// set. The file is mapped and cut into line aligned chunks. A first pass
+// counts the v/vt/vn lines of every chunk so each knows where its elements
+// land, a second parses the chunks on threads, then the meshes are welded
+// and given smooth normals on threads too. The result matches Assimp with
+// Triangulate, FlipUVs, GenSmoothNormals and JoinIdenticalVertices, except
+// that there is one mesh per usemtl material instead of per object.
+
+struct ObjMaterial {
+	std::string diffuse, specular;
+};
+
+struct ObjMesh {
+	std::string material;
+	std::vector<Vertex> vertices;
+	std::vector<GLuint> indices;
+};
+
+struct ObjData {
+	std::vector<ObjMesh> meshes;
+	std::unordered_map<std::string, ObjMaterial> materials;
+	// Paths of the mtllib files read
+	std::vector<std::string> libraries;
+};
+
+struct ObjChunk {
+	const char *begin, *end;
+	// First v/vt/vn index of the chunk and how many it has
+	size_t first[3], count[3];
+	// Triangle corners as position, uv, normal index triples (-1 if absent)
+	std::vector<int> corners;
+	// usemtl lines as (offset into corners, material)
+	std::vector<std::pair<size_t, std::string> > switches;
+	std::vector<std::string> libraries;
+};
+
+// Corners of the chunks that make up one mesh, as (chunk, begin, end)
+struct ObjGroup {
+	std::string material;
+	std::vector<std::pair<size_t, std::pair<size_t, size_t> > > ranges;
+};
+
+struct ObjSource {
+	std::vector<glm::vec3> positions, normals;
+	std::vector<glm::vec2> uvs;
+	std::vector<ObjChunk> chunks;
+	std::vector<ObjGroup> groups;
+	bool flipWinding;
+};
+
+// Threads every model's OBJ passes share, so models parsing at once queue
+// their chunks rather than each starting threads of its own. The caller
+// of run() works through its own jobs too, so a full pool never stalls it.
+struct WorkerPool {
+
+	static WorkerPool &get() {
+		static WorkerPool pool;
+		return pool;
+	}
+
+	~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		jobReady.notify_all();
+		for (GLuint i = 0; i < workers.size(); ++i) {
+			workers[i].join();
+		}
+	}
+
+	// Returns once every job has run
+	void run(const std::vector<std::function<void()> > &jobs) {
+		if (jobs.empty()) return;
+		Batch batch(jobs);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			batches.push_back(&batch);
+		}
+		jobReady.notify_all();
+		for (size_t i = batch.next++; i < jobs.size(); i = batch.next++) {
+			jobs[i]();
+			std::lock_guard<std::mutex> lock(mutex);
+			batch.done++;
+		}
+		std::unique_lock<std::mutex> lock(mutex);
+		std::deque<Batch*>::iterator queued = std::find(batches.begin(), batches.end(), &batch);
+		if (queued != batches.end()) batches.erase(queued);
+		while (batch.done < jobs.size()) batchDone.wait(lock);
+	}
+
+private:
+	struct Batch {
+		Batch(const std::vector<std::function<void()> > &jobs) : jobs(jobs), next(0), done(0) {}
+		const std::vector<std::function<void()> > &jobs;
+		std::atomic<size_t> next;
+		// Guarded by the pool's mutex
+		size_t done;
+	};
+
+	std::vector<std::thread> workers;
+	std::deque<Batch*> batches;
+	std::mutex mutex;
+	std::condition_variable jobReady, batchDone;
+	bool quit;
+
+	WorkerPool() : quit(false) {
+		GLuint n = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+		for (GLuint i = 0; i < n; ++i) {
+			workers.push_back(std::thread(&WorkerPool::work, this));
+		}
+	}
+
+	// A batch stays alive while it is queued, and past that until its
+	// claimed jobs are done
+	void work() {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			while (!quit && batches.empty()) jobReady.wait(lock);
+			if (quit) return;
+			Batch *batch = batches.front();
+			size_t i = batch->next++;
+			if (i >= batch->jobs.size()) {
+				batches.pop_front();
+				continue;
+			}
+			lock.unlock();
+			batch->jobs[i]();
+			lock.lock();
+			if (++batch->done == batch->jobs.size()) batchDone.notify_all();
+		}
+	}
+
+	WorkerPool(const WorkerPool &);
+	WorkerPool &operator=(const WorkerPool &);
+};
+
+// Length of the run of digits at p, 16 bytes at a time with SSE2
+inline size_t objDigits(const char *p, const char *end) {
+	size_t n = 0;
+#ifdef USE_SSE
+	const __m128i zero = _mm_set1_epi8('0'), nine = _mm_set1_epi8(9);
+	while ((size_t)(end - p) - n >= 16) {
+		__m128i d = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(p + n)), zero);
+		int other = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(d, nine), d)) & 0xffff;
+		if (other) {
+			while (!(other & 1)) {
+				other >>= 1;
+				++n;
+			}
+			return n;
+		}
+		n += 16;
+	}
+#endif
+	while (p + n < end && (unsigned)(p[n] - '0') <= 9) ++n;
+	return n;
+}
+
+inline void objSkipSpace(const char *&p, const char *end) {
+	while (p < end && (*p == ' ' || *p == '\t')) ++p;
+}
+
+// Decimal to float without strtod's locale lookups
+float objFloat(const char *&p, const char *end) {
+	static const double powers[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	objSkipSpace(p, end);
+	bool negative = p < end && *p == '-';
+	if (p < end && (*p == '-' || *p == '+')) ++p;
+	unsigned long long mantissa = 0;
+	int exponent = 0;
+	size_t n = objDigits(p, end);
+	for (size_t i = 0; i < n; ++i) {
+		// Past 18 digits only the magnitude matters
+		if (mantissa < 100000000000000000ULL) mantissa = mantissa * 10 + (p[i] - '0');
+		else ++exponent;
+	}
+	p += n;
+	if (p < end && *p == '.') {
+		++p;
+		n = objDigits(p, end);
+		for (size_t i = 0; i < n; ++i) {
+			if (mantissa < 100000000000000000ULL) {
+				mantissa = mantissa * 10 + (p[i] - '0');
+				--exponent;
+			}
+		}
+		p += n;
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		++p;
+		bool negativeExponent = p < end && *p == '-';
+		if (p < end && (*p == '-' || *p == '+')) ++p;
+		int e = 0;
+		for (; p < end && (unsigned)(*p - '0') <= 9; ++p) {
+			if (e < 1000) e = e * 10 + (*p - '0');
+		}
+		exponent += negativeExponent ? -e : e;
+	}
+	double value = (double)mantissa;
+	if (exponent < 0) value = exponent >= -22 ? value / powers[-exponent] : value * std::pow(10.0, exponent);
+	else if (exponent > 0) value = exponent <= 22 ? value * powers[exponent] : value * std::pow(10.0, exponent);
+	return (float)(negative ? -value : value);
+}
+
+// One index of an f corner made zero based, count is how many elements of
+// its kind came before for negative (relative) indices
+int objIndex(const char *&p, const char *end, size_t count) {
+	bool negative = p < end && *p == '-';
+	if (negative) ++p;
+	size_t n = objDigits(p, end);
+	long long value = 0;
+	for (size_t i = 0; i < n && i < 12; ++i) value = value * 10 + (p[i] - '0');
+	p += n;
+	if (n == 0) return -1;
+	long long index = negative ? (long long)count - value : value - 1;
+	return index < 0 || index > INT_MAX ? -1 : (int)index;
+}
+
+// Rest of the line after a keyword, trimmed
+std::string objName(const char *p, const char *end) {
+	objSkipSpace(p, end);
+	while (end > p && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) --end;
+	return std::string(p, end);
+}
+
+inline const char *objLineEnd(const char *p, const char *end) {
+	const char *eol = (const char*)memchr(p, '\n', end - p);
+	return eol ? eol : end;
+}
+
+inline bool objKeyword(const char *p, const char *eol, const char *word, size_t length) {
+	return (size_t)(eol - p) > length && memcmp(p, word, length) == 0 && (p[length] == ' ' || p[length] == '\t');
+}
+
+void objCount(ObjChunk *chunk) {
+	PROFILE_ZONE("objCount");
+	for (const char *p = chunk->begin; p < chunk->end; ) {
+		const char *eol = objLineEnd(p, chunk->end);
+		objSkipSpace(p, eol);
+		if (eol - p > 2 && p[0] == 'v') {
+			if (p[1] == ' ' || p[1] == '\t') chunk->count[0]++;
+			else if (p[1] == 't' && (p[2] == ' ' || p[2] == '\t')) chunk->count[1]++;
+			else if (p[1] == 'n' && (p[2] == ' ' || p[2] == '\t')) chunk->count[2]++;
+		}
+		p = eol + 1;
+	}
+}
+
+void objParse(ObjSource *source, ObjChunk *chunk) {
+	PROFILE_ZONE("objParse");
+	size_t seen[3] = {chunk->first[0], chunk->first[1], chunk->first[2]};
+	std::vector<int> face;
+	for (const char *p = chunk->begin; p < chunk->end; ) {
+		const char *eol = objLineEnd(p, chunk->end);
+		objSkipSpace(p, eol);
+		if (eol - p > 2 && p[0] == 'v') {
+			const char *q = p + 2;
+			if (p[1] == ' ' || p[1] == '\t') {
+				q = p + 1;
+				float x = objFloat(q, eol), y = objFloat(q, eol), z = objFloat(q, eol);
+				source->positions[seen[0]++] = glm::vec3(x, y, z);
+			} else if (p[1] == 't' && (p[2] == ' ' || p[2] == '\t')) {
+				float u = objFloat(q, eol), v = objFloat(q, eol);
+				source->uvs[seen[1]++] = glm::vec2(u, v);
+			} else if (p[1] == 'n' && (p[2] == ' ' || p[2] == '\t')) {
+				float x = objFloat(q, eol), y = objFloat(q, eol), z = objFloat(q, eol);
+				source->normals[seen[2]++] = glm::vec3(x, y, z);
+			}
+		} else if (objKeyword(p, eol, "f", 1)) {
+			face.clear();
+			for (const char *q = p + 1; ; ) {
+				objSkipSpace(q, eol);
+				if (q >= eol || *q == '\r') break;
+				int v = objIndex(q, eol, seen[0]), t = -1, n = -1;
+				if (q < eol && *q == '/') {
+					++q;
+					t = objIndex(q, eol, seen[1]);
+					if (q < eol && *q == '/') {
+						++q;
+						n = objIndex(q, eol, seen[2]);
+					}
+				}
+				face.push_back(v);
+				face.push_back(t);
+				face.push_back(n);
+				while (q < eol && *q != ' ' && *q != '\t' && *q != '\r') ++q;
+			}
+			// Polygons as fans
+			for (size_t k = 2; k < face.size() / 3; ++k) {
+				chunk->corners.insert(chunk->corners.end(), face.begin(), face.begin() + 3);
+				chunk->corners.insert(chunk->corners.end(), face.begin() + (k - 1) * 3, face.begin() + (k + 1) * 3);
+			}
+		} else if (objKeyword(p, eol, "usemtl", 6)) {
+			chunk->switches.push_back(std::make_pair(chunk->corners.size(), objName(p + 6, eol)));
+		} else if (objKeyword(p, eol, "mtllib", 6)) {
+			chunk->libraries.push_back(objName(p + 6, eol));
+		}
+		p = eol + 1;
+	}
+}
+
+// Open addressing from an index triple to the first vertex made from it,
+// the keys kept per vertex so the table itself is one index per slot
+struct ObjWeld {
+
+	std::vector<int> keys;
+
+	ObjWeld(size_t expected) {
+		size_t capacity = 16;
+		while (capacity < expected * 2) capacity <<= 1;
+		table.assign(capacity, ~0u);
+		keys.reserve(expected * 3);
+	}
+
+	// Index of the triple's vertex, added tells whether it is new
+	GLuint find(int p, int t, int n, bool &added) {
+		if (keys.size() / 3 * 2 >= table.size()) grow();
+		size_t mask = table.size() - 1;
+		for (size_t slot = hash(p, t, n) & mask; ; slot = (slot + 1) & mask) {
+			GLuint index = table[slot];
+			if (index == ~0u) {
+				index = (GLuint)(keys.size() / 3);
+				table[slot] = index;
+				keys.push_back(p);
+				keys.push_back(t);
+				keys.push_back(n);
+				added = true;
+				return index;
+			}
+			if (keys[index * 3] == p && keys[index * 3 + 1] == t && keys[index * 3 + 2] == n) {
+				added = false;
+				return index;
+			}
+		}
+	}
+
+private:
+	std::vector<GLuint> table;
+
+	static size_t hash(int p, int t, int n) {
+		return ((unsigned)p * 73856093u) ^ ((unsigned)t * 19349663u) ^ ((unsigned)n * 83492791u);
+	}
+
+	void grow() {
+		table.assign(table.size() * 2, ~0u);
+		size_t mask = table.size() - 1;
+		for (GLuint i = 0; i < keys.size() / 3; ++i) {
+			size_t slot = hash(keys[i * 3], keys[i * 3 + 1], keys[i * 3 + 2]) & mask;
+			while (table[slot] != ~0u) slot = (slot + 1) & mask;
+			table[slot] = i;
+		}
+	}
+};
+
+void objBuild(const ObjSource *source, const ObjGroup *group, ObjMesh *mesh) {
+	size_t corners = 0;
+	for (size_t r = 0; r < group->ranges.size(); ++r) {
+		corners += (group->ranges[r].second.second - group->ranges[r].second.first) / 3;
+	}
+	ObjWeld weld(corners / 4);
+	// Smooth normals sum the face normals around each position
+	ObjWeld positions(corners / 6);
+	std::vector<glm::vec3> smooth;
+	std::vector<GLuint> smoothOf;
+	bool missingNormals = false;
+	mesh->material = group->material;
+	mesh->indices.reserve(corners);
+
+	for (size_t r = 0; r < group->ranges.size(); ++r) {
+		const std::vector<int> &c = source->chunks[group->ranges[r].first].corners;
+		for (size_t at = group->ranges[r].second.first; at < group->ranges[r].second.second; at += 9) {
+			int p[3], t[3], n[3];
+			bool valid = true;
+			for (int k = 0; k < 3; ++k) {
+				p[k] = c[at + k * 3];
+				t[k] = c[at + k * 3 + 1] < (int)source->uvs.size() ? c[at + k * 3 + 1] : -1;
+				n[k] = c[at + k * 3 + 2] < (int)source->normals.size() ? c[at + k * 3 + 2] : -1;
+				valid = valid && p[k] >= 0 && p[k] < (int)source->positions.size();
+			}
+			if (!valid) continue;
+
+			glm::vec3 faceNormal = glm::cross(source->positions[p[1]] - source->positions[p[0]],
+				source->positions[p[2]] - source->positions[p[0]]);
+			float length = glm::length(faceNormal);
+			if (length > 0.0f) faceNormal /= length;
+
+			GLuint index[3];
+			for (int k = 0; k < 3; ++k) {
+				bool added;
+				index[k] = weld.find(p[k], t[k], n[k], added);
+				if (added) {
+					Vertex vertex;
+					vertex.Position = source->positions[p[k]];
+					vertex.Normal = n[k] >= 0 ? source->normals[n[k]] : glm::vec3(0.0f);
+					glm::vec2 uv = t[k] >= 0 ? source->uvs[t[k]] : glm::vec2(0.0f, 1.0f);
+					vertex.TexCoords = glm::vec3(uv.x, 1.0f - uv.y, 0.0f);
+					mesh->vertices.push_back(vertex);
+				}
+				if (n[k] < 0) {
+					missingNormals = true;
+					GLuint s = positions.find(p[k], 0, 0, added);
+					if (added) smooth.push_back(glm::vec3(0.0f));
+					smooth[s] += faceNormal;
+					if (smoothOf.size() <= index[k]) smoothOf.resize(index[k] + 1, ~0u);
+					smoothOf[index[k]] = s;
+				}
+			}
+			mesh->indices.push_back(index[0]);
+			mesh->indices.push_back(index[source->flipWinding ? 2 : 1]);
+			mesh->indices.push_back(index[source->flipWinding ? 1 : 2]);
+		}
+	}
+
+	if (!missingNormals) return;
+	for (size_t s = 0; s < smooth.size(); ++s) {
+		float length = glm::length(smooth[s]);
+		smooth[s] = length > 0.0f ? smooth[s] / length : glm::vec3(0.0f, 0.0f, 1.0f);
+	}
+	for (GLuint i = 0; i < smoothOf.size(); ++i) {
+		if (smoothOf[i] != ~0u) mesh->vertices[i].Normal = smooth[smoothOf[i]];
+	}
+}
+
+void objBuildGroups(const ObjSource *source, ObjData *out, GLuint first, GLuint step) {
+	PROFILE_ZONE("objBuild");
+	for (GLuint g = first; g < source->groups.size(); g += step) {
+		objBuild(source, &source->groups[g], &out->meshes[g]);
+	}
+}
+
+// newmtl with its map_Kd and map_Ks, the file name being the last token so
+// options before it are skipped
+void parseMtl(const std::string &path, std::unordered_map<std::string, ObjMaterial> &materials) {
+	PROFILE_ZONE("parseMtl");
+	AssetData asset;
+	if (!readAsset(path, asset) || !asset.data) {
+		std::cerr << path << " not found" << std::endl;
+		return;
+	}
+	const char *end = (const char*)asset.data + asset.size;
+	ObjMaterial *material = NULL;
+	for (const char *p = (const char*)asset.data; p < end; ) {
+		const char *eol = objLineEnd(p, end);
+		objSkipSpace(p, eol);
+		if (objKeyword(p, eol, "newmtl", 6)) {
+			material = &materials[objName(p + 6, eol)];
+		} else if (material && (objKeyword(p, eol, "map_Kd", 6) || objKeyword(p, eol, "map_Ks", 6))) {
+			std::string value = objName(p + 6, eol);
+			value = value.substr(value.find_last_of(" \t") + 1);
+			(p[5] == 'd' ? material->diffuse : material->specular) = value;
+		}
+		p = eol + 1;
+	}
+}
+
+bool parseObj(const std::string &path, bool flipWinding, ObjData &out) {
+	const unsigned char *data;
+	size_t size;
+	MappedFile file;
+	if (!AssetPack::get().find(path, data, size)) {
+		if (!file.open(path)) return false;
+		data = file.data;
+		size = file.size;
+	}
+	const char *begin = (const char*)data, *end = begin + size;
+
+	ObjSource source;
+	source.flipWinding = flipWinding;
+	GLuint threads = std::max(std::thread::hardware_concurrency(), 1u);
+	// Chunks of at least 64KB, cut after a newline, a few per thread so the
+	// pool evens out uneven chunks
+	size_t count = std::max<size_t>(1, std::min<size_t>(threads * 4, size >> 16));
+	source.chunks.resize(count);
+	const char *at = begin;
+	for (size_t i = 0; i < count; ++i) {
+		ObjChunk &chunk = source.chunks[i];
+		chunk.begin = at;
+		at = i + 1 == count ? end : std::max(at, begin + size / count * (i + 1));
+		if (at < end) {
+			at = objLineEnd(at, end);
+			if (at < end) ++at;
+		}
+		chunk.end = at;
+		for (int k = 0; k < 3; ++k) chunk.count[k] = 0;
+	}
+
+	std::vector<std::function<void()> > jobs;
+	for (size_t i = 0; i < count; ++i) jobs.push_back(std::bind(objCount, &source.chunks[i]));
+	WorkerPool::get().run(jobs);
+	size_t totals[3] = {0, 0, 0};
+	for (size_t i = 0; i < count; ++i) {
+		for (int k = 0; k < 3; ++k) {
+			source.chunks[i].first[k] = totals[k];
+			totals[k] += source.chunks[i].count[k];
+		}
+	}
+	source.positions.resize(totals[0]);
+	source.uvs.resize(totals[1]);
+	source.normals.resize(totals[2]);
+
+	jobs.clear();
+	for (size_t i = 0; i < count; ++i) jobs.push_back(std::bind(objParse, &source, &source.chunks[i]));
+	WorkerPool::get().run(jobs);
+
+	// A chunk's corners before its first usemtl carry on the previous material
+	std::unordered_map<std::string, size_t> groupOf;
+	std::string material;
+	for (size_t i = 0; i < count; ++i) {
+		const ObjChunk &chunk = source.chunks[i];
+		size_t start = 0;
+		for (size_t s = 0; s <= chunk.switches.size(); ++s) {
+			size_t stop = s < chunk.switches.size() ? chunk.switches[s].first : chunk.corners.size();
+			if (stop > start) {
+				std::unordered_map<std::string, size_t>::iterator g = groupOf.find(material);
+				if (g == groupOf.end()) {
+					g = groupOf.insert(std::make_pair(material, source.groups.size())).first;
+					source.groups.push_back(ObjGroup());
+					source.groups.back().material = material;
+				}
+				source.groups[g->second].ranges.push_back(std::make_pair(i, std::make_pair(start, stop)));
+			}
+			if (s < chunk.switches.size()) material = chunk.switches[s].second;
+			start = stop;
+		}
+		for (size_t l = 0; l < chunk.libraries.size(); ++l) {
+			out.libraries.push_back(path.substr(0, path.find_last_of("/\\") + 1) + chunk.libraries[l]);
+			parseMtl(out.libraries.back(), out.materials);
+		}
+	}
+
+	out.meshes.resize(source.groups.size());
+	GLuint step = std::max<GLuint>(1, std::min<GLuint>(threads, (GLuint)source.groups.size()));
+	jobs.clear();
+	for (GLuint i = 0; i < step; ++i) jobs.push_back(std::bind(objBuildGroups, &source, &out, i, step));
+	WorkerPool::get().run(jobs);
+	return true;
+}
+
+// Assimp reads through these from AssetPack. Its importers copy the file
+// into their own buffer, so the pack saves the opens, not that copy.
+// Files the pack lacks, like a .mtl left out of it, are read from disk.
+class PackIOStream : public Assimp::IOStream {
+public:
+	AssetData asset;
+
+	PackIOStream() : pos(0) {}
+
+	size_t Read(void *buffer, size_t itemSize, size_t count) {
+		if (itemSize == 0) return 0;
+		size_t n = std::min(count, (asset.size - pos) / itemSize);
+		memcpy(buffer, asset.data + pos, n * itemSize);
+		pos += n * itemSize;
+		return n;
+	}
+
+	size_t Write(const void *, size_t, size_t) {
+		return 0;
+	}
+
+	// Offsets from the end wrap around like the ones fseek gets
+	aiReturn Seek(size_t offset, aiOrigin origin) {
+		size_t target = origin == aiOrigin_SET ? offset : (origin == aiOrigin_CUR ? pos : asset.size) + offset;
+		if (target > asset.size) return aiReturn_FAILURE;
+		pos = target;
+		return aiReturn_SUCCESS;
+	}
+
+	size_t Tell() const {
+		return pos;
+	}
+
+	size_t FileSize() const {
+		return asset.size;
+	}
+
+	void Flush() {}
+
+private:
+	size_t pos;
+};
+
+class PackIOSystem : public Assimp::IOSystem {
+public:
+	bool Exists(const char *file) const {
+		return assetExists(file);
+	}
+
+	char getOsSeparator() const {
+		return '/';
+	}
+
+	Assimp::IOStream *Open(const char *file, const char *mode) {
+		if (strchr(mode, 'w')) return NULL;
+		if (!AssetPack::get().contains(file)) {
+			std::cerr << file << " is not in the asset pack, reading it from disk" << std::endl;
+		}
+		PackIOStream *stream = new PackIOStream();
+		if (!readAsset(file, stream->asset)) {
+			delete stream;
+			return NULL;
+		}
+		return stream;
+	}
+
+	void Close(Assimp::IOStream *stream) {
+		delete stream;
+	}
+};
+
+class Model 
+{
+public:
+	// Parsing touches no GL, so it runs on its own thread and the model
+	// stays empty until update() uploads it. A lodCell above zero
+	// simplifies every mesh, see simplify.
+    Model(GLchar* path, bool flipWinding, float lodCell = 0.0f)
+		: modelMatrix(1.0f), version(0),
+		  flipWinding(flipWinding), lodCell(lodCell),
+		  boundsMin(std::numeric_limits<float>::max()), boundsMax(-std::numeric_limits<float>::max()),
+		  boundsVersion((unsigned)-1), indirectBase(-1), instances(NULL), instanceVersion(0), instancing(true),
+		  parsed(false), ready(false)
+    {
+		name = path;
+		this->directory = name.substr(0, name.find_last_of('/'));
+		parser = std::thread(&Model::loadModel, this, name);
+    }
+
+	~Model() {
+		if (parser.joinable()) parser.join();
+		for (GLuint i = 0; i < textures_loaded.size(); ++i) {
+			TextureCache::get().release(textures_loaded[i].id);
+		}
+	}
+
+    void Draw(Shader shader, Camera &camera) {
+		Draw(shader, camera, visible);
+	}
+
+	// Draws the meshes a pass's own cull left set in meshVisible
+	void Draw(Shader shader, Camera &camera, const std::vector<unsigned char> &meshVisible) {
+		PROFILE_ZONE("Model::Draw");
+		if (instances) {
+			DrawInstances(shader, camera);
+			return;
+		}
+		for (GLuint i = 0; i < this->meshes.size(); i++)
+			if (meshVisible[i]) this->meshes[i].Draw(shader, camera, modelMatrix, false,
+				indirectBase < 0 ? -1 : indirectBase + i);
+	}
+
+	// Uploads the meshes once parsing is done, with view given only once
+	// their bounds are in it. True on the call that made the model ready or
+	// swapped in a reload.
+	bool update(const Frustum *view) {
+		if (!parsed) return false;
+		if (parser.joinable()) parser.join();
+		if (!error.empty()) {
+			std::cout << error << std::endl;
+			if (!ready) throw false;
+			// A failed reload keeps the meshes there are
+			error.clear();
+			parsed = false;
+			return false;
+		}
+		if (!ready) {
+			boundsMin = pendingMin;
+			boundsMax = pendingMax;
+		}
+		if (view && !ready) {
+			glm::vec3 bMin, bMax;
+			getWorldBounds(bMin, bMax);
+			glm::vec3 c = (bMin + bMax) * 0.5f, e = (bMax - bMin) * 0.5f;
+			unsigned char inside;
+			cullBoxes(*view, &c.x, &c.y, &c.z, &e.x, &e.y, &e.z, 1, &inside);
+			if (!inside) return false;
+		}
+		upload();
+		return true;
+	}
+
+	// Blocks until parsed, so the next update uploads
+	void waitParsed() {
+		if (parser.joinable()) parser.join();
+	}
+
+	bool isReady() const {
+		return ready;
+	}
+
+	// Parses the file again on parser, the current meshes draw until
+	// update() swaps the new ones in
+	void reload() {
+		if (parser.joinable()) parser.join();
+		pendingMeshes.clear();
+		pendingTextures.clear();
+		error.clear();
+		parsed = false;
+		parser = std::thread(&Model::loadModel, this, name);
+	}
+
+	// Whether canonical is the canonicalPath of the model file or a
+	// material library it read
+	bool uses(const std::string &canonical) const {
+		if (canonicalPath(name) == canonical) return true;
+		for (GLuint i = 0; i < libraries.size(); ++i) {
+			if (canonicalPath(libraries[i]) == canonical) return true;
+		}
+		return false;
+	}
+
+	// Draw renders every instance in the buffer in place of modelMatrix, with
+	// one instanced draw per mesh or, without instancing, one draw per instance
+	void setInstances(InstanceBuffer *instances, bool instancing = true) {
+		this->instances = instances;
+		this->instancing = instancing;
+		instanceVersion = instances ? instances->getVersion() : 0;
+		version++;
+	}
+
+	void DrawInstances(Shader shader, Camera &camera) {
+		for (GLuint i = 0; i < this->meshes.size(); i++) {
+			if (instancing) {
+				this->meshes[i].DrawInstanced(shader, camera, instances->getVbo(), instances->instances.size());
+			} else {
+				for (GLuint j = 0; j < instances->instances.size(); ++j)
+					this->meshes[i].Draw(shader, camera, instances->instances[j], false);
+			}
+		}
+	}
+
+	// Requests each visible mesh's texture levels from TextureLoader by the
+	// height in pixels of its bounding sphere, taking a texture to span its
+	// mesh about once
+	void requestMips(Camera &camera) {
+		glm::mat3 m(modelMatrix);
+		float scale = std::max(glm::length(m[0]), std::max(glm::length(m[1]), glm::length(m[2])));
+		// Pixels per world unit at distance 1
+		float focal = camera.persp[1][1] * HEIGHT * 0.5f;
+		for (GLuint i = 0; i < meshes.size(); ++i) {
+			if (meshes[i].textures.empty() || (!visible.empty() && !visible[i])) continue;
+			glm::vec3 c = glm::vec3(modelMatrix * glm::vec4(meshes[i].sphereCenter, 1.0f));
+			float r = meshes[i].sphereRadius * scale;
+			float distance = std::max(glm::length(c - camera.lookFrom) - r, CAMERA_NEAR);
+			float pixels = 2.0f * r * focal / distance;
+			for (GLuint j = 0; j < meshes[i].textures.size(); ++j) {
+				TextureLoader::get().request(meshes[i].textures[j].id, pixels);
+			}
+		}
+	}
+
+	// Draws every textured mesh from its layer in materials
+	void setMaterials(MaterialSystem &materials) {
+		for (GLuint i = 0; i < meshes.size(); ++i) {
+			if (meshes[i].textures.empty()) continue;
+			meshes[i].materials = &materials;
+			meshes[i].material = materials.add(meshes[i].textures[0].id);
+		}
+	}
+
+	// Makes Draw take mesh i's count from indirect command base + i, -1 to draw directly
+	void setIndirectBase(GLint base) {
+		indirectBase = base;
+	}
+
+	// An instanced mesh's bounds cover all its instances
+	void appendBounds(std::vector<MeshBoundsGPU> &out) {
+		if (boundsVersion != getVersion()) {
+			updateWorldBounds();
+		}
+		for (GLuint i = 0; i < meshes.size(); ++i) {
+			MeshBoundsGPU b = {
+				glm::vec4(worldBounds[0][i], worldBounds[1][i], worldBounds[2][i], 0.0f),
+				glm::vec4(worldBounds[3][i], worldBounds[4][i], worldBounds[5][i], 0.0f),
+				{ (GLuint)meshes[i].indices.size(), 0, 0, 0 }
+			};
+			out.push_back(b);
+		}
+	}
+
+	// Tests every mesh's world AABB against the view frustum, following
+	// Draw calls and texture requests skip the invisible ones. Returns how
+	// many were culled.
+	GLuint cull(const Frustum &frustum) {
+		return cull(frustum, visible);
+	}
+
+	// Marks every mesh visible, for while the GPU culls the model instead
+	void clearCull() {
+		visible.assign(meshes.size(), 1);
+	}
+
+	// Same for another pass, into its own meshVisible so the view's stays
+	GLuint cull(const Frustum &frustum, std::vector<unsigned char> &meshVisible) {
+		if (meshes.empty() || instances) return 0;
+		if (boundsVersion != version) {
+			updateWorldBounds();
+		}
+		meshVisible.resize(meshes.size());
+		cullBoxes(frustum, &worldBounds[0][0], &worldBounds[1][0], &worldBounds[2][0],
+			&worldBounds[3][0], &worldBounds[4][0], &worldBounds[5][0], meshes.size(), &meshVisible[0]);
+		GLuint culled = 0;
+		for (GLuint i = 0; i < meshVisible.size(); ++i) {
+			culled += meshVisible[i] ? 0 : 1;
+		}
+		return culled;
+	}
+
+	const glm::mat4 &getModelMatrix() const {
+		return modelMatrix;
+	}
+
+	const std::vector<Mesh> &getMeshes() const {
+		return meshes;
+	}
+
+	InstanceBuffer *getInstances() const {
+		return instances;
+	}
+
+	void getLocalBounds(glm::vec3 &outMin, glm::vec3 &outMax) const {
+		outMin = boundsMin;
+		outMax = boundsMax;
+	}
+
+	void setModelMatrix(const glm::mat4 &m) {
+		if (m != modelMatrix) {
+			modelMatrix = m;
+			version++;
+		}
+	}
+
+	// Bumped whenever the transform, the geometry or the instances change,
+	// so shadow casters can be compared against what was last rendered
+	unsigned getVersion() const {
+		if (instances && instances->getVersion() != instanceVersion) {
+			instanceVersion = instances->getVersion();
+			version++;
+		}
+		return version;
+	}
+
+	void getWorldBounds(glm::vec3 &outMin, glm::vec3 &outMax) const {
+		outMin = glm::vec3(std::numeric_limits<float>::max());
+		outMax = glm::vec3(-std::numeric_limits<float>::max());
+		GLuint n = instances ? instances->instances.size() : 1;
+		for (GLuint j = 0; j < n; ++j) {
+			const glm::mat4 &m = instances ? instances->instances[j].model : modelMatrix;
+			for (int i = 0; i < 8; ++i) {
+				glm::vec3 corner(
+					(i & 1) ? boundsMax.x : boundsMin.x,
+					(i & 2) ? boundsMax.y : boundsMin.y,
+					(i & 4) ? boundsMax.z : boundsMin.z);
+				glm::vec3 w = glm::vec3(m * glm::vec4(corner, 1.0f));
+				outMin = glm::min(outMin, w);
+				outMax = glm::max(outMax, w);
+			}
+		}
+	}
+
+private:
+	glm::mat4 modelMatrix;
+	// getVersion folds in instance buffer uploads
+	mutable unsigned version;
+	// One entry per TextureCache acquire, released by the destructor
 	std::vector<Texture> textures_loaded; 
     std::vector<Mesh> meshes;
     std::string directory;
 	bool flipWinding;
+	float lodCell;
+	glm::vec3 boundsMin, boundsMax;
+	// Per mesh world AABB centre xyz and half extents xyz, one array each
+	std::vector<float> worldBounds[6];
+	std::vector<unsigned char> visible;
+	unsigned boundsVersion;
+	GLint indirectBase;
+	InstanceBuffer *instances;
+	// instances->getVersion() last folded into version
+	mutable unsigned instanceVersion;
+	bool instancing;
+	std::string name;
+	std::thread parser;
+	std::atomic<bool> parsed;
+	bool ready;
+	std::string error;
+	// Filled by parser: meshes with everything but their GL objects, and per
+	// mesh the (file, type) of each texture
+	std::vector<Mesh> pendingMeshes;
+	std::vector<std::vector<std::pair<std::string, std::string> > > pendingTextures;
+	glm::vec3 pendingMin, pendingMax;
+	std::vector<std::string> libraries, pendingLibraries;
+
+	Model(const Model &);
+	Model &operator=(const Model &);
+
+	// Instanced, the union over every instance's transform
+	void updateWorldBounds() {
+		for (int k = 0; k < 6; ++k) {
+			worldBounds[k].resize(meshes.size());
+		}
+		GLuint n = instances ? instances->instances.size() : 1;
+		std::vector<glm::vec3> lo(meshes.size(), glm::vec3(std::numeric_limits<float>::max()));
+		std::vector<glm::vec3> hi(meshes.size(), glm::vec3(-std::numeric_limits<float>::max()));
+		for (GLuint j = 0; j < n; ++j) {
+			const glm::mat4 &m = instances ? instances->instances[j].model : modelMatrix;
+			glm::mat3 absM(m);
+			for (int c = 0; c < 3; ++c) {
+				absM[c] = glm::abs(absM[c]);
+			}
+			for (GLuint i = 0; i < meshes.size(); ++i) {
+				glm::vec3 c = glm::vec3(m * glm::vec4((meshes[i].boundsMin + meshes[i].boundsMax) * 0.5f, 1.0f));
+				glm::vec3 e = absM * ((meshes[i].boundsMax - meshes[i].boundsMin) * 0.5f);
+				lo[i] = glm::min(lo[i], c - e);
+				hi[i] = glm::max(hi[i], c + e);
+			}
+		}
+		for (GLuint i = 0; i < meshes.size(); ++i) {
+			// No instances, nothing drawn
+			if (!n) lo[i] = hi[i] = glm::vec3(0.0f);
+			glm::vec3 c = (lo[i] + hi[i]) * 0.5f, e = (hi[i] - lo[i]) * 0.5f;
+			worldBounds[0][i] = c.x;
+			worldBounds[1][i] = c.y;
+			worldBounds[2][i] = c.z;
+			worldBounds[3][i] = e.x;
+			worldBounds[4][i] = e.y;
+			worldBounds[5][i] = e.z;
+		}
+		boundsVersion = version;
+	}
        
+	// Runs on parser
 	void loadModel(std::string path) {
+		PROFILE_THREAD();
+		LOAD_PROFILER(setThreadAsset(path));
+		LOAD_TIMER("parse");
+		AssetData file;
+		if (AssetPack::get().find(path, file.data, file.size)) {
+			LOAD_PROFILER(addCounts(path, file.size, 0, 0));
+		} else {
+			std::ifstream in(path.c_str(), std::ios::binary | std::ios::ate);
+			LOAD_PROFILER(addCounts(path, in.is_open() ? (size_t)in.tellg() : 0, 0, 0));
+		}
+		std::string extension = path.substr(path.find_last_of('.') + 1);
+		std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+		if (NATIVE_OBJ && extension == "obj") {
+			loadObj(path);
+		} else {
+			loadScene(path);
+		}
+		pendingMin = glm::vec3(std::numeric_limits<float>::max());
+		pendingMax = glm::vec3(-std::numeric_limits<float>::max());
+		for (GLuint i = 0; i < pendingMeshes.size(); ++i) {
+			pendingMin = glm::min(pendingMin, pendingMeshes[i].boundsMin);
+			pendingMax = glm::max(pendingMax, pendingMeshes[i].boundsMax);
+		}
+		parsed = true;
+	}
+
+	void loadScene(const std::string &path) {
 		Assimp::Importer import;
-		const aiScene* scene = import.ReadFile(path,
-			aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_GenSmoothNormals | aiProcess_JoinIdenticalVertices |
-			(flipWinding ? aiProcess_FlipWindingOrder : 0));	
+		// The importer deletes the handlers
+		if (AssetPack::get().contains(path)) {
+			import.SetIOHandler(new PackIOSystem());
+		}
+#if LOAD_PROFILING
+		import.SetProgressHandler(new ProfileProgress());
+#endif
+		const aiScene* scene;
+		{
+			LOAD_TIMER("assimp ReadFile");
+			scene = import.ReadFile(path,
+				aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_GenSmoothNormals | aiProcess_JoinIdenticalVertices |
+				(flipWinding ? aiProcess_FlipWindingOrder : 0));	
+		}
 		if(!scene || scene->mFlags == AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) 
 		{
-			std::cout << "ERROR::ASSIMP::" << import.GetErrorString() << std::endl;
-			throw false;
+			error = std::string("ERROR::ASSIMP::") + import.GetErrorString();
+			return;
+		}
+		this->processNode(scene->mRootNode, scene);
+	}
+
+	void loadObj(const std::string &path) {
+		ObjData data;
+		LOAD_TIMER("parseObj");
+		if (!parseObj(path, flipWinding, data)) {
+			error = "ERROR::OBJ::" + path + " not found";
+			return;
+		}
+		pendingLibraries.swap(data.libraries);
+		for (GLuint i = 0; i < data.meshes.size(); ++i) {
+			if (data.meshes[i].indices.empty()) continue;
+			std::vector<std::pair<std::string, std::string> > textures;
+			std::unordered_map<std::string, ObjMaterial>::const_iterator material = data.materials.find(data.meshes[i].material);
+			if (material != data.materials.end()) {
+				if (!material->second.diffuse.empty()) textures.push_back(std::make_pair(material->second.diffuse, std::string("texture_diffuse")));
+				if (!material->second.specular.empty()) textures.push_back(std::make_pair(material->second.specular, std::string("texture_specular")));
+			}
+			addPending(data.meshes[i].vertices, data.meshes[i].indices, textures);
+		}
+	}
+
+	void addPending(std::vector<Vertex> &vertices, const std::vector<GLuint> &indices,
+		const std::vector<std::pair<std::string, std::string> > &textures) {
+		pendingMeshes.push_back(Mesh());
+		Mesh &mesh = pendingMeshes.back();
+		LOAD_PROFILER(addCounts(LoadProfiler::get().threadAsset(), 0, vertices.size(), indices.size()));
+		std::vector<GLuint> triangles(indices);
+		if (lodCell > 0.0f) simplify(vertices, triangles, lodCell);
+		mesh.vertices.swap(vertices);
+		LOAD_TIMER("computeAdjacency");
+		mesh.computeAdjacency(triangles);
+		mesh.computeBounds();
+		pendingTextures.push_back(textures);
+	}
+
+	// Vertex clustering: each vertex merges into the first one in its cell
+	// of a grid cell times the mesh's bounding diagonal, triangles left
+	// with less than three corners go and unused vertices are dropped
+	static void simplify(std::vector<Vertex> &vertices, std::vector<GLuint> &indices, float cell) {
+		glm::vec3 lo(std::numeric_limits<float>::max()), hi(-std::numeric_limits<float>::max());
+		for (GLuint i = 0; i < vertices.size(); ++i) {
+			lo = glm::min(lo, vertices[i].Position);
+			hi = glm::max(hi, vertices[i].Position);
+		}
+		float size = glm::length(hi - lo) * cell;
+		if (vertices.empty() || size <= 0.0f) return;
+		std::unordered_map<unsigned long long, GLuint> cells;
+		std::vector<Vertex> kept;
+		std::vector<GLuint> remap(vertices.size());
+		for (GLuint i = 0; i < vertices.size(); ++i) {
+			glm::vec3 q = (vertices[i].Position - lo) / size;
+			unsigned long long key = (unsigned long long)q.x | ((unsigned long long)q.y << 21) | ((unsigned long long)q.z << 42);
+			std::pair<std::unordered_map<unsigned long long, GLuint>::iterator, bool> c =
+				cells.insert(std::make_pair(key, (GLuint)kept.size()));
+			if (c.second) kept.push_back(vertices[i]);
+			remap[i] = c.first->second;
+		}
+		std::vector<GLuint> out;
+		for (GLuint i = 0; i + 2 < indices.size(); i += 3) {
+			GLuint a = remap[indices[i]], b = remap[indices[i + 1]], c = remap[indices[i + 2]];
+			if (a == b || b == c || a == c) continue;
+			out.push_back(a);
+			out.push_back(b);
+			out.push_back(c);
+		}
+		vertices.swap(kept);
+		indices.swap(out);
+	}
+
+	// Main thread: textures and GL buffers for the parsed meshes. A reload
+	// acquires its textures before the old ones are released, so unchanged
+	// textures stay in TextureCache.
+	void upload() {
+		LOAD_ASSET_TIMER("upload", name);
+		for (GLuint i = 0; i < meshes.size(); ++i) {
+			meshes[i].release();
+		}
+		std::vector<Texture> previous;
+		previous.swap(textures_loaded);
+		meshes.swap(pendingMeshes);
+		for (GLuint i = 0; i < meshes.size(); ++i) {
+			for (GLuint j = 0; j < pendingTextures[i].size(); ++j) {
+				// TextureCache shares the texture with earlier meshes and models
+				Texture texture;
+				texture.id = TextureFromFile(pendingTextures[i][j].first.c_str(), this->directory);
+				texture.type = pendingTextures[i][j].second;
+				texture.path = aiString(pendingTextures[i][j].first);
+				meshes[i].textures.push_back(texture);
+				this->textures_loaded.push_back(texture);
+			}
+			meshes[i].setupMesh();
+		}
+		for (GLuint i = 0; i < previous.size(); ++i) {
+			TextureCache::get().release(previous[i].id);
+		}
+		pendingMeshes.clear();
+		pendingTextures.clear();
+		libraries.swap(pendingLibraries);
+		pendingLibraries.clear();
+		boundsMin = pendingMin;
+		boundsMax = pendingMax;
+		visible.assign(meshes.size(), 1);
+		parsed = false;
+		ready = true;
+		version++;
+	}
+
+    void processNode(aiNode* node, const aiScene* scene) {
+		for (GLuint i = 0; i < node->mNumMeshes; i++)
+		{
+			aiMesh* mesh = scene->mMeshes[node->mMeshes[i]]; 
+			this->processMesh(mesh, scene);
+		}	
+		for(GLuint i = 0; i < node->mNumChildren; i++)
+		{
+			this->processNode(node->mChildren[i], scene);
+		}
+	}
+
+    void processMesh(aiMesh* mesh, const aiScene* scene) {
+		LOAD_TIMER("processMesh");
+		std::vector<Vertex> vertices;
+		std::vector<GLuint> indices;
+		std::vector<std::pair<std::string, std::string> > textures;
+		convertMesh(mesh, vertices, indices);
+
+		if (mesh->mMaterialIndex >= 0)
+		{
+			aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
+			this->loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse", textures);
+			this->loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular", textures);
+		}
+
+		addPending(vertices, indices, textures);
+	}
+
+public:
+	// The vertex and index copy out of Assimp's arrays, public for the microbenchmarks
+	static void convertMesh(const aiMesh* mesh, std::vector<Vertex> &vertices, std::vector<GLuint> &indices) {
+		for(GLuint i = 0; i < mesh->mNumVertices; i++)
+		{
+			Vertex vertex;
+
+			glm::vec3 vector; 
+			vector.x = mesh->mVertices[i].x;
+			vector.y = mesh->mVertices[i].y;
+			vector.z = mesh->mVertices[i].z; 
+			vertex.Position = vector;
+
+			vector.x = mesh->mNormals[i].x;
+			vector.y = mesh->mNormals[i].y;
+			vector.z = mesh->mNormals[i].z;
+			vertex.Normal = vector;  
+
+			if (mesh->mTextureCoords[0])
+			{
+				glm::vec3 vec;
+				vec.x = mesh->mTextureCoords[0][i].x; 
+				vec.y = mesh->mTextureCoords[0][i].y;
+				vec.z = 0.0f;
+				vertex.TexCoords = vec;
+			}
+			else
+				vertex.TexCoords = glm::vec3(0.0f, 0.0f, 0.0f);  
+
+			vertices.push_back(vertex);
+		}
+			
+		for (GLuint i = 0; i < mesh->mNumFaces; i++)
+		{
+			aiFace face = mesh->mFaces[i];
+			for(GLuint j = 0; j < face.mNumIndices; j++)
+				indices.push_back(face.mIndices[j]);
+		}  
+	}
+
+private:
+    void loadMaterialTextures(aiMaterial* mat, aiTextureType type, std::string typeName,
+		std::vector<std::pair<std::string, std::string> > &textures) {
+		for(GLuint i = 0; i < mat->GetTextureCount(type); i++)
+		{
+			aiString str;
+			mat->GetTexture(type, i, &str);
+			textures.push_back(std::make_pair(std::string(str.C_Str()), typeName));
+		}
+	}
+};
+
+// Matches Object in cull.comp (std430)
+struct GpuObject {
+	InstanceData instance;
+	glm::vec4 sphere;
+	GLuint lodFirst[4], lodCount[4];
+	GLfloat lodDistance[4];
+};
+
+// All meshes of the added models share one vertex and index buffer, and
+// every instance is an object in an SSBO. cull.comp frustum and distance
+// culls the objects, picks a LOD and appends each visible one to the
+// instance range of its meshes' indirect commands, so a pass is one
+// glMultiDrawElementsIndirect per material array (or per texture for
+// meshes without one) whatever the object count.
+struct GpuScene {
+
+	GpuScene() : maxDistance(GPU_DRAW_DISTANCE), shader(1, "../a1/cull.comp", GL_COMPUTE_SHADER),
+		vao(0), meshCount(0), objectCount(0) {}
+
+	void addModel(Model &model) {
+		Entry e = { &model, (unsigned)-1 };
+		entries.push_back(e);
+		lods.push_back(std::vector<std::pair<Model*, float> >());
+	}
+
+	// Up to three extra models swapped in for model past each distance
+	void addLod(Model &model, Model &lod, float distance) {
+		for (GLuint i = 0; i < entries.size(); ++i) {
+			if (entries[i].model == &model && lods[i].size() < 3) {
+				lods[i].push_back(std::make_pair(&lod, distance));
+			}
+		}
+	}
+
+	// Packs every mesh into the shared buffers, sorted by material array or
+	// diffuse texture so each batch is one contiguous range of commands.
+	// Materials must be built before this.
+	void build() {
+		std::vector<const Mesh*> pool;
+		for (GLuint i = 0; i < entries.size(); ++i) {
+			addMeshes(*entries[i].model, pool);
+			for (GLuint j = 0; j < lods[i].size(); ++j) addMeshes(*lods[i][j].first, pool);
+		}
+		std::vector<GLuint> order(pool.size());
+		for (GLuint i = 0; i < pool.size(); ++i) order[i] = i;
+		std::stable_sort(order.begin(), order.end(), MaterialLess(pool));
+		meshes.clear();
+		for (GLuint i = 0; i < order.size(); ++i) meshes.push_back(pool[order[i]]);
+		std::unordered_map<const Mesh*, GLuint> meshIndex;
+		for (GLuint i = 0; i < meshes.size(); ++i) meshIndex[meshes[i]] = i;
+		meshCount = meshes.size();
+
+		// Sorting scatters a model's meshes, so each model gets a run of
+		// command indices in lodMeshes
+		lodMeshes.clear();
+		modelRanges.clear();
+		for (GLuint i = 0; i < entries.size(); ++i) {
+			addRange(*entries[i].model, meshIndex);
+			for (GLuint j = 0; j < lods[i].size(); ++j) addRange(*lods[i][j].first, meshIndex);
+		}
+
+		std::vector<Vertex> vertices;
+		std::vector<GLuint> indices;
+		std::vector<GLuint> commands;
+		std::vector<GLuint> layers;
+		for (GLuint i = 0; i < meshes.size(); ++i) {
+			GLuint cmd[5] = { (GLuint)meshes[i]->indices.size(), 0, (GLuint)indices.size(), (GLuint)vertices.size(), 0 };
+			commands.insert(commands.end(), cmd, cmd + 5);
+			const Mesh &m = *meshes[i];
+			layers.push_back(m.materials && m.materials->isBuilt(m.material) ? m.materials->getLayer(m.material) : 0);
+			vertices.insert(vertices.end(), meshes[i]->vertices.begin(), meshes[i]->vertices.end());
+			indices.insert(indices.end(), meshes[i]->indices.begin(), meshes[i]->indices.end());
+		}
+		if (meshes.empty()) return;
+
+		if (!vao) {
+			glGenVertexArrays(1, &vao);
+			glGenBuffers(1, &vbo);
+			glGenBuffers(1, &ebo);
+			glGenBuffers(1, &objectBuffer);
+			glGenBuffers(1, &commandBuffer);
+			glGenBuffers(1, &templateBuffer);
+			glGenBuffers(1, &instanceBuffer);
+			glGenBuffers(1, &lodMeshBuffer);
+			glGenBuffers(1, &layerBuffer);
+		}
+		glBindVertexArray(vao);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), &indices[0], GL_STATIC_DRAW);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)0);
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, Normal));
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, TexCoords));
+
+		glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+		for (GLuint i = 0; i < 4; ++i) {
+			glEnableVertexAttribArray(3 + i);
+			glVertexAttribPointer(3 + i, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+				(GLvoid*)(offsetof(InstanceData, model) + i * sizeof(glm::vec4)));
+			glVertexAttribDivisor(3 + i, 1);
+		}
+		glEnableVertexAttribArray(7);
+		glVertexAttribPointer(7, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (GLvoid*)offsetof(InstanceData, tint));
+		glVertexAttribDivisor(7, 1);
+		for (GLuint i = 0; i < 3; ++i) {
+			glEnableVertexAttribArray(8 + i);
+			glVertexAttribPointer(8 + i, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+				(GLvoid*)(offsetof(InstanceData, normal) + i * sizeof(glm::vec4)));
+			glVertexAttribDivisor(8 + i, 1);
+		}
+		glEnableVertexAttribArray(11);
+		glVertexAttribIPointer(11, 1, GL_UNSIGNED_INT, sizeof(InstanceData), (GLvoid*)offsetof(InstanceData, material));
+		glVertexAttribDivisor(11, 1);
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, layerBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, layers.size() * sizeof(GLuint), &layers[0], GL_STATIC_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+		templateCommands = commands;
+		for (GLuint i = 0; i < entries.size(); ++i) entries[i].version = (unsigned)-1;
+		sync();
+	}
+
+	// Re-uploads the objects if any model moved, otherwise does nothing
+	void sync() {
+		bool changed = false;
+		for (GLuint i = 0; i < entries.size(); ++i) {
+			changed |= entries[i].version != entries[i].model->getVersion();
+			entries[i].version = entries[i].model->getVersion();
+		}
+		if (!changed || meshes.empty()) return;
+
+		std::vector<GpuObject> objects;
+		std::vector<GLuint> regionSize(meshCount, 0);
+		for (GLuint i = 0; i < entries.size(); ++i) {
+			Model &model = *entries[i].model;
+			GpuObject o;
+			glm::vec3 bMin, bMax;
+			model.getLocalBounds(bMin, bMax);
+			glm::vec3 c = (bMin + bMax) * 0.5f;
+			o.sphere = glm::vec4(c, glm::length(bMax - c));
+			for (GLuint l = 0; l < 4; ++l) {
+				Model *lod = l == 0 ? &model : (l <= lods[i].size() ? lods[i][l - 1].first : NULL);
+				o.lodDistance[l] = l == 0 || !lod ? 0.0f : lods[i][l - 1].second;
+				o.lodFirst[l] = 0;
+				o.lodCount[l] = 0;
+				if (!lod) continue;
+				o.lodFirst[l] = modelRanges[lod].first;
+				o.lodCount[l] = modelRanges[lod].second;
+			}
+			InstanceBuffer *instances = model.getInstances();
+			GLuint n = instances ? instances->instances.size() : 1;
+			for (GLuint j = 0; j < n; ++j) {
+				o.instance = instances ? instances->instances[j] : InstanceData::make(model.getModelMatrix(), glm::vec4(1.0f));
+				objects.push_back(o);
+				for (GLuint l = 0; l < 4; ++l)
+					for (GLuint k = o.lodFirst[l]; k < o.lodFirst[l] + o.lodCount[l]; ++k) regionSize[lodMeshes[k]]++;
+			}
+		}
+		objectCount = objects.size();
+
+		GLuint offset = 0;
+		for (GLuint i = 0; i < meshCount; ++i) {
+			templateCommands[i * 5 + 4] = offset;
+			offset += regionSize[i];
+		}
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, objectBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, objects.size() * sizeof(GpuObject),
+			objects.empty() ? NULL : &objects[0], GL_STATIC_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, templateBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, templateCommands.size() * sizeof(GLuint), &templateCommands[0], GL_STATIC_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, lodMeshBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, lodMeshes.size() * sizeof(GLuint), &lodMeshes[0], GL_STATIC_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, commandBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, templateCommands.size() * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, instanceBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, std::max(offset, (GLuint)1) * sizeof(InstanceData), NULL, GL_DYNAMIC_COPY);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+
+	// Culls against viewProj and fills the commands for the next draw
+	void cull(const glm::mat4 &viewProj, glm::vec3 eye) {
+		if (meshes.empty()) return;
+		glBindBuffer(GL_COPY_READ_BUFFER, templateBuffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, commandBuffer);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, templateCommands.size() * sizeof(GLuint));
+
+		Frustum frustum(viewProj);
+		GLfloat planes[24];
+		for (int p = 0; p < 6; ++p) {
+			planes[p * 4] = frustum.nx[p];
+			planes[p * 4 + 1] = frustum.ny[p];
+			planes[p * 4 + 2] = frustum.nz[p];
+			planes[p * 4 + 3] = frustum.d[p];
+		}
+		shader.use();
+		glUniform4fv(glGetUniformLocation(shader.getProgId(), "planes"), 6, planes);
+		glUniform3fv(glGetUniformLocation(shader.getProgId(), "eye"), 1, glm::value_ptr(eye));
+		glUniform1f(glGetUniformLocation(shader.getProgId(), "maxDistance"), maxDistance);
+		glUniform1ui(glGetUniformLocation(shader.getProgId(), "objectCount"), objectCount);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, objectBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, commandBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, instanceBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, lodMeshBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, layerBuffer);
+		glDispatchCompute((objectCount + 63) / 64, 1, 1);
+		// The draws read the commands and instances, and the next cull's copy
+		// overwrites the commands. Nothing reads instanceBuffer as storage.
+		glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+	}
+
+	// One multi draw per run of meshes sharing a material array or diffuse
+	// texture, or a single one for depth only passes
+	void draw(Shader drawShader, Camera &camera, bool textured) {
+		if (meshes.empty()) return;
+		drawShader.use();
+		camera.preDraw(drawShader, false);
+		glBindVertexArray(vao);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+		GLuint first = 0;
+		while (first < meshCount) {
+			GLuint last = first + 1;
+			if (textured) {
+				while (last < meshCount && batchOf(*meshes[last]) == batchOf(*meshes[first])) last++;
+				const_cast<Mesh*>(meshes[first])->bindTextures(drawShader, false);
+			} else {
+				last = meshCount;
+			}
+			glMultiDrawElementsIndirect(GL_TRIANGLES_ADJACENCY, GL_UNSIGNED_INT,
+				(GLvoid*)(first * 5 * sizeof(GLuint)), last - first, 0);
+			first = last;
+		}
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		glBindVertexArray(0);
+	}
+
+	float maxDistance;
+
+private:
+	struct Entry {
+		Model *model;
+		unsigned version;
+	};
+
+	struct MaterialLess {
+		MaterialLess(const std::vector<const Mesh*> &pool) : pool(pool) {}
+		bool operator()(GLuint a, GLuint b) const {
+			return batchOf(*pool[a]) < batchOf(*pool[b]);
+		}
+		const std::vector<const Mesh*> &pool;
+	};
+
+	Shader shader;
+	std::vector<Entry> entries;
+	std::vector<std::vector<std::pair<Model*, float> > > lods;
+	std::vector<const Mesh*> meshes;
+	std::vector<GLuint> lodMeshes;
+	std::unordered_map<const Model*, std::pair<GLuint, GLuint> > modelRanges;
+	std::vector<GLuint> templateCommands;
+	GLuint vao, vbo, ebo, objectBuffer, commandBuffer, templateBuffer, instanceBuffer, lodMeshBuffer, layerBuffer;
+	GLuint meshCount, objectCount;
+
+	// Meshes with the same key share their textures' binding
+	static GLuint batchOf(const Mesh &mesh) {
+		if (mesh.materials && mesh.materials->isBuilt(mesh.material)) {
+			return mesh.materials->getArray(mesh.material);
+		}
+		return mesh.textures.empty() ? 0 : mesh.textures[0].id;
+	}
+
+	static void addMeshes(Model &model, std::vector<const Mesh*> &pool) {
+		for (GLuint i = 0; i < model.getMeshes().size(); ++i) pool.push_back(&model.getMeshes()[i]);
+	}
+
+	void addRange(Model &model, std::unordered_map<const Mesh*, GLuint> &meshIndex) {
+		if (modelRanges.count(&model)) return;
+		modelRanges[&model] = std::make_pair((GLuint)lodMeshes.size(), (GLuint)model.getMeshes().size());
+		for (GLuint i = 0; i < model.getMeshes().size(); ++i) lodMeshes.push_back(meshIndex[&model.getMeshes()[i]]);
+	}
+};
+
+//////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////
+
+struct CubeMap {
+	// Faces sharing a file share one read: a .dds sibling when every face
+	// has one of the same format, otherwise one decode through ImageCache.
+	// GL won't complete a cube mixing compressed and uncompressed faces.
+	CubeMap(char **list, GLenum active) {
+		std::string asset = std::string("cube map ") + list[0];
+		LOAD_ASSET_TIMER("CubeMap", asset);
+		std::map<std::string, std::shared_ptr<CompressedImage> > compressed;
+		std::vector<std::shared_ptr<CompressedImage> > dds(6);
+		bool allCompressed = true;
+		for (int i = 0; i < 6 && allCompressed; ++i) {
+			std::string path = compressedSibling(list[i]);
+			if (path != list[i] && !compressed.count(path)) {
+				std::shared_ptr<CompressedImage> image(new CompressedImage());
+				if (!readDdsFile(path, *image)) image.reset();
+				compressed[path] = image;
+			}
+			if (path != list[i]) dds[i] = compressed[path];
+			allCompressed = dds[i] && dds[i]->format == dds[0]->format && dds[i]->width == dds[0]->width
+				&& dds[i]->height == dds[0]->height;
+		}
+
+		glGenTextures(1, &tid);
+		glActiveTexture(active);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, tid);
+		GLint levels = 1;
+		if (allCompressed) {
+			levels = dds[0]->levelSizes.size();
+			for (int i = 1; i < 6; ++i) levels = std::min(levels, (GLint)dds[i]->levelSizes.size());
+			for (int i = 0; i < 6; ++i) {
+				const unsigned char *data = &dds[i]->data[0];
+				for (GLint l = 0; l < levels; ++l) {
+					glCompressedTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, l, dds[i]->format,
+						std::max(dds[i]->width >> l, 1), std::max(dds[i]->height >> l, 1), 0, dds[i]->levelSizes[l], data);
+					data += dds[i]->levelSizes[l];
+				}
+			}
+		} else {
+			std::vector<std::shared_ptr<Image> > images =
+				ImageCache::get().loadAll(std::vector<std::string>(list, list + 6));
+			for (int i = 0; i < 6; ++i) {
+				if (!images[i]) {
+					std::cerr << "Load cube map failed" << std::endl;
+					throw false;
+				}
+				LOAD_PROFILER(addCounts(asset, images[i]->pixels.size(), 0, 0));
+				glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGBA8, images[i]->width, images[i]->height,
+					0, GL_RGBA, GL_UNSIGNED_BYTE, &images[i]->pixels[0]);
+			}
+		}
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, levels - 1);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);  
+		glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	}
+
+	GLuint getTid() {
+		return tid;
+	}
+
+private:
+	GLuint tid;
+};
+
+struct Light {
+	glm::vec3 position, ambient, diffuse, specular;
+	unsigned version;
+
+	Light() : position(0.0f),
+		ambient(0.45f), diffuse(1.0f), specular(0.6f), version(0) {
+	}
+
+	void setPosition(glm::vec3 p) {
+		if (p != position) {
+			position = p;
+			version++;
+		}
+	}
+
+	void preDraw(Shader shader) {
+		glUniform3fv(glGetUniformLocation(shader.getProgId(), "light.position"), 1, glm::value_ptr(position));
+		glUniform3fv(glGetUniformLocation(shader.getProgId(), "light.ambient"), 1, glm::value_ptr(ambient));
+		glUniform3fv(glGetUniformLocation(shader.getProgId(), "light.diffuse"), 1, glm::value_ptr(diffuse));
+		glUniform3fv(glGetUniformLocation(shader.getProgId(), "light.specular"), 1, glm::value_ptr(specular));
+	}
+};
+
+// GL_LINEAR on a depth compare texture gives 2x2 hardware PCF in one fetch,
+// taps > 1 adds a Poisson kernel of that many fetches on top
+struct ShadowSettings {
+	GLsizei width, height;
+	GLenum format;
+	GLenum filter;
+	GLuint taps;
+	float bias;
+};
+
+struct ShadowMap {
+
+	ShadowMap(const ShadowSettings &settings)
+		: partialUpdate(SHADOW_PARTIAL_UPDATE), fitToCasters(SHADOW_FIT),
+		  lightVersion(0), valid(false), renderCount(0), gpuScene(NULL) {
+
+		glGenFramebuffers(1, &fbo);
+		glGenTextures(1, &tid);
+		configure(settings);
+	}
+
+	void configure(const ShadowSettings &settings) {
+		this->settings = settings;
+		width = settings.width;
+		height = settings.height;
+
+		GLfloat border[] = {1.0f, 0.0f, 0.0f, 0.0f};
+		glBindTexture(GL_TEXTURE_2D, tid);
+		glTexImage2D(GL_TEXTURE_2D, 0, settings.format, 
+					 width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, settings.filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, settings.filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER); 
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);  
+		glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tid, 0);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);  
+		valid = false;
+	}
+
+	void preDraw(Shader shader) {
+		glUniform1ui(glGetUniformLocation(shader.getProgId(), "shadowTaps"), settings.taps);
+		glUniform1f(glGetUniformLocation(shader.getProgId(), "shadowBias"), settings.bias);
+	}
+
+	// Re-renders only when the light, the fitted projection or a caster
+	// changed since the last render. With partialUpdate, a moved caster
+	// only re-renders the scissored union of its old and new footprint
+	// in the map. Returns true if anything was drawn.
+	bool update(Shader &shader, Light &light, std::vector<Model*> &casters, Camera &viewCamera) {
+		glm::mat4 lastView = camera.getViewMatrix(false), lastPersp = camera.persp;
+		if (fitToCasters) {
+			fit(light, casters);
+		} else {
+			camera = Camera();
+			camera.lookFrom = light.position;
+		}
+		glm::mat4 m = getMatrix();
+
+		bool full = !valid || light.version != lightVersion || casters.size() != states.size() ||
+			lastView != camera.getViewMatrix(false) || lastPersp != camera.persp;
+		glm::ivec4 dirty(width, height, 0, 0);
+		if (!full) {
+			for (GLuint i = 0; i < casters.size(); ++i) {
+				if (states[i].model != casters[i]) {
+					full = true;
+					break;
+				}
+				if (states[i].version == casters[i]->getVersion()) continue;
+				glm::ivec4 r = footprint(m, *casters[i]);
+				dirty = unite(dirty, unite(states[i].rect, r));
+			}
+			if (!full && dirty.x >= dirty.z) return false;
+			if (!partialUpdate) full = true;
+		}
+
+		states.resize(casters.size());
+		for (GLuint i = 0; i < casters.size(); ++i) {
+			states[i].model = casters[i];
+			states[i].version = casters[i]->getVersion();
+			states[i].rect = footprint(m, *casters[i]);
+		}
+		lightVersion = light.version;
+		valid = true;
+		renderCount++;
+
+		shader.use();
+		glViewport(0, 0, width, height);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		if (!full) {
+			glEnable(GL_SCISSOR_TEST);
+			glScissor(dirty.x, dirty.y, dirty.z - dirty.x, dirty.w - dirty.y);
+		}
+		glClear(GL_DEPTH_BUFFER_BIT);
+		if (gpuScene) {
+			gpuScene->cull(m, viewCamera.lookFrom);
+			gpuScene->draw(shader, camera, false);
+		} else {
+			Frustum frustum(m);
+			std::vector<unsigned char> meshVisible;
+			for (GLuint i = 0; i < casters.size(); ++i) {
+				casters[i]->cull(frustum, meshVisible);
+				casters[i]->Draw(shader, camera, meshVisible);
+			}
+		}
+		glDisable(GL_SCISSOR_TEST);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		return true;
+	}
+
+	// Forces a full re-render on the next update
+	void invalidate() {
+		valid = false;
+	}
+
+	// Draws the casters through the scene's culled multi draw instead
+	void setGpuScene(GpuScene *scene) {
+		gpuScene = scene;
+		valid = false;
+	}
+
+	glm::mat4 getMatrix() {
+		return camera.persp * camera.getViewMatrix(false);
+	}
+
+	GLuint getTid() {
+		return tid;
+	}
+
+	unsigned getRenderCount() {
+		return renderCount;
+	}
+
+	const ShadowSettings &getSettings() {
+		return settings;
+	}
+
+	bool partialUpdate, fitToCasters;
+
+private:
+	struct CasterState {
+		Model *model;
+		unsigned version;
+		glm::ivec4 rect;
+	};
+
+	ShadowSettings settings;
+	GLsizei width, height;
+	GLuint tid, fbo;
+	Camera camera;
+	std::vector<CasterState> states;
+	unsigned lightVersion;
+	bool valid;
+	unsigned renderCount;
+	GpuScene *gpuScene;
+
+	static glm::ivec4 unite(glm::ivec4 a, glm::ivec4 b) {
+		return glm::ivec4(std::min(a.x, b.x), std::min(a.y, b.y), std::max(a.z, b.z), std::max(a.w, b.w));
+	}
+
+	// Light-space tangent rect (x0, y0, x1, y1) and depth range of a box
+	// seen from the light, false if part of it is behind the light
+	static bool lightRect(const glm::mat4 &view, glm::vec3 bMin, glm::vec3 bMax,
+		glm::vec4 &rect, glm::vec2 &depth) {
+		rect = glm::vec4(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+			-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+		depth = glm::vec2(std::numeric_limits<float>::max(), 0.0f);
+		for (int i = 0; i < 8; ++i) {
+			glm::vec4 c = view * glm::vec4(
+				(i & 1) ? bMax.x : bMin.x,
+				(i & 2) ? bMax.y : bMin.y,
+				(i & 4) ? bMax.z : bMin.z, 1.0f);
+			float d = -c.z;
+			if (d < 0.1f) return false;
+			rect = glm::vec4(glm::min(glm::vec2(rect), glm::vec2(c) / d), glm::max(glm::vec2(rect.z, rect.w), glm::vec2(c) / d));
+			depth = glm::vec2(std::min(depth.x, d), std::max(depth.y, d));
+		}
+		return true;
+	}
+
+	// Perspective projection from the light fitted to the casters' bounds.
+	// It doesn't depend on the view, so a moving camera keeps the cached map.
+	void fit(Light &light, std::vector<Model*> &casters) {
+		glm::vec3 sMin(std::numeric_limits<float>::max()), sMax(-std::numeric_limits<float>::max());
+		for (GLuint i = 0; i < casters.size(); ++i) {
+			glm::vec3 bMin, bMax;
+			casters[i]->getWorldBounds(bMin, bMax);
+			sMin = glm::min(sMin, bMin);
+			sMax = glm::max(sMax, bMax);
+		}
+		camera.lookFrom = light.position;
+		camera.lookAt = casters.empty() ? glm::vec3(0.0f) : (sMin + sMax) * 0.5f;
+		glm::vec3 dir = glm::normalize(camera.lookAt - camera.lookFrom);
+		camera.lookUp = std::abs(dir.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+		glm::mat4 view = camera.getViewMatrix(false);
+
+		glm::vec4 rect(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+			-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+		glm::vec2 depth(std::numeric_limits<float>::max(), 0.0f);
+		for (GLuint i = 0; i < casters.size(); ++i) {
+			glm::vec3 bMin, bMax;
+			glm::vec4 r;
+			glm::vec2 d;
+			casters[i]->getWorldBounds(bMin, bMax);
+			if (!lightRect(view, bMin, bMax, r, d)) {
+				camera.persp = Camera().persp;
+				return;
+			}
+			rect = glm::vec4(glm::min(glm::vec2(rect), glm::vec2(r)), glm::max(glm::vec2(rect.z, rect.w), glm::vec2(r.z, r.w)));
+			depth = glm::vec2(std::min(depth.x, d.x), std::max(depth.y, d.y));
+		}
+		if (rect.x >= rect.z) {
+			camera.persp = Camera().persp;
+			return;
+		}
+		float n = std::max(depth.x * 0.99f, 0.1f), f = depth.y * 1.01f;
+		camera.persp = glm::frustum(rect.x * n, rect.z * n, rect.y * n, rect.w * n, n, f);
+	}
+
+	// Pixel rect (x0, y0, x1, y1) covered by the caster's world bounds in the map
+	glm::ivec4 footprint(const glm::mat4 &m, const Model &model) {
+		glm::vec3 bMin, bMax;
+		model.getWorldBounds(bMin, bMax);
+		glm::vec2 lo(1.0f), hi(-1.0f);
+		for (int i = 0; i < 8; ++i) {
+			glm::vec4 c = m * glm::vec4(
+				(i & 1) ? bMax.x : bMin.x,
+				(i & 2) ? bMax.y : bMin.y,
+				(i & 4) ? bMax.z : bMin.z, 1.0f);
+			if (c.w <= 0.0f) return glm::ivec4(0, 0, width, height);
+			glm::vec2 ndc = glm::vec2(c) / c.w;
+			lo = glm::min(lo, ndc);
+			hi = glm::max(hi, ndc);
+		}
+		lo = glm::clamp(lo, -1.0f, 1.0f);
+		hi = glm::clamp(hi, -1.0f, 1.0f);
+		return glm::ivec4(
+			std::max((int)std::floor((lo.x * 0.5f + 0.5f) * width) - 1, 0),
+			std::max((int)std::floor((lo.y * 0.5f + 0.5f) * height) - 1, 0),
+			std::min((int)std::ceil((hi.x * 0.5f + 0.5f) * width) + 1, (int)width),
+			std::min((int)std::ceil((hi.y * 0.5f + 0.5f) * height) + 1, (int)height));
+	}
+};
+
+// Directional cascades along the light -> origin axis. Each split of the
+// view frustum gets an ortho projection around its bounding sphere,
+// snapped to whole texels so the cascades don't shimmer as the camera moves.
+struct CascadedShadowMap {
+
+	CascadedShadowMap(const ShadowSettings &settings, GLuint count)
+		: lambda(SHADOW_CASCADE_LAMBDA), settings(settings), count(std::min(count, (GLuint)MAX_CASCADES)),
+		  culledCount(0), gpuScene(NULL) {
+
+		GLfloat border[] = {1.0f, 0.0f, 0.0f, 0.0f};
+		glGenTextures(1, &tid);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, tid);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, settings.format, settings.width, settings.height,
+					 std::max(this->count, (GLuint)1), 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, settings.filter);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, settings.filter);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER); 
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);  
+		glTexParameterfv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BORDER_COLOR, border);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		for (GLuint i = 0; i < MAX_CASCADES; ++i) {
+			matrices[i] = glm::mat4(1.0f);
+			splits[i] = CAMERA_FAR;
+		}
+	}
+
+	// Re-renders each cascade only when its projection or one of the
+	// casters it contains changed
+	void update(Shader &shader, Light &light, std::vector<Model*> &casters, Camera &viewCamera) {
+		float n = CAMERA_NEAR, f = CAMERA_FAR;
+		for (GLuint i = 0; i < count; ++i) {
+			float p = (i + 1) / (float)count;
+			splits[i] = lambda * n * std::pow(f / n, p) + (1.0f - lambda) * (n + (f - n) * p);
+		}
+
+		glm::mat4 invViewProj = glm::inverse(viewCamera.persp * viewCamera.getViewMatrix(false));
+		glm::vec3 nearCorners[4], farCorners[4];
+		for (int i = 0; i < 4; ++i) {
+			glm::vec4 a = invViewProj * glm::vec4((i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f, -1.0f, 1.0f);
+			glm::vec4 b = invViewProj * glm::vec4((i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f, 1.0f, 1.0f);
+			nearCorners[i] = glm::vec3(a) / a.w;
+			farCorners[i] = glm::vec3(b) / b.w;
+		}
+
+		lightCamera.lookFrom = glm::vec3(0.0f);
+		lightCamera.lookAt = glm::normalize(-light.position);
+		lightCamera.lookUp = std::abs(lightCamera.lookAt.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+		glm::mat4 view = lightCamera.getViewMatrix(false);
+
+		std::vector<glm::vec3> cMin(casters.size()), cMax(casters.size());
+		for (GLuint j = 0; j < casters.size(); ++j) {
+			glm::vec3 bMin, bMax;
+			casters[j]->getWorldBounds(bMin, bMax);
+			cMin[j] = glm::vec3(std::numeric_limits<float>::max());
+			cMax[j] = glm::vec3(-std::numeric_limits<float>::max());
+			for (int k = 0; k < 8; ++k) {
+				glm::vec3 c = glm::vec3(view * glm::vec4(
+					(k & 1) ? bMax.x : bMin.x, (k & 2) ? bMax.y : bMin.y, (k & 4) ? bMax.z : bMin.z, 1.0f));
+				cMin[j] = glm::min(cMin[j], c);
+				cMax[j] = glm::max(cMax[j], c);
+			}
+		}
+
+		culledCount = 0;
+		float sliceNear = n;
+		for (GLuint i = 0; i < count; ++i) {
+			float a = (sliceNear - n) / (f - n), b = (splits[i] - n) / (f - n);
+			sliceNear = splits[i];
+			glm::vec3 corners[8], center(0.0f);
+			for (int k = 0; k < 4; ++k) {
+				corners[k] = nearCorners[k] + (farCorners[k] - nearCorners[k]) * a;
+				corners[k + 4] = nearCorners[k] + (farCorners[k] - nearCorners[k]) * b;
+			}
+			for (int k = 0; k < 8; ++k) center += corners[k] / 8.0f;
+			float radius = 0.0f;
+			for (int k = 0; k < 8; ++k) radius = std::max(radius, glm::length(corners[k] - center));
+			radius = std::ceil(radius * 16.0f) / 16.0f;
+
+			float texel = 2.0f * radius / settings.width;
+			glm::vec3 lc = glm::vec3(view * glm::vec4(center, 1.0f));
+			lc.x = std::floor(lc.x / texel) * texel;
+			lc.y = std::floor(lc.y / texel) * texel;
+
+			// View space looks down -z, so the light side of the slice is the max z
+			float zNear = -(lc.z + radius), zFar = -(lc.z - radius);
+			std::vector<unsigned> versions(casters.size(), (unsigned)-1);
+			for (GLuint j = 0; j < casters.size(); ++j) {
+				bool inside = cMin[j].x < lc.x + radius && cMax[j].x > lc.x - radius &&
+					cMin[j].y < lc.y + radius && cMax[j].y > lc.y - radius &&
+					-cMax[j].z < zFar;
+				if (!inside) {
+					culledCount++;
+					continue;
+				}
+				versions[j] = casters[j]->getVersion();
+				zNear = std::min(zNear, -cMax[j].z);
+			}
+			lightCamera.persp = glm::ortho(lc.x - radius, lc.x + radius, lc.y - radius, lc.y + radius,
+				zNear - 1.0f, zFar);
+			glm::mat4 m = lightCamera.persp * view;
+
+			if (m == matrices[i] && versions == lastVersions[i]) continue;
+			matrices[i] = m;
+			lastVersions[i] = versions;
+
+			shader.use();
+			glViewport(0, 0, settings.width, settings.height);
+			glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+			glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, tid, 0, i);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			if (gpuScene) {
+				gpuScene->cull(m, viewCamera.lookFrom);
+				gpuScene->draw(shader, lightCamera, false);
+			} else {
+				Frustum frustum(m);
+				std::vector<unsigned char> meshVisible;
+				for (GLuint j = 0; j < casters.size(); ++j) {
+					if (versions[j] == (unsigned)-1) continue;
+					casters[j]->cull(frustum, meshVisible);
+					casters[j]->Draw(shader, lightCamera, meshVisible);
+				}
+			}
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		}
+	}
+
+	void preDraw(Shader shader) {
+		glUniformMatrix4fv(glGetUniformLocation(shader.getProgId(), "cascadeMatrices"),
+			count, GL_FALSE, glm::value_ptr(matrices[0]));
+		glUniform4fv(glGetUniformLocation(shader.getProgId(), "cascadeSplits"), 1, splits);
+		glUniform1f(glGetUniformLocation(shader.getProgId(), "cascadeBias"), settings.bias);
+	}
+
+	GLuint getTid() {
+		return tid;
+	}
+
+	GLuint getCount() {
+		return count;
+	}
+
+	unsigned getCulledCount() {
+		return culledCount;
+	}
+
+	// Draws the casters through the scene's culled multi draw instead
+	void setGpuScene(GpuScene *scene) {
+		gpuScene = scene;
+		for (GLuint i = 0; i < MAX_CASCADES; ++i) {
+			lastVersions[i].clear();
+		}
+	}
+
+	// Blend between logarithmic (1) and uniform (0) split distances
+	float lambda;
+
+private:
+	ShadowSettings settings;
+	GLuint count, tid, fbo;
+	Camera lightCamera;
+	glm::mat4 matrices[MAX_CASCADES];
+	GLfloat splits[MAX_CASCADES];
+	std::vector<unsigned> lastVersions[MAX_CASCADES];
+	unsigned culledCount;
+	GpuScene *gpuScene;
+};
+
+// Depth prepass of the occluders into a max-reduced depth pyramid, then
+// each mesh's bounds are tested against it on the GPU. Hidden meshes get
+// an indirect command with no instances, so the CPU never waits on results.
+struct OcclusionCuller {
+
+	OcclusionCuller()
+		: hizShader(1, "../a1/hiz.comp", GL_COMPUTE_SHADER),
+		  testShader(1, "../a1/occlusion.comp", GL_COMPUTE_SHADER),
+		  occludedCount(0), frame(0) {
+
+		glGenTextures(1, &depthTid);
+		glBindTexture(GL_TEXTURE_2D, depthTid);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, HIZ_WIDTH * 2, HIZ_HEIGHT * 2,
+			0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+		levels = 1;
+		while ((HIZ_WIDTH >> levels) > 0 || (HIZ_HEIGHT >> levels) > 0) levels++;
+		glGenTextures(1, &hizTid);
+		glBindTexture(GL_TEXTURE_2D, hizTid);
+		glTexStorage2D(GL_TEXTURE_2D, levels, GL_R32F, HIZ_WIDTH, HIZ_HEIGHT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTid, 0);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		glGenBuffers(1, &boundsBuffer);
+		glGenBuffers(2, commandBuffers);
+		glGenBuffers(2, counterBuffers);
+		for (int i = 0; i < 2; ++i) {
+			GLuint zero = 0;
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, counterBuffers[i]);
+			glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), &zero, GL_DYNAMIC_READ);
+			fences[i] = 0;
+		}
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+
+	// Leaves the command buffer bound to GL_DRAW_INDIRECT_BUFFER and the
+	// models drawing from it until finish
+	void update(Shader &depthShader, std::vector<Model*> &models, Camera &camera) {
+		std::vector<MeshBoundsGPU> bounds;
+		std::vector<GLint> bases(models.size());
+		for (GLuint i = 0; i < models.size(); ++i) {
+			bases[i] = bounds.size();
+			models[i]->appendBounds(bounds);
+		}
+		std::vector<GLuint> counts(bounds.size());
+		for (GLuint i = 0; i < bounds.size(); ++i) {
+			counts[i] = bounds[i].info[0];
+		}
+		int slot = frame++ % 2;
+
+		// The depth only needs what passed last frame's test, the meshes it
+		// hid can't hide anything. Until the meshes match last frame's, all
+		// the ones in the view are drawn.
+		bool previous = frame > 1 && counts == lastCounts;
+		for (GLuint i = 0; i < models.size(); ++i) {
+			models[i]->setIndirectBase(previous ? bases[i] : -1);
+		}
+		if (previous) glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffers[1 - slot]);
+		depthShader.use();
+		glViewport(0, 0, HIZ_WIDTH * 2, HIZ_HEIGHT * 2);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		for (GLuint i = 0; i < models.size(); ++i) {
+			models[i]->Draw(depthShader, camera);
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		for (GLuint i = 0; i < models.size(); ++i) {
+			models[i]->setIndirectBase(bases[i]);
+		}
+		lastCounts.swap(counts);
+
+		hizShader.use();
+		glUniform1i(glGetUniformLocation(hizShader.getProgId(), "srcTex"), 0);
+		glUniform1i(glGetUniformLocation(hizShader.getProgId(), "dstImg"), 0);
+		glActiveTexture(GL_TEXTURE0);
+		for (GLint level = 0; level < levels; ++level) {
+			glBindTexture(GL_TEXTURE_2D, level == 0 ? depthTid : hizTid);
+			glUniform1i(glGetUniformLocation(hizShader.getProgId(), "srcLevel"), level == 0 ? 0 : level - 1);
+			glBindImageTexture(0, hizTid, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+			GLuint w = std::max(HIZ_WIDTH >> level, 1), h = std::max(HIZ_HEIGHT >> level, 1);
+			glDispatchCompute((w + 7) / 8, (h + 7) / 8, 1);
+			glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+		}
+
+		if (bounds.empty()) return;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, boundsBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, bounds.size() * sizeof(MeshBoundsGPU), &bounds[0], GL_STREAM_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, commandBuffers[slot]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, bounds.size() * 5 * sizeof(GLuint), NULL, GL_STREAM_DRAW);
+
+		// Read the count from two frames ago if the GPU is done with it
+		if (fences[slot]) {
+			if (glClientWaitSync(fences[slot], 0, 0) != GL_TIMEOUT_EXPIRED) {
+				glBindBuffer(GL_SHADER_STORAGE_BUFFER, counterBuffers[slot]);
+				glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &occludedCount);
+			}
+			glDeleteSync(fences[slot]);
+		}
+		GLuint zero = 0;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, counterBuffers[slot]);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &zero);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+		testShader.use();
+		glUniformMatrix4fv(glGetUniformLocation(testShader.getProgId(), "viewProj"), 1, GL_FALSE,
+			glm::value_ptr(camera.persp * camera.getViewMatrix(false)));
+		glUniform1ui(glGetUniformLocation(testShader.getProgId(), "meshCount"), bounds.size());
+		glUniform1i(glGetUniformLocation(testShader.getProgId(), "hizTex"), 0);
+		glBindTexture(GL_TEXTURE_2D, hizTid);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, boundsBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, commandBuffers[slot]);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, counterBuffers[slot]);
+		glDispatchCompute((bounds.size() + 63) / 64, 1, 1);
+		glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+		fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffers[slot]);
+	}
+
+	void finish(std::vector<Model*> &models) {
+		for (GLuint i = 0; i < models.size(); ++i) {
+			models[i]->setIndirectBase(-1);
+		}
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+
+	// Meshes hidden by occluders, lags the current frame by two
+	GLuint getOccludedCount() {
+		return occludedCount;
+	}
+
+private:
+	Shader hizShader, testShader;
+	GLuint depthTid, hizTid, fbo;
+	GLint levels;
+	// Commands alternate so the depth pass can draw from last frame's
+	GLuint boundsBuffer, commandBuffers[2], counterBuffers[2];
+	GLsync fences[2];
+	GLuint occludedCount;
+	unsigned frame;
+	// Index counts of the meshes last frame's commands were made for
+	std::vector<GLuint> lastCounts;
+};
+
+struct SkyBox {
+
+	SkyBox(char **list) 
+		: skyShader(2, 
+			"../a1/skybox.vert", GL_VERTEX_SHADER,
+			"../a1/skybox.frag", GL_FRAGMENT_SHADER),
+		cubeMap(list, GL_TEXTURE0) {
+
+		texId = glGetUniformLocation(skyShader.getProgId(), "skyTex");
+
+		glGenVertexArrays(1, &vao);
+		glGenBuffers(1, &vbo);
+		glGenBuffers(1, &ebo);
+  
+		glBindVertexArray(vao);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, 24 * sizeof(GLfloat), &SkyBox::skyCubeVertices[0], GL_STATIC_DRAW);  
+
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, 36 * sizeof(GLuint), &SkyBox::skyCubeIndices[0], GL_STATIC_DRAW);
+
+		glEnableVertexAttribArray(0);	
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (GLvoid*)0);
+
+		glBindVertexArray(0);
+	}
+
+	// Rebuilds skyShader if canonical is one of its files
+	void reload(const std::string &canonical) {
+		if (skyShader.uses(canonical) && skyShader.reload()) {
+			texId = glGetUniformLocation(skyShader.getProgId(), "skyTex");
+		}
+	}
+
+	void draw(Camera &camera) {
+		camera.preDraw(skyShader, true);
+		glBindVertexArray(vao);
+		glActiveTexture(GL_TEXTURE0);
+		glUniform1i(texId, 0);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, cubeMap.getTid());
+		glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, NULL);
+		glBindVertexArray(0);
+	}
+
+	Shader skyShader;
+
+private:
+	static GLfloat skyCubeVertices[];
+	static GLuint skyCubeIndices[];
+	
+	CubeMap cubeMap;
+	GLint texId;
+	GLuint vao, vbo, ebo;
+};
+
+GLfloat SkyBox::skyCubeVertices[] = {
+	-1.0f, -1.0f, -1.0f,
+	-1.0f, 1.0f, -1.0f,
+	1.0f, 1.0f, -1.0f,
+	1.0f, -1.0f, -1.0f,
+
+	-1.0f, -1.0f, 1.0f,
+	-1.0f, 1.0f, 1.0f,
+	1.0f, 1.0f, 1.0f,
+	1.0f, -1.0f, 1.0f,
+};
+
+GLuint SkyBox::skyCubeIndices[] = {
+	0, 1, 2, 0, 2, 3,
+	4, 5, 6, 4, 6, 7,
+	0, 1, 5, 0, 5, 4,
+	2, 3, 7, 2, 7, 6,
+	1, 2, 6, 1, 6, 5,
+	0, 3, 7, 0, 7, 4
+};
+
+// Collects files changed on disk under the watched directories. inotify
+// reports them on Linux, elsewhere a thread compares write times every
+// HOT_RELOAD_POLL_MS.
+struct FileWatcher {
+
+	FileWatcher() : quit(false) {
+#ifndef _WIN32
+		fd = -1;
+#endif
+	}
+
+	~FileWatcher() {
+		quit = true;
+		if (thread.joinable()) thread.join();
+#ifndef _WIN32
+		if (fd >= 0) ::close(fd);
+#endif
+	}
+
+	// Call before start
+	void watch(const std::string &dir) {
+		dirs.push_back(dir);
+	}
+
+	void start() {
+#ifdef _WIN32
+		for (GLuint i = 0; i < dirs.size(); ++i) scan(dirs[i], false);
+#else
+		fd = inotify_init1(IN_NONBLOCK);
+		if (fd < 0) {
+			std::cerr << "inotify unavailable, hot reload is off" << std::endl;
+			return;
+		}
+		for (GLuint i = 0; i < dirs.size(); ++i) {
+			// Editors either write in place or rename a temporary over the file
+			int wd = inotify_add_watch(fd, dirs[i].c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+			if (wd >= 0) watched[wd] = dirs[i];
+		}
+#endif
+		thread = std::thread(&FileWatcher::run, this);
+	}
+
+	// canonicalPath of every file changed since the last call
+	std::vector<std::string> takeChanges() {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<std::string> out(changed.begin(), changed.end());
+		changed.clear();
+		return out;
+	}
+
+private:
+	std::vector<std::string> dirs;
+	std::atomic<bool> quit;
+	std::thread thread;
+	std::mutex mutex;
+	std::set<std::string> changed;
+#ifdef _WIN32
+	std::map<std::string, unsigned long long> times;
+#else
+	int fd;
+	std::map<int, std::string> watched;
+#endif
+
+	FileWatcher(const FileWatcher &);
+	FileWatcher &operator=(const FileWatcher &);
+
+	void add(const std::string &path) {
+		std::string canonical = canonicalPath(path);
+		std::lock_guard<std::mutex> lock(mutex);
+		changed.insert(canonical);
+	}
+
+	void run() {
+		while (!quit) {
+#ifdef _WIN32
+			std::this_thread::sleep_for(std::chrono::milliseconds(HOT_RELOAD_POLL_MS));
+			for (GLuint i = 0; i < dirs.size(); ++i) scan(dirs[i], true);
+#else
+			// Wakes up now and then to see quit
+			struct pollfd p = { fd, POLLIN, 0 };
+			if (::poll(&p, 1, 100) <= 0) continue;
+			union {
+				inotify_event event;
+				char bytes[4096];
+			} buffer;
+			ssize_t n = read(fd, buffer.bytes, sizeof(buffer.bytes));
+			for (ssize_t at = 0; at < n; ) {
+				const inotify_event *e = (const inotify_event*)(buffer.bytes + at);
+				std::map<int, std::string>::iterator dir = watched.find(e->wd);
+				if (e->len && dir != watched.end()) add(dir->second + "/" + e->name);
+				at += sizeof(inotify_event) + e->len;
+			}
+#endif
+		}
+	}
+
+#ifdef _WIN32
+	void scan(const std::string &dir, bool report) {
+		WIN32_FIND_DATAA data;
+		HANDLE find = FindFirstFileA((dir + "/*").c_str(), &data);
+		if (find == INVALID_HANDLE_VALUE) return;
+		do {
+			if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+			std::string path = dir + "/" + data.cFileName;
+			unsigned long long time = ((unsigned long long)data.ftLastWriteTime.dwHighDateTime << 32)
+				| data.ftLastWriteTime.dwLowDateTime;
+			std::map<std::string, unsigned long long>::iterator t = times.find(path);
+			if (report && (t == times.end() || t->second != time)) add(path);
+			times[path] = time;
+		} while (FindNextFileA(find, &data));
+		FindClose(find);
+	}
+#endif
+};
+
+enum GpuPass {
+	PASS_SHADOW, PASS_SKYBOX, PASS_CHARACTERS, PASS_FLOOR, PASS_PORTRAIT, PASS_COUNT
+};
+
+// GL_TIME_ELAPSED around each pass. Frames cycle through GPU_TIMER_LATENCY
+// sets of queries and a set is only read back when it comes round again,
+// so the results are there already; one still pending is dropped instead
+// of waited on. The last GPU_TIMER_WINDOW frames are kept for averages.
+// Queries can't nest, so this is off while a benchmark times whole frames.
+struct GpuPassTimer {
+	GpuPassTimer() : frame(0), samples(0), enabled(GPU_PASS_TIMING) {
+		std::memset(issued, 0, sizeof(issued));
+	}
+
+	void init() {
+		glGenQueries(GPU_TIMER_LATENCY * PASS_COUNT, &queries[0][0]);
+	}
+
+	void setEnabled(bool enabled) {
+		this->enabled = enabled;
+	}
+
+	void begin(GpuPass pass) {
+		if (!enabled) return;
+		glBeginQuery(GL_TIME_ELAPSED, queries[frame % GPU_TIMER_LATENCY][pass]);
+	}
+
+	void end(GpuPass pass) {
+		if (!enabled) return;
+		glEndQuery(GL_TIME_ELAPSED);
+		issued[frame % GPU_TIMER_LATENCY][pass] = true;
+	}
+
+	// Collects the set the next frame is about to reuse
+	void endFrame() {
+		if (!enabled) return;
+		frame++;
+		GLuint set = frame % GPU_TIMER_LATENCY;
+		if (frame < GPU_TIMER_LATENCY) return;
+		GLuint row = samples % GPU_TIMER_WINDOW;
+		frames[row] = frame - GPU_TIMER_LATENCY;
+		for (GLuint p = 0; p < PASS_COUNT; ++p) {
+			window[row][p] = -1.0;
+			if (!issued[set][p]) continue;
+			issued[set][p] = false;
+			GLint available = 0;
+			glGetQueryObjectiv(queries[set][p], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available) continue;
+			GLuint64 ns;
+			glGetQueryObjectui64v(queries[set][p], GL_QUERY_RESULT, &ns);
+			window[row][p] = ns / 1.0e6;
+		}
+		samples++;
+	}
+
+	// Milliseconds over the frames in the window that have this pass
+	double average(GpuPass pass) const {
+		double total = 0.0;
+		GLuint count = 0;
+		for (GLuint i = 0; i < std::min(samples, (GLuint)GPU_TIMER_WINDOW); ++i) {
+			if (window[i][pass] < 0.0) continue;
+			total += window[i][pass];
+			count++;
+		}
+		return count ? total / count : 0.0;
+	}
+
+	std::string summary() const {
+		std::stringstream out;
+		out.precision(2);
+		out << std::fixed;
+		for (GLuint p = 0; p < PASS_COUNT; ++p) {
+			out << (p ? " | " : "") << names[p] << " " << average((GpuPass)p) << " ms";
+		}
+		return out.str();
+	}
+
+	// One row per frame in the window, oldest first, empty where a result was dropped
+	bool writeCsv(const std::string &path) const {
+		std::ofstream out(path.c_str());
+		if (!out.is_open()) {
+			std::cerr << "can't write " << path << std::endl;
+			return false;
+		}
+		out << "frame";
+		for (GLuint p = 0; p < PASS_COUNT; ++p) out << "," << names[p] << "_ms";
+		out << std::endl;
+		GLuint count = std::min(samples, (GLuint)GPU_TIMER_WINDOW);
+		for (GLuint i = 0; i < count; ++i) {
+			GLuint row = (samples - count + i) % GPU_TIMER_WINDOW;
+			out << frames[row];
+			for (GLuint p = 0; p < PASS_COUNT; ++p) {
+				out << ",";
+				if (window[row][p] >= 0.0) out << window[row][p];
+			}
+			out << std::endl;
+		}
+		std::cout << path << ": " << count << " frames" << std::endl;
+		return true;
+	}
+
+private:
+	static const char *names[PASS_COUNT];
+	GLuint queries[GPU_TIMER_LATENCY][PASS_COUNT];
+	bool issued[GPU_TIMER_LATENCY][PASS_COUNT];
+	GLuint frame;
+	GLuint samples;
+	GLuint frames[GPU_TIMER_WINDOW];
+	// Milliseconds, negative where the pass has no result
+	double window[GPU_TIMER_WINDOW][PASS_COUNT];
+	bool enabled;
+};
+
+const char *GpuPassTimer::names[PASS_COUNT] = {
+	"shadow", "skybox", "characters", "floor", "portrait"
+};
+
+class Program {
+	static char *skyBoxList[];
+	static ShadowSettings defaultShadowSettings, cascadeShadowSettings;
+	Shader defaultShader, shadowShader;
+	Light light;
+	Camera camera;
+	SkyBox skyBox;
+	Mesh floor;
+	Model goku, vegeta, portrait;
+	// Drawn only by GpuScene, in place of goku's far copies
+	Model gokuLod;
+	float rotation;
+	GLint edgeWidthId, extendId, nonsenseId, vId, gId, sMapId, sMatId, cMapId, cCountId;
+	glm::mat4 floorModel;
+	ShadowMap shadowMap;
+	CascadedShadowMap cascadeMap;
+	bool cascaded;
+	GLuint culledMeshes;
+	OcclusionCuller occlusion;
+	bool occlusionCulling;
+	std::vector<Model*> occlusionModels;
+	MaterialSystem materials;
+	bool materialsBuilt;
+	GpuScene gpuScene;
+	bool gpuDriven;
+	bool sceneBuilt;
+	bool profileWritten;
+	bool materialsDirty;
+	// Framebuffer the scene ends up in, 0 for the window
+	GLuint target;
+	bool hotReload;
+	GpuPassTimer passTimer;
+	FileWatcher watcher;
+	std::vector<Model*> shadowCasters;
+	// Models not uploaded yet
+	std::vector<Model*> loading;
+
+public:
+	
+	// Runs without hot reload when measuring, so a file saved meanwhile
+	// can't change the result
+	explicit Program(bool hotReload = HOT_RELOAD) :
+		skyBox(Program::skyBoxList),
+		shadowShader(2,
+			"../a1/shadow.vert", GL_VERTEX_SHADER,
+			"../a1/shadow.frag", GL_FRAGMENT_SHADER),
+		defaultShader(3,
+			"../a1/simple.vert", GL_VERTEX_SHADER,
+			"../a1/simple.frag", GL_FRAGMENT_SHADER,
+			"../a1/simple.geom", GL_GEOMETRY_SHADER),
+		rotation(0.0f),
+		goku("../Debug/Goku.obj", false),
+		vegeta("../Debug/Vegeta.obj", true),
+		portrait("../Debug/model.obj", false),
+		gokuLod("../Debug/Goku.obj", false, LOD_CELL),
+		shadowMap(Program::defaultShadowSettings),
+		cascadeMap(Program::cascadeShadowSettings, SHADOW_CASCADES),
+		cascaded(SHADOW_CASCADES > 0),
+		culledMeshes(0),
+		occlusionCulling(OCCLUSION_CULLING),
+		materialsBuilt(!MATERIAL_ARRAYS || TEXTURE_STREAMING),
+		gpuDriven(false),
+		sceneBuilt(false),
+		profileWritten(false),
+		materialsDirty(false),
+		target(0),
+		hotReload(hotReload) {
+
+		Vertex floorVertices[] = {
+			{
+				glm::vec3(-10000.0f, -0.0f, -10000.0f),
+				glm::vec3(0.0f, 1.0f, 0.0f),
+				glm::vec3(0.0f, 0.0f, 0.0f)
+			},
+			{
+				glm::vec3(-10000.0f, -0.0f, 10000.0f),
+				glm::vec3(0.0f, 1.0f, 0.0f),
+				glm::vec3(0.0f, 600.0f, 0.0f)
+			},
+						{
+				glm::vec3(10000.0f, -0.0f, 10000.0f),
+				glm::vec3(0.0f, 1.0f, 0.0f),
+				glm::vec3(600.0f, 600.0f, 0.0f)
+			},
+						{
+				glm::vec3(10000.0f, -0.0f, -10000.0f),
+				glm::vec3(0.0f, 1.0f, 0.0f),
+				glm::vec3(600.0f, 0.0f, 0.0f)
+			}
+		};
+
+		GLuint floorIndices[] = {
+			0, 0, 1, 1, 2, 2,
+			0, 0, 2, 2, 3, 3
+		};
+
+		floor.vertices = std::vector<Vertex>(floorVertices, floorVertices + sizeof(floorVertices) / sizeof(Vertex));
+		floor.indices = std::vector<GLuint>(floorIndices, floorIndices + sizeof(floorIndices) / sizeof(GLuint));
+		floor.textures = std::vector<Texture>();
+		floorModel = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -40.0f, 0.0f));
+
+		GLuint a = TextureFromFile("../Debug/floor.bmp", ".");
+		Texture aa = {
+			a, "texture_diffuse", aiString()
+		};
+		floor.textures.push_back(aa);
+		floor.setupMesh();
+
+		goku.setModelMatrix(
+			glm::rotate(
+			glm::scale(
+			glm::translate(
+			glm::mat4(1.0f), glm::vec3(-20.0f, -40.0f, 0.0f)), 
+			glm::vec3(1.6f)),
+			glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f)));
+
+		vegeta.setModelMatrix(
+			glm::rotate(
+			glm::scale(
+			glm::translate(
+			glm::mat4(1.0f), glm::vec3(20.0f, -40.0f, 0.0f)), 
+			glm::vec3(1.0f)),
+			glm::radians(270.0f), glm::vec3(0.0f, 1.0f, 0.0f)));
+
+		portrait.setModelMatrix(
+			glm::rotate(
+			glm::scale(
+			glm::translate(
+			glm::mat4(1.0f), glm::vec3(-45.0f, -35.0f, -45.0f)), 
+			glm::vec3(20.0f)),
+			glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f)));
+
+		// Shadow casters, occlusion and materials take the models as update() uploads them
+		loading.push_back(&goku);
+		loading.push_back(&vegeta);
+		loading.push_back(&portrait);
+		loading.push_back(&gokuLod);
+		setGpuDriven(GPU_DRIVEN);
+
+		light.setPosition(glm::vec3(-CAMERA_DIST, CAMERA_DIST, -CAMERA_DIST));
+		findUniforms();
+		passTimer.init();
+		if (hotReload) {
+			watcher.watch("../Debug");
+			watcher.watch("../a1");
+			watcher.start();
+		}
+
+		glEnable(GL_DEPTH_TEST);
+		glDepthFunc(GL_LESS);
+	}
+
+	// Locations in defaultShader, again after every reload of it
+	void findUniforms() {
+		edgeWidthId = glGetUniformLocation(defaultShader.getProgId(), "edgeWidth");
+		extendId = glGetUniformLocation(defaultShader.getProgId(), "extend");
+		nonsenseId = glGetUniformLocation(defaultShader.getProgId(), "nonsenseOff");
+		vId = glGetUniformLocation(defaultShader.getProgId(), "vegetaLoc");
+		gId = glGetUniformLocation(defaultShader.getProgId(), "gokuLoc");
+		sMapId = glGetUniformLocation(defaultShader.getProgId(), "shadowMap");
+		sMatId = glGetUniformLocation(defaultShader.getProgId(), "shadowMatrix");
+		cMapId = glGetUniformLocation(defaultShader.getProgId(), "cascadeMap");
+		cCountId = glGetUniformLocation(defaultShader.getProgId(), "shadowCascades");
+		defaultShader.use();
+		glUniform3fv(vId, 1, glm::value_ptr(glm::vec3(20.0f, -40.0f, 0.0f)));
+		glUniform3fv(gId, 1, glm::value_ptr(glm::vec3(-20.0f, -40.0f, 0.0f)));
+	}
+
+	// Re-imports just what changed on disk. Models and textures decode on
+	// their threads and swap in between frames, shaders rebuild here.
+	void reloadChanged() {
+		std::vector<std::string> changed = watcher.takeChanges();
+		Model *models[] = { &goku, &vegeta, &portrait, &gokuLod };
+		for (GLuint i = 0; i < changed.size(); ++i) {
+			for (GLuint m = 0; m < 4; ++m) {
+				if (models[m]->isReady() && models[m]->uses(changed[i])) models[m]->reload();
+			}
+			if (defaultShader.uses(changed[i]) && defaultShader.reload()) findUniforms();
+			if (shadowShader.uses(changed[i])) shadowShader.reload();
+			skyBox.reload(changed[i]);
+			TextureCache::get().reload(changed[i]);
+		}
+	}
+
+	ShadowMap &getShadowMap() {
+		return shadowMap;
+	}
+
+	GpuPassTimer &getPassTimer() {
+		return passTimer;
+	}
+
+	Model &getGoku() {
+		return goku;
+	}
+
+	// Blocks until every model is uploaded, for runs that need the whole scene
+	void finishLoading() {
+		for (GLuint i = 0; i < loading.size(); ++i) {
+			loading[i]->waitParsed();
+		}
+		updateLoading(NULL, NULL);
+	}
+
+	GLuint getCulledMeshes() {
+		return culledMeshes;
+	}
+
+	GLuint getOccludedMeshes() {
+		return occlusionCulling ? occlusion.getOccludedCount() : 0;
+	}
+
+	void setOcclusionCulling(bool enabled) {
+		occlusionCulling = enabled;
+	}
+
+	// Draws the characters through gpuScene in every pass once both are
+	// loaded. Occlusion culling only covers the per-model path.
+	void setGpuDriven(bool enabled) {
+		gpuDriven = enabled;
+		shadowMap.setGpuScene(enabled && sceneBuilt ? &gpuScene : NULL);
+		cascadeMap.setGpuScene(enabled && sceneBuilt ? &gpuScene : NULL);
+		if (enabled && sceneBuilt) {
+			goku.clearCull();
+			vegeta.clearCull();
+		}
+	}
+
+	// Hands models to the passes as they finish uploading. With view given
+	// a model waits until its bounds are first in it, a shadow caster until
+	// they're first in casterView.
+	void updateLoading(const Frustum *view, const Frustum *casterView) {
+		for (GLuint i = 0; i < loading.size(); ) {
+			Model *model = loading[i];
+			// The LOD has no transform of its own, it draws where goku's copies are
+			if (!model->update(model == &gokuLod ? NULL : model == &portrait ? view : casterView)) {
+				++i;
+				continue;
+			}
+			loading.erase(loading.begin() + i);
+			// Array layers are fixed in size, so streamed textures stay out of them
+			if (MATERIAL_ARRAYS && !TEXTURE_STREAMING) {
+				model->setMaterials(materials);
+			}
+			if (model == &gokuLod) continue;
+			if (model != &portrait) {
+				shadowCasters.push_back(model);
+			}
+			occlusionModels.push_back(model);
+		}
+		// Reloads swap in here, the passes already hold these models
+		Model *models[] = { &goku, &vegeta, &portrait, &gokuLod };
+		for (GLuint i = 0; i < 4; ++i) {
+			if (!models[i]->isReady() || !models[i]->update(NULL)) continue;
+			materialsDirty = MATERIAL_ARRAYS && !TEXTURE_STREAMING;
+			// gpuScene points at the meshes just replaced
+			if (sceneBuilt) gpuScene.build();
+		}
+		if (TextureLoader::get().takeReloaded()) {
+			materialsDirty = MATERIAL_ARRAYS && !TEXTURE_STREAMING;
+		}
+		if (materialsBuilt && materialsDirty && loading.empty() && TextureLoader::get().isIdle()) {
+			materials.clear();
+			for (GLuint i = 0; i < 4; ++i) models[i]->setMaterials(materials);
+			materials.build();
+			gpuScene.build();
+			materialsDirty = false;
+		}
+		if (!sceneBuilt && goku.isReady() && vegeta.isReady() && gokuLod.isReady()) {
+			gpuScene.addModel(goku);
+			gpuScene.addModel(vegeta);
+			gpuScene.addLod(goku, gokuLod, LOD_DISTANCE);
+			gpuScene.build();
+			sceneBuilt = true;
+			setGpuDriven(gpuDriven);
+		}
+		// The arrays copy the real textures, so wait for every model and the last upload
+		if (!materialsBuilt && loading.empty() && TextureLoader::get().isIdle()) {
+			materials.build();
+			gpuScene.build();
+			materialsBuilt = true;
+		}
+		// Startup ends with the last model uploaded and the last texture decoded
+		if (!profileWritten && loading.empty() && TextureLoader::get().isIdle()) {
+#if LOAD_PROFILING
+			TextureCache::get().addToProfile();
+			LoadProfiler::get().write(LOAD_PROFILE);
+#endif
+			TextureCache::get().printStats();
+			profileWritten = true;
+		}
+	}
+
+	// The passes before the main one leave framebuffer 0 bound
+	void setTarget(GLuint fbo) {
+		target = fbo;
+	}
+
+	GLuint getTarget() {
+		return target;
+	}
+
+	void setCascaded(bool cascaded) {
+		this->cascaded = cascaded && cascadeMap.getCount() > 0;
+	}
+
+	bool isCascaded() const {
+		return cascaded;
+	}
+
+	void update(bool isAnimating, double diff) {
+		PROFILE_ZONE("Program::update");
+		rotation += isAnimating ? 0.005f : 0.0f;
+		rotation = std::fmod(rotation, 3.14159f * 2.0f);
+		camera.lookFrom.x = CAMERA_DIST * std::sin(rotation);
+		camera.lookFrom.z = CAMERA_DIST * std::cos(rotation);
+		camera.lookFrom.y = std::max(CAMERA_DIST * std::sin(rotation), 0.0f);
+
+		Frustum viewFrustum(camera.persp * camera.getViewMatrix(false));
+		{
+			PROFILE_ZONE("loading");
+			if (hotReload) {
+				reloadChanged();
+			}
+			TextureLoader::get().update();
+			// A caster outside the view can still shadow into it
+			Frustum casterFrustum = viewFrustum.towardsLight(light.position);
+			updateLoading(&viewFrustum, &casterFrustum);
+		}
+		if (gpuDriven && sceneBuilt) {
+			PROFILE_ZONE("gpuScene sync");
+			gpuScene.sync();
+		}
+		{
+			PROFILE_ZONE("shadow");
+			passTimer.begin(PASS_SHADOW);
+			if (cascaded) {
+				cascadeMap.update(shadowShader, light, shadowCasters, camera);
+			} else {
+				shadowMap.update(shadowShader, light, shadowCasters, camera);
+			}
+			passTimer.end(PASS_SHADOW);
+		}
+		{
+			PROFILE_ZONE("frustum cull");
+			// gpuScene culls the characters itself
+			culledMeshes = portrait.cull(viewFrustum);
+			if (!(gpuDriven && sceneBuilt)) {
+				culledMeshes += goku.cull(viewFrustum) + vegeta.cull(viewFrustum);
+			}
+		}
+		if (TEXTURE_STREAMING) {
+			PROFILE_ZONE("texture streaming");
+			goku.requestMips(camera);
+			vegeta.requestMips(camera);
+			portrait.requestMips(camera);
+			// The floor runs under the camera, so it always wants full detail
+			TextureLoader::get().request(floor.textures[0].id, std::numeric_limits<float>::max());
+			TextureLoader::get().stream();
+		}
+		if (occlusionCulling && !(gpuDriven && sceneBuilt)) {
+			PROFILE_ZONE("occlusion");
+			occlusion.update(shadowShader, occlusionModels, camera);
+		}
+		glBindFramebuffer(GL_FRAMEBUFFER, target);
+		glViewport(0, 0, WIDTH, HEIGHT);
+
+		{
+			PROFILE_ZONE("skybox");
+			passTimer.begin(PASS_SKYBOX);
+			skyBox.skyShader.use();
+			glDisable(GL_DEPTH_TEST);
+			skyBox.draw(camera);
+			glEnable(GL_DEPTH_TEST);
+			passTimer.end(PASS_SKYBOX);
+		}
+
+		defaultShader.use();
+		light.specular = glm::vec3(0.5f);
+		light.preDraw(defaultShader);
+		glUniformMatrix4fv(sMatId, 1, false,
+			glm::value_ptr(shadowMap.getMatrix()));
+		glActiveTexture(GL_TEXTURE0 + 5);
+		glUniform1i(sMapId, 5);
+		glBindTexture(GL_TEXTURE_2D, shadowMap.getTid());
+		shadowMap.preDraw(defaultShader);
+		glActiveTexture(GL_TEXTURE0 + 6);
+		glUniform1i(cMapId, 6);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, cascadeMap.getTid());
+		glUniform1ui(cCountId, cascaded ? cascadeMap.getCount() : 0);
+		cascadeMap.preDraw(defaultShader);
+		glUniform1f(edgeWidthId, 0.005f);
+		glUniform1f(extendId, 0.00f);
+		glUniform1ui(nonsenseId, 0);
+		{
+			PROFILE_ZONE("characters");
+			passTimer.begin(PASS_CHARACTERS);
+			if (gpuDriven && sceneBuilt) {
+				gpuScene.cull(camera.persp * camera.getViewMatrix(false), camera.lookFrom);
+				gpuScene.draw(defaultShader, camera, true);
+			} else {
+				goku.Draw(defaultShader, camera);
+				vegeta.Draw(defaultShader, camera);
+			}
+			passTimer.end(PASS_CHARACTERS);
+		}
+		
+		{
+			PROFILE_ZONE("floor");
+			passTimer.begin(PASS_FLOOR);
+			floor.Draw(defaultShader, camera, floorModel, false);
+			passTimer.end(PASS_FLOOR);
+		}
+		glUniform1ui(nonsenseId, 1);
+		light.specular = glm::vec3(1.0f);
+		light.preDraw(defaultShader);
+		{
+			PROFILE_ZONE("portrait");
+			passTimer.begin(PASS_PORTRAIT);
+			portrait.Draw(defaultShader, camera);
+			passTimer.end(PASS_PORTRAIT);
+		}
+		if (occlusionCulling && !(gpuDriven && sceneBuilt)) {
+			PROFILE_ZONE("occlusion finish");
+			occlusion.finish(occlusionModels);
+		}
+		passTimer.endFrame();
+	}
+};
+
+ShadowSettings Program::defaultShadowSettings = {
+	SHADOW_WIDTH, SHADOW_HEIGHT, SHADOW_FORMAT, SHADOW_FILTER, SHADOW_TAPS, SHADOW_BIAS
+};
+
+ShadowSettings Program::cascadeShadowSettings = {
+	SHADOW_WIDTH, SHADOW_HEIGHT, SHADOW_FORMAT, SHADOW_FILTER, SHADOW_TAPS, SHADOW_CASCADE_BIAS
+};
+
+char *Program::skyBoxList[] = {
+	"../Debug/side.bmp", "../Debug/side.bmp", "../Debug/up.bmp", 
+	"../Debug/down.bmp", "../Debug/side.bmp", "../Debug/side.bmp"
+};
+
+void drawFrame(Program &prog, bool isAnimating, double diff) {
+	// Clear the buffer the frame is drawn into, not whatever is still bound
+	glBindFramebuffer(GL_FRAMEBUFFER, prog.getTarget());
+	glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	prog.update(isAnimating, diff);
+}
+
+////////////////////////////////////////////////////////////////////
+// Benchmarks, run with a1.exe --bench <name>
+////////////////////////////////////////////////////////////////////
+
+#define BENCH_FRAMES 100
+
+std::vector<unsigned char> readFrame() {
+	std::vector<unsigned char> pixels(WIDTH * HEIGHT * 3);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, WIDTH, HEIGHT, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+	return pixels;
+}
+
+double frameRmse(const std::vector<unsigned char> &a, const std::vector<unsigned char> &b) {
+	double sum = 0.0;
+	for (size_t i = 0; i < a.size(); ++i) {
+		double d = (double)a[i] - (double)b[i];
+		sum += d * d;
+	}
+	return std::sqrt(sum / a.size());
+}
+
+// Cost is the GPU time of a whole frame with the shadow map forced to
+// re-render, quality is the RMSE against a 4096^2 32F 16 tap reference
+void shadowBenchmark(Program &prog, GLFWwindow *window) {
+	GLsizei sizes[] = {512, 1024, 2048, 4096};
+	GLenum formats[] = {GL_DEPTH_COMPONENT16, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT32F};
+	const char *formatNames[] = {"16", "24", "32F"};
+	GLenum filters[] = {GL_NEAREST, GL_LINEAR};
+	const char *filterNames[] = {"nearest", "linear"};
+	GLuint taps[] = {1, 4, 16};
+
+	ShadowMap &shadowMap = prog.getShadowMap();
+	bool cascaded = prog.isCascaded();
+	prog.setCascaded(false);
+	ShadowSettings original = shadowMap.getSettings();
+	ShadowSettings reference = {4096, 4096, GL_DEPTH_COMPONENT32F, GL_LINEAR, 16, original.bias};
+	shadowMap.configure(reference);
+	drawFrame(prog, false, 0.0);
+	std::vector<unsigned char> refImage = readFrame();
+
+	GLuint query;
+	glGenQueries(1, &query);
+	std::cout << "size,format,filter,taps,gpu_ms,rmse" << std::endl;
+	for (int si = 0; si < 4; ++si)
+	for (int fi = 0; fi < 3; ++fi)
+	for (int li = 0; li < 2; ++li)
+	for (int ti = 0; ti < 3; ++ti) {
+		ShadowSettings settings = {sizes[si], sizes[si], formats[fi], filters[li], taps[ti], original.bias};
+		shadowMap.configure(settings);
+		drawFrame(prog, false, 0.0);
+		std::vector<unsigned char> image = readFrame();
+
+		GLuint64 total = 0;
+		for (int i = 0; i < BENCH_FRAMES; ++i) {
+			shadowMap.invalidate();
+			glBeginQuery(GL_TIME_ELAPSED, query);
+			drawFrame(prog, false, 0.0);
+			glEndQuery(GL_TIME_ELAPSED);
+			GLuint64 ns;
+			glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+			total += ns;
+			glfwSwapBuffers(window);
+		}
+		std::cout << sizes[si] << "," << formatNames[fi] << "," << filterNames[li] << ","
+			<< taps[ti] << "," << (total / (double)BENCH_FRAMES) / 1.0e6 << ","
+			<< frameRmse(image, refImage) << std::endl;
+	}
+	glDeleteQueries(1, &query);
+	shadowMap.configure(original);
+	prog.setCascaded(cascaded);
+}
+
+// Culls random boxes and spheres spread around the camera, comparing the
+// SSE batches against the scalar tail path
+void cullBenchmark() {
+	Camera camera;
+	Frustum frustum(camera.persp * camera.getViewMatrix(false));
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> pos(-1000.0f, 1000.0f), size(0.5f, 20.0f);
+	size_t counts[] = {1000, 10000, 100000};
+
+	std::cout << "objects,kind,path,ns_per_object,visible" << std::endl;
+	for (int c = 0; c < 3; ++c) {
+		size_t n = counts[c];
+		std::vector<float> data[6];
+		for (int k = 0; k < 6; ++k) {
+			data[k].resize(n);
+			for (size_t i = 0; i < n; ++i) data[k][i] = k < 3 ? pos(rng) : size(rng);
+		}
+		std::vector<unsigned char> visible(n);
+		for (int kind = 0; kind < 2; ++kind)
+		for (int path = 0; path < 2; ++path) {
+			// The scalar path is the SSE kernel fed one object at a time
+			size_t step = path == 0 ? n : 1;
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			for (int rep = 0; rep < BENCH_FRAMES; ++rep) {
+				for (size_t i = 0; i < n; i += step) {
+					size_t len = std::min(step, n - i);
+					if (kind == 0) {
+						cullBoxes(frustum, &data[0][i], &data[1][i], &data[2][i],
+							&data[3][i], &data[4][i], &data[5][i], len, &visible[i]);
+					} else {
+						cullSpheres(frustum, &data[0][i], &data[1][i], &data[2][i], &data[3][i], len, &visible[i]);
+					}
+				}
+			}
+			double ns = std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - start).count();
+			size_t count = 0;
+			for (size_t i = 0; i < n; ++i) count += visible[i];
+			std::cout << n << "," << (kind == 0 ? "aabb" : "sphere") << "," << (path == 0 ? "simd" : "scalar") << ","
+				<< ns / BENCH_FRAMES / n << "," << count << std::endl;
+		}
+	}
+}
+
+// Decode throughput of SOIL against decodeImage per file, then of every
+// file decoded one after another against one thread per file
+void decodeBenchmark() {
+	const char *files[] = {
+		"../Debug/side.bmp", "../Debug/up.bmp", "../Debug/floor.bmp",
+		"../Debug/face.png", "../Debug/pants.png", "../Debug/textureA.png"
+	};
+	const int count = sizeof(files) / sizeof(files[0]);
+	std::vector<std::vector<unsigned char> > data(count);
+	for (int f = 0; f < count; ++f) {
+		std::ifstream file(files[f], std::ios::binary);
+		data[f].assign((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	}
+
+	std::cout << "file,decoder,ms,mpixels_per_s" << std::endl;
+	for (int f = 0; f < count; ++f) {
+		if (data[f].empty()) continue;
+		for (int decoder = 0; decoder < 2; ++decoder) {
+			int width = 0, height = 0, channels;
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			for (int rep = 0; rep < BENCH_FRAMES; ++rep) {
+				if (decoder == 0) {
+					unsigned char *image = SOIL_load_image_from_memory(&data[f][0], data[f].size(),
+						&width, &height, &channels, SOIL_LOAD_RGBA);
+					SOIL_free_image_data(image);
+				} else {
+					Image image;
+					decodeImage(&data[f][0], data[f].size(), image);
+					width = image.width;
+					height = image.height;
+				}
+			}
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / BENCH_FRAMES;
+			std::cout << files[f] << "," << (decoder == 0 ? "soil" : "a1") << "," << ms << ","
+				<< (double)width * height / 1000.0 / ms << std::endl;
+		}
+	}
+
+	for (int threaded = 0; threaded < 2; ++threaded) {
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		for (int rep = 0; rep < BENCH_FRAMES; ++rep) {
+			std::vector<Image> images(count);
+			std::vector<std::thread> workers;
+			for (int f = 0; f < count; ++f) {
+				if (data[f].empty()) continue;
+				if (threaded) {
+					workers.push_back(std::thread(decodeImage, &data[f][0], data[f].size(), std::ref(images[f]), false));
+				} else {
+					decodeImage(&data[f][0], data[f].size(), images[f]);
+				}
+			}
+			for (GLuint i = 0; i < workers.size(); ++i) workers[i].join();
+		}
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / BENCH_FRAMES;
+		std::cout << "all," << (threaded ? "a1_threaded" : "a1_serial") << "," << ms << "," << std::endl;
+	}
+}
+
+#define OBJ_BENCH_GRID "../Debug/grid10m.obj"
+
+// side x side quads, two triangles each, with uvs and no normals like the
+// scene models
+void writeGridObj(const char *path, int side) {
+	std::ofstream out(path, std::ios::binary);
+	std::vector<char> buffer(1 << 20);
+	out.rdbuf()->pubsetbuf(&buffer[0], buffer.size());
+	char line[128];
+	for (int y = 0; y <= side; ++y) {
+		for (int x = 0; x <= side; ++x) {
+			float h = 0.5f * std::sin(x * 0.05f) * std::cos(y * 0.05f);
+			out.write(line, sprintf(line, "v %.4f %.4f %.4f\nvt %.5f %.5f\n",
+				x * 0.1f, h, y * 0.1f, (float)x / side, (float)y / side));
+		}
+	}
+	for (int y = 0; y < side; ++y) {
+		for (int x = 0; x < side; ++x) {
+			int a = y * (side + 1) + x + 1, b = a + 1, c = a + side + 1, d = c + 1;
+			out.write(line, sprintf(line, "f %d/%d %d/%d %d/%d\nf %d/%d %d/%d %d/%d\n",
+				a, a, c, c, b, b, b, b, c, c, d, d));
+		}
+	}
+}
+
+// Load time of Assimp (with Model's flags) against parseObj for the scene
+// models and a generated 10M triangle grid
+void objBenchmark() {
+	if (!std::ifstream(OBJ_BENCH_GRID).good()) {
+		writeGridObj(OBJ_BENCH_GRID, 2237);
+	}
+	const char *files[] = {"../Debug/Goku.obj", "../Debug/Vegeta.obj", OBJ_BENCH_GRID};
+	const int count = sizeof(files) / sizeof(files[0]);
+
+	std::cout << "file,loader,ms,vertices,triangles" << std::endl;
+	for (int f = 0; f < count; ++f) {
+		int reps = f == count - 1 ? 1 : 10;
+		for (int loader = 0; loader < 2; ++loader) {
+			size_t vertices = 0, triangles = 0;
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			for (int rep = 0; rep < reps; ++rep) {
+				vertices = triangles = 0;
+				if (loader == 0) {
+					Assimp::Importer import;
+					const aiScene *scene = import.ReadFile(files[f], aiProcess_Triangulate | aiProcess_FlipUVs |
+						aiProcess_GenSmoothNormals | aiProcess_JoinIdenticalVertices);
+					for (GLuint m = 0; scene && m < scene->mNumMeshes; ++m) {
+						vertices += scene->mMeshes[m]->mNumVertices;
+						triangles += scene->mMeshes[m]->mNumFaces;
+					}
+				} else {
+					ObjData data;
+					parseObj(files[f], false, data);
+					for (GLuint m = 0; m < data.meshes.size(); ++m) {
+						vertices += data.meshes[m].vertices.size();
+						triangles += data.meshes[m].indices.size() / 3;
+					}
+				}
+			}
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / reps;
+			std::cout << files[f] << "," << (loader == 0 ? "assimp" : "a1") << "," << ms << ","
+				<< vertices << "," << triangles << std::endl;
+		}
+	}
+}
+
+// CPU side of loading and drawing, run with a1.exe --bench micro [out.json]
+// and needing no GL context. A case runs in batches sized to take about
+// MICRO_BENCH_BATCH_MS after a warm up batch, and reports the median and
+// median absolute deviation over the batches, so a preempted batch or two
+// don't move the result.
+struct MicroCase {
+	virtual ~MicroCase() {}
+	virtual void run() = 0;
+};
+
+volatile float microSink;
+
+struct AdjacencyCase : MicroCase {
+	AdjacencyCase(const std::vector<GLuint> &indices) : indices(indices) {}
+	void run() {
+		Mesh mesh;
+		mesh.computeAdjacency(indices);
+		microSink = (float)mesh.indices.back();
+	}
+	const std::vector<GLuint> &indices;
+};
+
+// What Model::processMesh does per aiMesh less the texture names
+struct ProcessMeshCase : MicroCase {
+	ProcessMeshCase(const aiMesh *mesh) : mesh(mesh) {}
+	void run() {
+		Mesh result;
+		std::vector<GLuint> indices;
+		Model::convertMesh(mesh, result.vertices, indices);
+		result.computeAdjacency(indices);
+		result.computeBounds();
+		microSink = result.sphereRadius;
+	}
+	const aiMesh *mesh;
+};
+
+// The decode TextureFromFile hands to TextureLoader
+struct DecodeCase : MicroCase {
+	DecodeCase(const std::string &path) : path(path) {}
+	void run() {
+		Image image;
+		decodeImageFile(path, image);
+		microSink = (float)image.width;
+	}
+	std::string path;
+};
+
+// CubeMap's face decode, nothing held between runs
+struct CubeFacesCase : MicroCase {
+	CubeFacesCase(const std::vector<std::string> &faces) : faces(faces) {}
+	void run() {
+		std::vector<std::shared_ptr<Image> > images = ImageCache::get().loadAll(faces);
+		microSink = images[0] ? (float)images[0]->width : 0.0f;
+	}
+	std::vector<std::string> faces;
+};
+
+// Per draw, Mesh::Draw builds the instance attributes and Camera::preDraw
+// the view matrix
+struct DrawMathCase : MicroCase {
+	DrawMathCase(GLuint draws) : models(draws) {
+		std::mt19937 rng(1);
+		std::uniform_real_distribution<float> pos(-100.0f, 100.0f), angle(0.0f, 6.28f);
+		for (GLuint i = 0; i < draws; ++i) {
+			models[i] = glm::rotate(glm::scale(glm::translate(glm::mat4(1.0f),
+				glm::vec3(pos(rng), 0.0f, pos(rng))), glm::vec3(1.6f)), angle(rng), glm::vec3(0.0f, 1.0f, 0.0f));
+		}
+	}
+	void run() {
+		float sum = 0.0f;
+		for (GLuint i = 0; i < models.size(); ++i) {
+			InstanceData instance = InstanceData::make(models[i], glm::vec4(1.0f));
+			glm::mat4 view = camera.getViewMatrix(false);
+			sum += instance.normal[0].x + view[3][2] + camera.persp[0][0];
+		}
+		microSink = sum;
+	}
+	Camera camera;
+	std::vector<glm::mat4> models;
+};
+
+// side x side quads in the xz plane, two triangles each
+void gridMesh(GLuint side, std::vector<Vertex> &vertices, std::vector<GLuint> &indices) {
+	for (GLuint y = 0; y <= side; ++y) {
+		for (GLuint x = 0; x <= side; ++x) {
+			Vertex v = {
+				glm::vec3(x * 0.1f, 0.0f, y * 0.1f), glm::vec3(0.0f, 1.0f, 0.0f),
+				glm::vec3((float)x / side, (float)y / side, 0.0f)
+			};
+			vertices.push_back(v);
+		}
+	}
+	for (GLuint y = 0; y < side; ++y) {
+		for (GLuint x = 0; x < side; ++x) {
+			GLuint a = y * (side + 1) + x, b = a + 1, c = a + side + 1, d = c + 1;
+			GLuint quad[] = {a, c, b, b, c, d};
+			indices.insert(indices.end(), quad, quad + 6);
 		}
-		this->directory = path.substr(0, path.find_last_of('/'));
-		this->processNode(scene->mRootNode, scene);
 	}
+}
 
-    void processNode(aiNode* node, const aiScene* scene) {
-		for (GLuint i = 0; i < node->mNumMeshes; i++)
-		{
-			aiMesh* mesh = scene->mMeshes[node->mMeshes[i]]; 
-			this->meshes.push_back(this->processMesh(mesh, scene));			
-		}	
-		for(GLuint i = 0; i < node->mNumChildren; i++)
-		{
-			this->processNode(node->mChildren[i], scene);
-		}
+// The grid as Assimp hands it over after triangulation; deleting it frees the arrays
+aiMesh *gridAiMesh(GLuint side) {
+	std::vector<Vertex> vertices;
+	std::vector<GLuint> indices;
+	gridMesh(side, vertices, indices);
+	aiMesh *mesh = new aiMesh();
+	mesh->mPrimitiveTypes = aiPrimitiveType_TRIANGLE;
+	mesh->mNumVertices = vertices.size();
+	mesh->mVertices = new aiVector3D[vertices.size()];
+	mesh->mNormals = new aiVector3D[vertices.size()];
+	mesh->mTextureCoords[0] = new aiVector3D[vertices.size()];
+	mesh->mNumUVComponents[0] = 2;
+	for (GLuint i = 0; i < vertices.size(); ++i) {
+		const Vertex &v = vertices[i];
+		mesh->mVertices[i] = aiVector3D(v.Position.x, v.Position.y, v.Position.z);
+		mesh->mNormals[i] = aiVector3D(v.Normal.x, v.Normal.y, v.Normal.z);
+		mesh->mTextureCoords[0][i] = aiVector3D(v.TexCoords.x, v.TexCoords.y, 0.0f);
+	}
+	mesh->mNumFaces = indices.size() / 3;
+	mesh->mFaces = new aiFace[mesh->mNumFaces];
+	for (GLuint i = 0; i < mesh->mNumFaces; ++i) {
+		mesh->mFaces[i].mNumIndices = 3;
+		mesh->mFaces[i].mIndices = new unsigned int[3];
+		std::memcpy(mesh->mFaces[i].mIndices, &indices[i * 3], 3 * sizeof(unsigned int));
+	}
+	return mesh;
+}
+
+double microBatch(MicroCase &c, GLuint iterations) {
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	for (GLuint i = 0; i < iterations; ++i) c.run();
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+}
+
+// items is the work in one run (triangles, pixels, draws) for ns_per_item.
+// Cases slower than a second get a third of the samples.
+void microRun(std::ofstream &out, GLuint &results, const char *name, const std::string &input, double items, MicroCase &c) {
+	double first = microBatch(c, 1);
+	GLuint iterations = (GLuint)std::min(std::max(MICRO_BENCH_BATCH_MS / std::max(first, 1.0e-6), 1.0), 1.0e6);
+	microBatch(c, iterations);
+	std::vector<double> samples(first > 1000.0 ? MICRO_BENCH_SAMPLES / 3 : MICRO_BENCH_SAMPLES);
+	double mean = 0.0;
+	for (GLuint i = 0; i < samples.size(); ++i) {
+		samples[i] = microBatch(c, iterations);
+		mean += samples[i] / samples.size();
+	}
+	double variance = 0.0;
+	std::vector<double> deviations(samples.size());
+	std::sort(samples.begin(), samples.end());
+	double median = samples[samples.size() / 2];
+	for (GLuint i = 0; i < samples.size(); ++i) {
+		variance += (samples[i] - mean) * (samples[i] - mean) / std::max((double)samples.size() - 1.0, 1.0);
+		deviations[i] = std::abs(samples[i] - median);
+	}
+	std::sort(deviations.begin(), deviations.end());
+	double mad = deviations[deviations.size() / 2];
+
+	out << (results++ ? "," : "") << "\n    {\"name\": \"" << name << "\", \"input\": \"" << input
+		<< "\", \"items\": " << items << ", \"iterations\": " << iterations << ", \"samples\": " << samples.size()
+		<< ",\n     \"median_ms\": " << median << ", \"mad_ms\": " << mad << ", \"min_ms\": " << samples.front()
+		<< ", \"max_ms\": " << samples.back() << ", \"mean_ms\": " << mean << ", \"stddev_ms\": " << std::sqrt(variance)
+		<< ", \"ns_per_item\": " << median * 1.0e6 / std::max(items, 1.0) << "}";
+	std::cout << name << "," << input << "," << median << "," << mad << "," << median * 1.0e6 / std::max(items, 1.0) << std::endl;
+}
+
+bool microBenchmark(const std::string &output) {
+	std::ofstream out(output.c_str());
+	if (!out.is_open()) {
+		std::cerr << "can't write " << output << std::endl;
+		return false;
 	}
+	out << "{\n  \"batch_ms\": " << MICRO_BENCH_BATCH_MS << ",\n  \"results\": [";
+	GLuint results = 0;
+	std::cout << "name,input,median_ms,mad_ms,ns_per_item" << std::endl;
 
-    Mesh processMesh(aiMesh* mesh, const aiScene* scene) {
+	// Bundled meshes through Assimp with Model's flags, then synthetic grids
+	// of 32K, 512K and 2M triangles
+	const char *models[] = {"../Debug/Goku.obj", "../Debug/Vegeta.obj"};
+	for (GLuint m = 0; m < 2; ++m) {
+		Assimp::Importer import;
+		const aiScene *scene = import.ReadFile(models[m], aiProcess_Triangulate | aiProcess_FlipUVs |
+			aiProcess_GenSmoothNormals | aiProcess_JoinIdenticalVertices);
+		if (!scene) {
+			std::cerr << models[m] << ": " << import.GetErrorString() << std::endl;
+			continue;
+		}
+		// The largest mesh stands in for the model
+		const aiMesh *largest = scene->mMeshes[0];
+		for (GLuint i = 1; i < scene->mNumMeshes; ++i) {
+			if (scene->mMeshes[i]->mNumFaces > largest->mNumFaces) largest = scene->mMeshes[i];
+		}
+		std::vector<Vertex> vertices;
+		std::vector<GLuint> indices;
+		Model::convertMesh(largest, vertices, indices);
+		AdjacencyCase adjacency(indices);
+		microRun(out, results, "computeAdjacency", models[m], indices.size() / 3, adjacency);
+		ProcessMeshCase process(largest);
+		microRun(out, results, "processMesh", models[m], largest->mNumFaces, process);
+	}
+	GLuint sides[] = {128, 512, 1024};
+	for (GLuint i = 0; i < 3; ++i) {
+		std::stringstream input;
+		input << "grid " << sides[i] << "x" << sides[i];
 		std::vector<Vertex> vertices;
 		std::vector<GLuint> indices;
-		std::vector<Texture> textures;
+		gridMesh(sides[i], vertices, indices);
+		AdjacencyCase adjacency(indices);
+		microRun(out, results, "computeAdjacency", input.str(), indices.size() / 3, adjacency);
+		std::unique_ptr<aiMesh> mesh(gridAiMesh(sides[i]));
+		ProcessMeshCase process(mesh.get());
+		microRun(out, results, "processMesh", input.str(), mesh->mNumFaces, process);
+	}
 
-		for(GLuint i = 0; i < mesh->mNumVertices; i++)
-		{
-			Vertex vertex;
+	const char *textures[] = {
+		"../Debug/face.png", "../Debug/pants.png", "../Debug/textureA.png", "../Debug/floor.bmp"
+	};
+	for (GLuint i = 0; i < 4; ++i) {
+		Image image;
+		if (!decodeImageFile(textures[i], image)) continue;
+		DecodeCase decode(textures[i]);
+		microRun(out, results, "TextureFromFile decode", textures[i], (double)image.width * image.height, decode);
+	}
+	const char *faces[] = {
+		"../Debug/side.bmp", "../Debug/side.bmp", "../Debug/up.bmp",
+		"../Debug/down.bmp", "../Debug/side.bmp", "../Debug/side.bmp"
+	};
+	CubeFacesCase cube(std::vector<std::string>(faces, faces + 6));
+	microRun(out, results, "CubeMap faces", "skybox", 6, cube);
 
-			glm::vec3 vector; 
-			vector.x = mesh->mVertices[i].x;
-			vector.y = mesh->mVertices[i].y;
-			vector.z = mesh->mVertices[i].z; 
-			vertex.Position = vector;
+	// The scene's draws per pass, then a crowd's
+	GLuint draws[] = {64, 16384};
+	for (GLuint i = 0; i < 2; ++i) {
+		std::stringstream input;
+		input << draws[i] << " draws";
+		DrawMathCase math(draws[i]);
+		microRun(out, results, "draw matrices", input.str(), draws[i], math);
+	}
+	out << "\n  ]\n}\n";
+	std::cout << output << ": " << results << " results" << std::endl;
+	return true;
+}
 
-			vector.x = mesh->mNormals[i].x;
-			vector.y = mesh->mNormals[i].y;
-			vector.z = mesh->mNormals[i].z;
-			vertex.Normal = vector;  
+// Grid of tinted Gokus drawn through the full frame (shadows, occlusion
+// prepass, outlines), instanced, as one draw per instance and GPU driven
+void crowdBenchmark(Program &prog, GLFWwindow *window) {
+	Model &goku = prog.getGoku();
+	GLuint counts[] = {1, 10, 100, 1000, 10000};
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> tint(0.5f, 1.0f);
+	GLuint query;
+	glGenQueries(1, &query);
 
-			if (mesh->mTextureCoords[0])
-			{
-				glm::vec3 vec;
-				vec.x = mesh->mTextureCoords[0][i].x; 
-				vec.y = mesh->mTextureCoords[0][i].y;
-				vec.z = 0.0f;
-				vertex.TexCoords = vec;
+	std::cout << "instances,mode,cpu_ms,gpu_ms" << std::endl;
+	for (int c = 0; c < 5; ++c) {
+		InstanceBuffer crowd;
+		GLuint side = (GLuint)std::ceil(std::sqrt((float)counts[c]));
+		for (GLuint i = 0; i < counts[c]; ++i) {
+			glm::vec3 pos(((i % side) - side / 2.0f) * 30.0f, -40.0f, -(float)(i / side) * 30.0f);
+			crowd.add(glm::rotate(glm::scale(glm::translate(glm::mat4(1.0f), pos), glm::vec3(1.6f)),
+				glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f)),
+				glm::vec4(tint(rng), tint(rng), tint(rng), 1.0f));
+		}
+		crowd.upload();
+
+		for (int mode = 0; mode < 3; ++mode) {
+			goku.setInstances(&crowd, mode != 1);
+			prog.setGpuDriven(mode == 2);
+			int frames = counts[c] >= 10000 && mode == 1 ? 10 : BENCH_FRAMES;
+			drawFrame(prog, false, 0.0);
+			glFinish();
+			double cpu = 0.0;
+			GLuint64 gpu = 0;
+			for (int i = 0; i < frames; ++i) {
+				std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+				glBeginQuery(GL_TIME_ELAPSED, query);
+				drawFrame(prog, false, 0.0);
+				glEndQuery(GL_TIME_ELAPSED);
+				cpu += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+				GLuint64 ns;
+				glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+				gpu += ns;
+				glfwSwapBuffers(window);
 			}
-			else
-				vertex.TexCoords = glm::vec3(0.0f, 0.0f, 0.0f);  
+			const char *modeNames[] = {"instanced", "separate", "gpu_driven"};
+			std::cout << counts[c] << "," << modeNames[mode] << ","
+				<< cpu / frames << "," << gpu / 1.0e6 / frames << std::endl;
+		}
+	}
+	glDeleteQueries(1, &query);
+	goku.setInstances(NULL);
+	prog.setGpuDriven(GPU_DRIVEN);
+}
 
-			vertices.push_back(vertex);
+////////////////////////////////////////////////////////////////////
+// Texture encoder, run with a1.exe --encode <image> <out.dds> [bc1|bc3]
+////////////////////////////////////////////////////////////////////
+
+// Per channel min and max of a 4x4 RGBA block
+void blockBounds(const unsigned char *block, unsigned char *lo, unsigned char *hi) {
+#ifdef USE_SSE
+	__m128i a = _mm_loadu_si128((const __m128i*)block);
+	__m128i b = _mm_loadu_si128((const __m128i*)(block + 16));
+	__m128i c = _mm_loadu_si128((const __m128i*)(block + 32));
+	__m128i d = _mm_loadu_si128((const __m128i*)(block + 48));
+	__m128i mn = _mm_min_epu8(_mm_min_epu8(a, b), _mm_min_epu8(c, d));
+	__m128i mx = _mm_max_epu8(_mm_max_epu8(a, b), _mm_max_epu8(c, d));
+	mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 8));
+	mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 4));
+	mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 8));
+	mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 4));
+	int l = _mm_cvtsi128_si32(mn), h = _mm_cvtsi128_si32(mx);
+	memcpy(lo, &l, 4);
+	memcpy(hi, &h, 4);
+#else
+	for (int c = 0; c < 4; ++c) {
+		lo[c] = hi[c] = block[c];
+		for (int i = 1; i < 16; ++i) {
+			lo[c] = std::min(lo[c], block[i * 4 + c]);
+			hi[c] = std::max(hi[c], block[i * 4 + c]);
 		}
-			
-		for (GLuint i = 0; i < mesh->mNumFaces; i++)
-		{
-			aiFace face = mesh->mFaces[i];
-			for(GLuint j = 0; j < face.mNumIndices; j++)
-				indices.push_back(face.mIndices[j]);
-		}  
+	}
+#endif
+}
 
-		if (mesh->mMaterialIndex >= 0)
-		{
-			aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
-			std::vector<Texture> diffuseMaps = this->loadMaterialTextures(material, 
-												aiTextureType_DIFFUSE, "texture_diffuse");
-			textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
-			std::vector<Texture> specularMaps = this->loadMaterialTextures(material, 
-												aiTextureType_SPECULAR, "texture_specular");
-			textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
+static unsigned short to565(const unsigned char *c) {
+	return (unsigned short)(((c[0] >> 3) << 11) | ((c[1] >> 2) << 5) | (c[2] >> 3));
+}
+
+static void from565(unsigned short v, int *c) {
+	c[0] = ((v >> 11) & 31) * 255 / 31;
+	c[1] = ((v >> 5) & 63) * 255 / 63;
+	c[2] = (v & 31) * 255 / 31;
+}
+
+// Closest of the four palette colours for every pixel, 2 bits each. The
+// SSE path keeps four pixels per register, red and green as 16 bit pairs
+// so one madd gives dr*dr + dg*dg
+static GLuint colorIndices(const unsigned char *block, int p[4][3]) {
+	GLuint indices = 0;
+#ifdef USE_SSE
+	const __m128i byteMask = _mm_set1_epi32(0xff);
+	for (int i = 0; i < 16; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(block + i * 4));
+		__m128i rg = _mm_or_si128(_mm_and_si128(v, byteMask), _mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xff00)), 8));
+		__m128i b = _mm_and_si128(_mm_srli_epi32(v, 16), byteMask);
+		__m128i bestDist = _mm_setzero_si128(), best = _mm_setzero_si128();
+		for (int k = 0; k < 4; ++k) {
+			__m128i drg = _mm_sub_epi16(rg, _mm_set1_epi32(p[k][0] | (p[k][1] << 16)));
+			__m128i db = _mm_sub_epi16(b, _mm_set1_epi32(p[k][2]));
+			__m128i dist = _mm_add_epi32(_mm_madd_epi16(drg, drg), _mm_madd_epi16(db, db));
+			__m128i closer = k ? _mm_cmplt_epi32(dist, bestDist) : _mm_set1_epi32(-1);
+			bestDist = _mm_or_si128(_mm_and_si128(closer, dist), _mm_andnot_si128(closer, bestDist));
+			best = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(k)), _mm_andnot_si128(closer, best));
+		}
+		int lanes[4];
+		_mm_storeu_si128((__m128i*)lanes, best);
+		for (int j = 0; j < 4; ++j) indices |= (GLuint)lanes[j] << (2 * (i + j));
+	}
+#else
+	for (int i = 0; i < 16; ++i) {
+		int best = 0, bestDist = std::numeric_limits<int>::max();
+		for (int k = 0; k < 4; ++k) {
+			int dr = block[i * 4] - p[k][0], dg = block[i * 4 + 1] - p[k][1], db = block[i * 4 + 2] - p[k][2];
+			int dist = dr * dr + dg * dg + db * db;
+			if (dist < bestDist) {
+				bestDist = dist;
+				best = k;
+			}
 		}
+		indices |= best << (2 * i);
+	}
+#endif
+	return indices;
+}
 
-		return Mesh(vertices, indices, textures);
+// Closest of the eight palette alphas for every pixel, 3 bits each. The
+// SSE path gathers all 16 alphas into one register of bytes
+static unsigned long long alphaIndices(const unsigned char *block, const int *p) {
+	unsigned long long indices = 0;
+#ifdef USE_SSE
+	__m128i a01 = _mm_packs_epi32(_mm_srli_epi32(_mm_loadu_si128((const __m128i*)block), 24),
+		_mm_srli_epi32(_mm_loadu_si128((const __m128i*)(block + 16)), 24));
+	__m128i a23 = _mm_packs_epi32(_mm_srli_epi32(_mm_loadu_si128((const __m128i*)(block + 32)), 24),
+		_mm_srli_epi32(_mm_loadu_si128((const __m128i*)(block + 48)), 24));
+	__m128i a = _mm_packus_epi16(a01, a23);
+	__m128i bestDist = _mm_setzero_si128(), best = _mm_setzero_si128();
+	for (int k = 0; k < 8; ++k) {
+		__m128i pk = _mm_set1_epi8((char)p[k]);
+		__m128i dist = _mm_or_si128(_mm_subs_epu8(a, pk), _mm_subs_epu8(pk, a));
+		// bestDist - dist saturates to zero unless dist is strictly smaller
+		__m128i closer = k ? _mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(bestDist, dist), _mm_setzero_si128()),
+			_mm_set1_epi8(-1)) : _mm_set1_epi8(-1);
+		bestDist = k ? _mm_min_epu8(bestDist, dist) : dist;
+		best = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi8((char)k)), _mm_andnot_si128(closer, best));
 	}
+	unsigned char lanes[16];
+	_mm_storeu_si128((__m128i*)lanes, best);
+	for (int i = 0; i < 16; ++i) indices |= (unsigned long long)lanes[i] << (3 * i);
+#else
+	for (int i = 0; i < 16; ++i) {
+		int best = 0, bestDist = 256;
+		for (int k = 0; k < 8; ++k) {
+			int dist = std::abs(block[i * 4 + 3] - p[k]);
+			if (dist < bestDist) {
+				bestDist = dist;
+				best = k;
+			}
+		}
+		indices |= (unsigned long long)best << (3 * i);
+	}
+#endif
+	return indices;
+}
 
-    std::vector<Texture> loadMaterialTextures(aiMaterial* mat, aiTextureType type, 
-                                        std::string typeName) {
-		std::vector<Texture> textures;
-		for(GLuint i = 0; i < mat->GetTextureCount(type); i++)
-		{
-			aiString str;
-			mat->GetTexture(type, i, &str);
-			GLboolean skip = false;
-			for(GLuint j = 0; j < textures_loaded.size(); j++)
-			{
-				if (textures_loaded[j].path == str)
-				{
-					textures.push_back(textures_loaded[j]);
-					skip = true; 
-					break;
+// Endpoints from the bounding box inset by a sixteenth, on the diagonal
+// that follows how red and blue vary with green, then the closest of the
+// four palette colours for every pixel
+void encodeColorBlock(const unsigned char *block, unsigned char *out) {
+	unsigned char lo[4], hi[4];
+	blockBounds(block, lo, hi);
+	for (int c = 0; c < 3; ++c) {
+		int inset = (hi[c] - lo[c]) >> 4;
+		lo[c] = (unsigned char)(lo[c] + inset);
+		hi[c] = (unsigned char)(hi[c] - inset);
+	}
+	int mid[3] = { (lo[0] + hi[0]) / 2, (lo[1] + hi[1]) / 2, (lo[2] + hi[2]) / 2 };
+	int covR = 0, covB = 0;
+	for (int i = 0; i < 16; ++i) {
+		int g = block[i * 4 + 1] - mid[1];
+		covR += (block[i * 4] - mid[0]) * g;
+		covB += (block[i * 4 + 2] - mid[2]) * g;
+	}
+	if (covR < 0) std::swap(lo[0], hi[0]);
+	if (covB < 0) std::swap(lo[2], hi[2]);
+	unsigned short c0 = to565(hi), c1 = to565(lo);
+	// c0 > c1 selects four colour mode
+	if (c0 < c1) std::swap(c0, c1);
+	GLuint indices = 0;
+	if (c0 != c1) {
+		int p[4][3];
+		from565(c0, p[0]);
+		from565(c1, p[1]);
+		for (int c = 0; c < 3; ++c) {
+			p[2][c] = (2 * p[0][c] + p[1][c]) / 3;
+			p[3][c] = (p[0][c] + 2 * p[1][c]) / 3;
+		}
+		indices = colorIndices(block, p);
+	}
+	memcpy(out, &c0, 2);
+	memcpy(out + 2, &c1, 2);
+	memcpy(out + 4, &indices, 4);
+}
+
+void encodeAlphaBlock(const unsigned char *block, unsigned char *out) {
+	unsigned char lo[4], hi[4];
+	blockBounds(block, lo, hi);
+	int a0 = hi[3], a1 = lo[3];
+	unsigned long long indices = 0;
+	if (a0 != a1) {
+		int p[8] = { a0, a1 };
+		for (int k = 1; k < 7; ++k) {
+			p[k + 1] = ((7 - k) * a0 + k * a1) / 7;
+		}
+		indices = alphaIndices(block, p);
+	}
+	out[0] = (unsigned char)a0;
+	out[1] = (unsigned char)a1;
+	for (int i = 0; i < 6; ++i) {
+		out[2 + i] = (unsigned char)(indices >> (8 * i));
+	}
+}
+
+struct EncodeJob {
+	const unsigned char *pixels;
+	int width, height;
+	bool bc3;
+	unsigned char *out;
+	int firstRow, lastRow;
+};
+
+// Block rows [firstRow, lastRow) of one level, edge pixels repeated
+void encodeRows(EncodeJob *job) {
+	int blocksX = (job->width + 3) / 4;
+	GLuint blockBytes = job->bc3 ? 16 : 8;
+	unsigned char block[64];
+	for (int by = job->firstRow; by < job->lastRow; ++by) {
+		for (int bx = 0; bx < blocksX; ++bx) {
+			for (int y = 0; y < 4; ++y) {
+				for (int x = 0; x < 4; ++x) {
+					int sx = std::min(bx * 4 + x, job->width - 1), sy = std::min(by * 4 + y, job->height - 1);
+					memcpy(block + (y * 4 + x) * 4, job->pixels + ((size_t)sy * job->width + sx) * 4, 4);
 				}
 			}
-			if(!skip)
-			{  
-				Texture texture;
-				texture.id = TextureFromFile(str.C_Str(), this->directory);
-				texture.type = typeName;
-				texture.path = str;
-				textures.push_back(texture);
-				this->textures_loaded.push_back(texture);
+			unsigned char *out = job->out + ((size_t)by * blocksX + bx) * blockBytes;
+			if (job->bc3) {
+				encodeAlphaBlock(block, out);
+				out += 8;
 			}
+			encodeColorBlock(block, out);
+		}
+	}
+}
+
+// Writes every mip level of image as BC1 or BC3 into a DDS file, each
+// level split into block rows over all cores
+bool encodeTexture(const std::string &input, const std::string &output, const std::string &format) {
+	bool bc3 = format == "bc3";
+	if (!bc3 && format != "bc1") {
+		std::cerr << "unknown format " << format << ", use bc1 or bc3" << std::endl;
+		return false;
+	}
+	int width, height, channels;
+	unsigned char *image = SOIL_load_image(input.c_str(), &width, &height, &channels, SOIL_LOAD_RGBA);
+	if (!image) {
+		std::cerr << input << " not loaded" << std::endl;
+		return false;
+	}
+	std::vector<unsigned char> pixels(image, image + (size_t)width * height * 4);
+	SOIL_free_image_data(image);
+
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	GLuint blockBytes = bc3 ? 16 : 8;
+	GLuint threads = std::max(std::thread::hardware_concurrency(), 1u);
+	std::vector<unsigned char> data;
+	GLuint levels = 0, topSize = 0;
+	int w = width, h = height;
+	for (;;) {
+		int blocksX = (w + 3) / 4, blocksY = (h + 3) / 4;
+		size_t offset = data.size();
+		data.resize(offset + (size_t)blocksX * blocksY * blockBytes);
+		if (levels == 0) topSize = data.size();
+		std::vector<EncodeJob> jobs(std::min(threads, (GLuint)blocksY));
+		std::vector<std::thread> workers;
+		for (GLuint t = 0; t < jobs.size(); ++t) {
+			EncodeJob job = { &pixels[0], w, h, bc3, &data[offset],
+				(int)(blocksY * t / jobs.size()), (int)(blocksY * (t + 1) / jobs.size()) };
+			jobs[t] = job;
+			workers.push_back(std::thread(encodeRows, &jobs[t]));
+		}
+		for (GLuint t = 0; t < workers.size(); ++t) {
+			workers[t].join();
+		}
+		levels++;
+		if (w == 1 && h == 1) break;
+		pixels = halveImage(pixels, w, h);
+		w = std::max(w / 2, 1);
+		h = std::max(h / 2, 1);
+	}
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+	GLuint header[31] = { 0 };
+	header[0] = 124;
+	// caps, height, width, pixel format, mip count, linear size
+	header[1] = 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000;
+	header[2] = height;
+	header[3] = width;
+	header[4] = topSize;
+	header[6] = levels;
+	header[18] = 32;
+	header[19] = 0x4;
+	header[20] = fourCC(bc3 ? "DXT5" : "DXT1");
+	// texture, complex, mipmap
+	header[26] = 0x1000 | 0x8 | 0x400000;
+	std::ofstream file(output.c_str(), std::ios::binary);
+	file.write("DDS ", 4);
+	file.write((const char*)header, sizeof(header));
+	file.write((const char*)&data[0], data.size());
+	if (!file.good()) {
+		std::cerr << output << " not written" << std::endl;
+		return false;
+	}
+	std::cout << output << ": " << width << "x" << height << " " << format << ", " << levels << " levels, "
+		<< data.size() / 1024 << " KB (RGBA8 with mips " << (size_t)width * height * 4 * 4 / 3 / 1024
+		<< " KB), " << ms << " ms" << std::endl;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////
+// Asset packer, run with a1.exe --pack <out.pack> <files...>
+////////////////////////////////////////////////////////////////////
+
+// Writes the files in the order given, so loading them reads the pack front to back
+bool writeAssetPack(const std::string &output, const std::vector<std::string> &files) {
+	std::ofstream out(output.c_str(), std::ios::binary);
+	std::vector<char> zeros(ASSET_PACK_ALIGN, 0);
+	out.write(&zeros[0], ASSET_PACK_ALIGN);
+	std::vector<std::pair<std::string, std::pair<unsigned long long, unsigned long long> > > index;
+	// Entries are found by file name alone, so two files can't share one
+	std::unordered_map<std::string, std::string> packed;
+	unsigned long long at = ASSET_PACK_ALIGN;
+	for (GLuint i = 0; i < files.size(); ++i) {
+		std::string name = AssetPack::entryName(files[i]);
+		if (packed.count(name)) {
+			std::cerr << files[i] << " and " << packed[name] << " would both be packed as " << name << std::endl;
+			return false;
+		}
+		packed[name] = files[i];
+		std::ifstream file(files[i].c_str(), std::ios::binary);
+		std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		if (!file.good() && data.empty()) {
+			std::cerr << files[i] << " not found" << std::endl;
+			return false;
+		}
+		index.push_back(std::make_pair(name, std::make_pair(at, (unsigned long long)data.size())));
+		if (!data.empty()) out.write(&data[0], data.size());
+		size_t pad = (ASSET_PACK_ALIGN - data.size() % ASSET_PACK_ALIGN) % ASSET_PACK_ALIGN;
+		out.write(&zeros[0], pad);
+		at += data.size() + pad;
+	}
+	for (GLuint i = 0; i < index.size(); ++i) {
+		GLuint length = index[i].first.size();
+		out.write((const char*)&length, 4);
+		out.write(index[i].first.c_str(), length);
+		out.write((const char*)&index[i].second.first, 8);
+		out.write((const char*)&index[i].second.second, 8);
+	}
+	GLuint count = index.size();
+	out.seekp(0);
+	out.write("A1PK", 4);
+	out.write((const char*)&count, 4);
+	out.write((const char*)&at, 8);
+	if (!out.good()) {
+		std::cerr << output << " not written" << std::endl;
+		return false;
+	}
+	std::cout << output << ": " << count << " files, " << at / 1024 << " KB" << std::endl;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////
+// Headless runner, run with a1.exe --headless [frames] [out.json], and
+// GL capture and replay, a1.exe --capture [frames] [out.trace] and
+// a1.exe --replay <trace> [fast|paced] [out.json]
+////////////////////////////////////////////////////////////////////
+
+// GL 4.3 core context with no window. Linux goes through EGL without a
+// surface, so Mesa's llvmpipe runs it with no GPU or display server.
+struct HeadlessContext {
+#ifdef _WIN32
+	GLFWwindow *window;
+#else
+	EGLDisplay display;
+	EGLContext context;
+#endif
+
+	bool create() {
+#ifdef _WIN32
+		if (!glfwInit()) return false;
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+		glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+		window = glfwCreateWindow(WIDTH, HEIGHT, "a1", nullptr, nullptr);
+		if (!window) {
+			std::cerr << "can't create hidden window" << std::endl;
+			glfwTerminate();
+			return false;
+		}
+		glfwMakeContextCurrent(window);
+#else
+		display = EGL_NO_DISPLAY;
+		context = EGL_NO_CONTEXT;
+		PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+			(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if (getPlatformDisplay) {
+			display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+		}
+		if (display == EGL_NO_DISPLAY) {
+			display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+		}
+		EGLint major, minor;
+		if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+			std::cerr << "no EGL display" << std::endl;
+			return false;
+		}
+		EGLint configAttribs[] = {
+			EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+			EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+			EGL_NONE
+		};
+		EGLint contextAttribs[] = {
+			EGL_CONTEXT_MAJOR_VERSION, 4,
+			EGL_CONTEXT_MINOR_VERSION, 3,
+			EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+			EGL_NONE
+		};
+		EGLConfig config;
+		EGLint configs = 0;
+		if (!eglBindAPI(EGL_OPENGL_API) || !eglChooseConfig(display, configAttribs, &config, 1, &configs) || !configs) {
+			std::cerr << "no desktop GL config on the EGL display" << std::endl;
+			eglTerminate(display);
+			return false;
+		}
+		context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+		if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+			std::cerr << "can't make a surfaceless GL 4.3 core context current" << std::endl;
+			if (context != EGL_NO_CONTEXT) eglDestroyContext(display, context);
+			eglTerminate(display);
+			return false;
 		}
-		return textures;
+#endif
+		// With no window system bound GLEW can report an error after loading
+		// the core entry points, which are all this needs
+		glewExperimental = GL_TRUE;
+		if (glewInit() != GLEW_OK && !GLEW_VERSION_4_3) {
+			destroy();
+			return false;
+		}
+		return true;
+	}
+
+	void destroy() {
+#ifdef _WIN32
+		glfwDestroyWindow(window);
+		glfwTerminate();
+#else
+		eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroyContext(display, context);
+		eglTerminate(display);
+#endif
 	}
 };
 
-//////////////////////////////////////////////////////////////
-//////////////////////////////////////////////////////////////
+// Window sized color and depth the frames draw into instead of a window
+struct OffscreenTarget {
+	GLuint fbo, color, depth;
 
-struct CubeMap {
-	CubeMap(char **list, GLenum active) {
-		glGenTextures(1, &tid);
-		int width, height;
-		unsigned char* image;
-		glActiveTexture(active);
-		glBindTexture(GL_TEXTURE_CUBE_MAP, tid);
-		for (int i = 0; i < 6; ++i) {
-			image = SOIL_load_image(list[i], &width, &height, 0, SOIL_LOAD_RGB);
-			if (image == NULL) {
-				std::cerr << "Load cube map failed" << std::endl;
-				throw false;
-			}
-			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, width, height,
-				0, GL_RGB, GL_UNSIGNED_BYTE, image);
-			SOIL_free_image_data(image);
+	bool create() {
+		glGenRenderbuffers(1, &color);
+		glBindRenderbuffer(GL_RENDERBUFFER, color);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, WIDTH, HEIGHT);
+		glGenRenderbuffers(1, &depth);
+		glBindRenderbuffer(GL_RENDERBUFFER, depth);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, WIDTH, HEIGHT);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depth);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			std::cerr << "headless framebuffer incomplete" << std::endl;
+			return false;
 		}
-		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);  
-		glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+		return true;
 	}
 
-	GLuint getTid() {
-		return tid;
+	void destroy() {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glDeleteFramebuffers(1, &fbo);
+		glDeleteRenderbuffers(1, &color);
+		glDeleteRenderbuffers(1, &depth);
+	}
+};
+
+// FNV-1a, so runs can be compared frame by frame without keeping images
+unsigned long long frameHash(const std::vector<unsigned char> &pixels) {
+	unsigned long long hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < pixels.size(); ++i) {
+		hash = (hash ^ pixels[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Every frame advances the orbit by the same step, so the camera path and
+// the hashes only change when the rendering does. cpu_ms is the time to
+// submit the frame, gpu_ms the time between timestamps around it.
+bool headlessBenchmark(Program &prog, int frames, const std::string &output) {
+	OffscreenTarget target;
+	if (!target.create()) {
+		return false;
+	}
+	prog.setTarget(target.fbo);
+
+	std::vector<GLuint> queries(frames * 2);
+	glGenQueries(frames * 2, &queries[0]);
+	std::vector<double> cpuMs(frames), gpuMs(frames);
+	std::vector<unsigned long long> hashes(frames);
+	for (int i = 0; i < frames; ++i) {
+		PROFILE_FRAME();
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		glQueryCounter(queries[i * 2], GL_TIMESTAMP);
+		drawFrame(prog, true, 1.0 / 60.0);
+		glQueryCounter(queries[i * 2 + 1], GL_TIMESTAMP);
+		cpuMs[i] = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, target.fbo);
+		hashes[i] = frameHash(readFrame());
+	}
+	double cpuTotal = 0.0, gpuTotal = 0.0;
+	for (int i = 0; i < frames; ++i) {
+		GLuint64 from, to;
+		glGetQueryObjectui64v(queries[i * 2], GL_QUERY_RESULT, &from);
+		glGetQueryObjectui64v(queries[i * 2 + 1], GL_QUERY_RESULT, &to);
+		gpuMs[i] = (to - from) / 1.0e6;
+		cpuTotal += cpuMs[i];
+		gpuTotal += gpuMs[i];
+	}
+	glDeleteQueries(frames * 2, &queries[0]);
+	prog.setTarget(0);
+	target.destroy();
+
+	std::ofstream out(output.c_str());
+	if (!out.is_open()) {
+		std::cerr << "can't write " << output << std::endl;
+		return false;
+	}
+	out << "{\n  \"renderer\": \"" << (const char*)glGetString(GL_RENDERER) << "\",\n  \"width\": " << WIDTH
+		<< ", \"height\": " << HEIGHT << ", \"frames\": " << frames
+		<< ",\n  \"cpu_ms_avg\": " << cpuTotal / frames << ", \"gpu_ms_avg\": " << gpuTotal / frames
+		<< ",\n  \"per_frame\": [";
+	for (int i = 0; i < frames; ++i) {
+		char hash[17];
+		std::snprintf(hash, sizeof(hash), "%016llx", hashes[i]);
+		out << (i ? "," : "") << "\n    {\"frame\": " << i << ", \"cpu_ms\": " << cpuMs[i]
+			<< ", \"gpu_ms\": " << gpuMs[i] << ", \"hash\": \"" << hash << "\"}";
+	}
+	out << "\n  ]\n}\n";
+	std::cout << output << ": " << frames << " frames, cpu " << cpuTotal / frames << " ms, gpu "
+		<< gpuTotal / frames << " ms, last hash " << std::hex << hashes[frames - 1] << std::dec << std::endl;
+	return true;
+}
+
+int headlessMain(int frames, const std::string &output) {
+	HeadlessContext context;
+	if (frames < 1 || !context.create()) {
+		return 1;
+	}
+	bool written;
+	{
+		TextureLoader::get().setStreaming(TEXTURE_STREAMING, TEXTURE_BUDGET);
+		AssetPack::get().open(ASSET_PACK);
+		Program prog(false);
+		prog.finishLoading();
+		TextureLoader::get().finish();
+		written = headlessBenchmark(prog, frames, output);
+	}
+	context.destroy();
+	return written ? 0 : 1;
+}
+
+#if GL_CAPTURE
+// Plays back a trace from GlCapture. The names, uniform locations and syncs
+// the capture saw are mapped to the ones replay gets, and payloads are
+// passed to GL straight out of the mapped file.
+struct GlReplay {
+	GLuint segments;
+
+	GlReplay() : segments(0), at(NULL), end(NULL), program(0), packAlignment(4) {}
+
+	bool open(const std::string &path) {
+		GLuint version = 0;
+		if (file.open(path) && file.size >= 12) {
+			std::memcpy(&version, file.data + 4, 4);
+			std::memcpy(&segments, file.data + 8, 4);
+		}
+		if (!file.data || std::memcmp(file.data, "A1GL", 4) || version != 1 || !segments) {
+			std::cerr << path << " isn't a finished GL trace" << std::endl;
+			return false;
+		}
+		at = file.data + 12;
+		end = file.data + file.size;
+		return true;
 	}
 
+	// Plays up to the next frame mark and returns the milliseconds the
+	// capture spent on that segment, or a negative number at the end
+	float run();
+
 private:
-	GLuint tid;
-};
+	MappedFile file;
+	const unsigned char *at, *end;
+	std::map<GLuint, GLuint> names[GL_NAME_KINDS];
+	std::map<std::pair<GLuint, GLint>, GLint> locations;
+	std::map<unsigned long long, GLsync> syncs;
+	std::map<GLenum, void*> mapped;
+	GLuint program;
+	GLint packAlignment;
+	std::vector<GLuint> made;
+	std::vector<GLfloat> floats;
+	std::vector<unsigned char> scratch;
 
-struct Light {
-	glm::vec3 position, ambient, diffuse, specular;
+	void get(void *v, size_t size) {
+		if ((size_t)(end - at) < size) {
+			std::cerr << "GL trace cut short" << std::endl;
+			std::memset(v, 0, size);
+			at = end;
+			return;
+		}
+		std::memcpy(v, at, size);
+		at += size;
+	}
 
-	Light() : position(0.0f),
-		ambient(0.45f), diffuse(1.0f), specular(0.6f) {
+	GLuint get_i() {
+		GLuint v;
+		get(&v, 4);
+		return v;
+	}
+
+	GLfloat get_f() {
+		GLfloat v;
+		get(&v, 4);
+		return v;
+	}
+
+	unsigned long long get_u64() {
+		unsigned long long v;
+		get(&v, 8);
+		return v;
+	}
+
+	size_t get_p() {
+		return (size_t)get_u64();
+	}
+
+	GLuint name(GlNameKind kind, GLuint captured) {
+		std::map<GLuint, GLuint>::iterator i = names[kind].find(captured);
+		return i == names[kind].end() ? captured : i->second;
+	}
+
+	GLint get_loc() {
+		GLint captured = (GLint)get_i();
+		std::map<std::pair<GLuint, GLint>, GLint>::iterator i = locations.find(std::make_pair(program, captured));
+		return i == locations.end() ? captured : i->second;
+	}
+
+	GLuint get_buf() { return name(GL_NAME_BUFFER, get_i()); }
+	GLuint get_tex() { return name(GL_NAME_TEXTURE, get_i()); }
+	GLuint get_fbo() { return name(GL_NAME_FRAMEBUFFER, get_i()); }
+	GLuint get_rbo() { return name(GL_NAME_RENDERBUFFER, get_i()); }
+	GLuint get_vao() { return name(GL_NAME_VERTEX_ARRAY, get_i()); }
+	GLuint get_qry() { return name(GL_NAME_QUERY, get_i()); }
+	GLuint get_prg() { return name(GL_NAME_PROGRAM, get_i()); }
+	GLuint get_shd() { return name(GL_NAME_SHADER, get_i()); }
+
+	const void *get_data(size_t &size) {
+		size = (size_t)get_u64();
+		if ((size_t)(end - at) < size) {
+			std::cerr << "GL trace cut short" << std::endl;
+			at = end;
+			size = 0;
+		}
+		const unsigned char *data = at;
+		at += size;
+		return size ? data : NULL;
+	}
+
+	// Copied out, the floats in the trace aren't aligned
+	const GLfloat *get_floats() {
+		size_t size;
+		const void *data = get_data(size);
+		floats.resize(size / sizeof(GLfloat) + 1);
+		if (size) std::memcpy(&floats[0], data, size);
+		return &floats[0];
+	}
+
+	const void *get_pixels() {
+		unsigned char mode;
+		get(&mode, 1);
+		size_t size;
+		if (mode == 1) return (const void*)get_p();
+		if (mode == 2) return get_data(size);
+		return NULL;
+	}
+
+	GLsync sync(unsigned long long captured) {
+		std::map<unsigned long long, GLsync>::iterator i = syncs.find(captured);
+		return i == syncs.end() ? (GLsync)0 : i->second;
+	}
+};
+
+float GlReplay::run() {
+	while (at < end) {
+		GLushort code;
+		get(&code, 2);
+		switch (code) {
+		case GL_OP_FRAME:
+			return get_f();
+#define GL_TRACE_0(fn) \
+		case GL_OP_##fn: \
+			gl##fn(); \
+			break;
+#define GL_TRACE_1(fn, k1, t1) \
+		case GL_OP_##fn: { \
+			t1 a1 = (t1)get_##k1(); \
+			gl##fn(a1); \
+			break; \
+		}
+#define GL_TRACE_2(fn, k1, t1, k2, t2) \
+		case GL_OP_##fn: { \
+			t1 a1 = (t1)get_##k1(); t2 a2 = (t2)get_##k2(); \
+			gl##fn(a1, a2); \
+			break; \
+		}
+#define GL_TRACE_3(fn, k1, t1, k2, t2, k3, t3) \
+		case GL_OP_##fn: { \
+			t1 a1 = (t1)get_##k1(); t2 a2 = (t2)get_##k2(); t3 a3 = (t3)get_##k3(); \
+			gl##fn(a1, a2, a3); \
+			break; \
+		}
+#define GL_TRACE_4(fn, k1, t1, k2, t2, k3, t3, k4, t4) \
+		case GL_OP_##fn: { \
+			t1 a1 = (t1)get_##k1(); t2 a2 = (t2)get_##k2(); t3 a3 = (t3)get_##k3(); t4 a4 = (t4)get_##k4(); \
+			gl##fn(a1, a2, a3, a4); \
+			break; \
+		}
+#define GL_TRACE_5(fn, k1, t1, k2, t2, k3, t3, k4, t4, k5, t5) \
+		case GL_OP_##fn: { \
+			t1 a1 = (t1)get_##k1(); t2 a2 = (t2)get_##k2(); t3 a3 = (t3)get_##k3(); t4 a4 = (t4)get_##k4(); \
+			t5 a5 = (t5)get_##k5(); \
+			gl##fn(a1, a2, a3, a4, a5); \
+			break; \
+		}
+#define GL_TRACE_6(fn, k1, t1, k2, t2, k3, t3, k4, t4, k5, t5, k6, t6) \
+		case GL_OP_##fn: { \
+			t1 a1 = (t1)get_##k1(); t2 a2 = (t2)get_##k2(); t3 a3 = (t3)get_##k3(); t4 a4 = (t4)get_##k4(); \
+			t5 a5 = (t5)get_##k5(); t6 a6 = (t6)get_##k6(); \
+			gl##fn(a1, a2, a3, a4, a5, a6); \
+			break; \
+		}
+#define GL_TRACE_7(fn, k1, t1, k2, t2, k3, t3, k4, t4, k5, t5, k6, t6, k7, t7) \
+		case GL_OP_##fn: { \
+			t1 a1 = (t1)get_##k1(); t2 a2 = (t2)get_##k2(); t3 a3 = (t3)get_##k3(); t4 a4 = (t4)get_##k4(); \
+			t5 a5 = (t5)get_##k5(); t6 a6 = (t6)get_##k6(); t7 a7 = (t7)get_##k7(); \
+			gl##fn(a1, a2, a3, a4, a5, a6, a7); \
+			break; \
+		}
+#define GL_TRACE_NAMES(gen, del, kind) \
+		case GL_OP_##gen: { \
+			GLsizei n = (GLsizei)get_i(); \
+			made.resize(n + 1); \
+			gl##gen(n, &made[0]); \
+			for (GLsizei i = 0; i < n; ++i) names[kind][get_i()] = made[i]; \
+			break; \
+		} \
+		case GL_OP_##del: { \
+			GLsizei n = (GLsizei)get_i(); \
+			made.resize(n + 1); \
+			for (GLsizei i = 0; i < n; ++i) { \
+				GLuint captured = get_i(); \
+				made[i] = name(kind, captured); \
+				names[kind].erase(captured); \
+			} \
+			gl##del(n, &made[0]); \
+			break; \
+		}
+		GL_TRACE_CORE_CALLS GL_TRACE_GLEW_CALLS
+		GL_TRACE_CORE_NAMES GL_TRACE_GLEW_NAMES
+#undef GL_TRACE_0
+#undef GL_TRACE_1
+#undef GL_TRACE_2
+#undef GL_TRACE_3
+#undef GL_TRACE_4
+#undef GL_TRACE_5
+#undef GL_TRACE_6
+#undef GL_TRACE_7
+#undef GL_TRACE_NAMES
+		case GL_OP_PixelStorei: {
+			GLenum pname = get_i();
+			GLint param = (GLint)get_i();
+			if (pname == GL_PACK_ALIGNMENT) packAlignment = param;
+			glPixelStorei(pname, param);
+			break;
+		}
+		case GL_OP_TexParameterfv: {
+			GLenum target = get_i(), pname = get_i();
+			glTexParameterfv(target, pname, get_floats());
+			break;
+		}
+		case GL_OP_TexImage2D: {
+			GLuint a[8];
+			for (GLuint i = 0; i < 8; ++i) a[i] = get_i();
+			glTexImage2D(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], get_pixels());
+			break;
+		}
+		case GL_OP_TexSubImage2D: {
+			GLuint a[8];
+			for (GLuint i = 0; i < 8; ++i) a[i] = get_i();
+			glTexSubImage2D(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], get_pixels());
+			break;
+		}
+		case GL_OP_ReadPixels: {
+			GLuint a[6];
+			for (GLuint i = 0; i < 6; ++i) a[i] = get_i();
+			scratch.resize(glImageBytes(a[2], a[3], 1, a[4], a[5], packAlignment) + 1);
+			glReadPixels(a[0], a[1], a[2], a[3], a[4], a[5], &scratch[0]);
+			break;
+		}
+		case GL_OP_BindBuffer: {
+			GLenum target = get_i();
+			glBindBuffer(target, get_buf());
+			break;
+		}
+		case GL_OP_UseProgram:
+			program = get_i();
+			glUseProgram(name(GL_NAME_PROGRAM, program));
+			break;
+		case GL_OP_CreateShader: {
+			GLenum type = get_i();
+			names[GL_NAME_SHADER][get_i()] = glCreateShader(type);
+			break;
+		}
+		case GL_OP_CreateProgram:
+			names[GL_NAME_PROGRAM][get_i()] = glCreateProgram();
+			break;
+		case GL_OP_ShaderSource: {
+			GLuint shader = get_shd();
+			GLsizei count = (GLsizei)get_i();
+			std::vector<const GLchar*> strings(count + 1);
+			std::vector<GLint> lengths(count + 1);
+			for (GLsizei i = 0; i < count; ++i) {
+				size_t size;
+				strings[i] = (const GLchar*)get_data(size);
+				lengths[i] = (GLint)size;
+			}
+			glShaderSource(shader, count, &strings[0], &lengths[0]);
+			break;
+		}
+		case GL_OP_GetUniformLocation: {
+			GLuint captured = get_i();
+			size_t size;
+			const char *data = (const char*)get_data(size);
+			std::string uniform(data ? data : "", size);
+			GLint location = (GLint)get_i();
+			locations[std::make_pair(captured, location)] =
+				glGetUniformLocation(name(GL_NAME_PROGRAM, captured), uniform.c_str());
+			break;
+		}
+		case GL_OP_Uniform3fv: {
+			GLint location = get_loc();
+			GLsizei count = (GLsizei)get_i();
+			glUniform3fv(location, count, get_floats());
+			break;
+		}
+		case GL_OP_Uniform4fv: {
+			GLint location = get_loc();
+			GLsizei count = (GLsizei)get_i();
+			glUniform4fv(location, count, get_floats());
+			break;
+		}
+		case GL_OP_UniformMatrix4fv: {
+			GLint location = get_loc();
+			GLsizei count = (GLsizei)get_i();
+			GLboolean transpose = (GLboolean)get_i();
+			glUniformMatrix4fv(location, count, transpose, get_floats());
+			break;
+		}
+		case GL_OP_VertexAttrib3fv: {
+			GLuint index = get_i();
+			glVertexAttrib3fv(index, get_floats());
+			break;
+		}
+		case GL_OP_VertexAttrib4fv: {
+			GLuint index = get_i();
+			glVertexAttrib4fv(index, get_floats());
+			break;
+		}
+		case GL_OP_BufferData: {
+			GLenum target = get_i();
+			GLsizeiptr size = (GLsizeiptr)get_p();
+			GLenum usage = get_i();
+			size_t dataSize;
+			glBufferData(target, size, get_data(dataSize), usage);
+			break;
+		}
+		case GL_OP_BufferSubData: {
+			GLenum target = get_i();
+			GLintptr offset = (GLintptr)get_p();
+			size_t size;
+			const void *data = get_data(size);
+			glBufferSubData(target, offset, size, data);
+			break;
+		}
+		case GL_OP_BufferStorage: {
+			GLenum target = get_i();
+			GLsizeiptr size = (GLsizeiptr)get_p();
+			GLbitfield flags = get_i();
+			size_t dataSize;
+			glBufferStorage(target, size, get_data(dataSize), flags);
+			break;
+		}
+		case GL_OP_MapBufferRange: {
+			GLenum target = get_i();
+			GLintptr offset = (GLintptr)get_p();
+			GLsizeiptr length = (GLsizeiptr)get_p();
+			GLbitfield access = get_i();
+			mapped[target] = glMapBufferRange(target, offset, length, access);
+			break;
+		}
+		case GL_OP_UnmapBuffer: {
+			GLenum target = get_i();
+			size_t size;
+			const void *data = get_data(size);
+			if (mapped[target] && size) std::memcpy(mapped[target], data, size);
+			mapped.erase(target);
+			glUnmapBuffer(target);
+			break;
+		}
+		case GL_OP_GetBufferSubData: {
+			GLenum target = get_i();
+			GLintptr offset = (GLintptr)get_p();
+			GLsizeiptr size = (GLsizeiptr)get_p();
+			scratch.resize(size + 1);
+			glGetBufferSubData(target, offset, size, &scratch[0]);
+			break;
+		}
+		case GL_OP_TexImage3D: {
+			GLuint a[9];
+			for (GLuint i = 0; i < 9; ++i) a[i] = get_i();
+			glTexImage3D(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], get_pixels());
+			break;
+		}
+		case GL_OP_CompressedTexImage2D: {
+			GLuint a[7];
+			for (GLuint i = 0; i < 7; ++i) a[i] = get_i();
+			glCompressedTexImage2D(a[0], a[1], a[2], a[3], a[4], a[5], a[6], get_pixels());
+			break;
+		}
+		case GL_OP_CompressedTexSubImage2D: {
+			GLuint a[8];
+			for (GLuint i = 0; i < 8; ++i) a[i] = get_i();
+			glCompressedTexSubImage2D(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], get_pixels());
+			break;
+		}
+		case GL_OP_CopyImageSubData: {
+			GLuint a[15];
+			for (GLuint i = 0; i < 15; ++i) a[i] = get_i();
+			a[0] = name(a[1] == GL_RENDERBUFFER ? GL_NAME_RENDERBUFFER : GL_NAME_TEXTURE, a[0]);
+			a[6] = name(a[7] == GL_RENDERBUFFER ? GL_NAME_RENDERBUFFER : GL_NAME_TEXTURE, a[6]);
+			glCopyImageSubData(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9], a[10], a[11],
+				a[12], a[13], a[14]);
+			break;
+		}
+		case GL_OP_FenceSync: {
+			GLenum condition = get_i();
+			GLbitfield flags = get_i();
+			syncs[get_u64()] = glFenceSync(condition, flags);
+			break;
+		}
+		case GL_OP_ClientWaitSync: {
+			GLsync waited = sync(get_u64());
+			GLbitfield flags = get_i();
+			GLuint64 timeout = get_u64();
+			glClientWaitSync(waited, flags, timeout);
+			break;
+		}
+		case GL_OP_DeleteSync: {
+			unsigned long long captured = get_u64();
+			glDeleteSync(sync(captured));
+			syncs.erase(captured);
+			break;
+		}
+		case GL_OP_GetQueryObjectiv: {
+			GLuint query = get_qry();
+			GLint result;
+			glGetQueryObjectiv(query, get_i(), &result);
+			break;
+		}
+		case GL_OP_GetQueryObjectui64v: {
+			GLuint query = get_qry();
+			GLuint64 result;
+			glGetQueryObjectui64v(query, get_i(), &result);
+			break;
+		}
+		default:
+			std::cerr << "unknown GL op " << code << " in trace" << std::endl;
+			at = end;
+		}
 	}
+	return -1.0f;
+}
+#endif
 
-	void preDraw(Shader shader) {
-		glUniform3fv(glGetUniformLocation(shader.getProgId(), "light.position"), 1, glm::value_ptr(position));
-		glUniform3fv(glGetUniformLocation(shader.getProgId(), "light.ambient"), 1, glm::value_ptr(ambient));
-		glUniform3fv(glGetUniformLocation(shader.getProgId(), "light.diffuse"), 1, glm::value_ptr(diffuse));
-		glUniform3fv(glGetUniformLocation(shader.getProgId(), "light.specular"), 1, glm::value_ptr(specular));
+#if GL_CAPTURE
+// Records from startup so the trace holds everything the frames draw with:
+// the shaders, meshes, textures and the offscreen target are the setup
+// segment, then each frame is one segment ended by its CPU time
+int captureMain(int frames, const std::string &path) {
+	HeadlessContext context;
+	if (frames < 1 || !context.create()) {
+		return 1;
 	}
-};
+	bool written = GlCapture::get().start(path);
+	if (written) {
+		TextureLoader::get().setStreaming(TEXTURE_STREAMING, TEXTURE_BUDGET);
+		AssetPack::get().open(ASSET_PACK);
+		Program prog(false);
+		prog.finishLoading();
+		TextureLoader::get().finish();
+		// Its readbacks would stall the replay on the capture's queries
+		prog.getPassTimer().setEnabled(false);
+		OffscreenTarget target;
+		written = target.create();
+		if (written) {
+			prog.setTarget(target.fbo);
+			GlCapture::get().frame(0.0f);
+			for (int i = 0; i < frames; ++i) {
+				PROFILE_FRAME();
+				std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+				drawFrame(prog, true, 1.0 / 60.0);
+				GlCapture::get().frame(std::chrono::duration<float, std::milli>(
+					std::chrono::high_resolution_clock::now() - start).count());
+			}
+			glFinish();
+			prog.setTarget(0);
+		}
+		written = GlCapture::get().stop() && written;
+		target.destroy();
+	}
+	context.destroy();
+	return written ? 0 : 1;
+}
 
-struct SkyBox {
+// Fast submits the frames back to back, paced holds each one to the time
+// it took when captured. cpu_ms is the time to submit a frame's calls,
+// gpu_ms the time between timestamps around them.
+int replayMain(const std::string &path, bool paced, const std::string &output) {
+	GlReplay replay;
+	if (!replay.open(path)) {
+		return 1;
+	}
+	HeadlessContext context;
+	if (!context.create()) {
+		return 1;
+	}
+	replay.run();
+	glFinish();
+	int frames = (int)replay.segments - 1;
+	std::vector<GLuint> queries(frames * 2 + 2);
+	glGenQueries(frames * 2 + 2, &queries[0]);
+	std::vector<double> cpuMs, gpuMs, capturedMs;
+	std::chrono::high_resolution_clock::time_point due = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < frames; ++i) {
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		glQueryCounter(queries[i * 2], GL_TIMESTAMP);
+		float ms = replay.run();
+		glQueryCounter(queries[i * 2 + 1], GL_TIMESTAMP);
+		if (ms < 0.0f) break;
+		cpuMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+		capturedMs.push_back(ms);
+		if (paced) {
+			due = std::max(due, start) + std::chrono::microseconds((long long)(ms * 1000.0f));
+			std::this_thread::sleep_until(due);
+		}
+	}
+	frames = (int)cpuMs.size();
+	double cpuTotal = 0.0, gpuTotal = 0.0, capturedTotal = 0.0;
+	for (int i = 0; i < frames; ++i) {
+		GLuint64 from, to;
+		glGetQueryObjectui64v(queries[i * 2], GL_QUERY_RESULT, &from);
+		glGetQueryObjectui64v(queries[i * 2 + 1], GL_QUERY_RESULT, &to);
+		gpuMs.push_back((to - from) / 1.0e6);
+		cpuTotal += cpuMs[i];
+		gpuTotal += gpuMs[i];
+		capturedTotal += capturedMs[i];
+	}
+	glDeleteQueries((GLsizei)queries.size(), &queries[0]);
 
-	SkyBox(char **list) 
-		: skyShader(2, 
-			"../a1/skybox.vert", GL_VERTEX_SHADER,
-			"../a1/skybox.frag", GL_FRAGMENT_SHADER),
-		cubeMap(list, GL_TEXTURE0) {
+	std::ofstream out(output.c_str());
+	if (!out.is_open() || !frames) {
+		std::cerr << "can't write " << output << std::endl;
+		context.destroy();
+		return 1;
+	}
+	out << "{\n  \"renderer\": \"" << (const char*)glGetString(GL_RENDERER) << "\",\n  \"trace\": \"" << path
+		<< "\", \"mode\": \"" << (paced ? "paced" : "fast") << "\", \"frames\": " << frames
+		<< ",\n  \"cpu_ms_avg\": " << cpuTotal / frames << ", \"gpu_ms_avg\": " << gpuTotal / frames
+		<< ", \"captured_ms_avg\": " << capturedTotal / frames << ",\n  \"per_frame\": [";
+	for (int i = 0; i < frames; ++i) {
+		out << (i ? "," : "") << "\n    {\"frame\": " << i << ", \"cpu_ms\": " << cpuMs[i]
+			<< ", \"gpu_ms\": " << gpuMs[i] << ", \"captured_ms\": " << capturedMs[i] << "}";
+	}
+	out << "\n  ]\n}\n";
+	std::cout << output << ": " << frames << " frames, cpu " << cpuTotal / frames << " ms, gpu "
+		<< gpuTotal / frames << " ms, captured " << capturedTotal / frames << " ms" << std::endl;
+	context.destroy();
+	return 0;
+}
+#endif
 
-		texId = glGetUniformLocation(skyShader.getProgId(), "skyTex");
+////////////////////////////////////////////////////////////////////
+// Window code
+////////////////////////////////////////////////////////////////////
 
-		glGenVertexArrays(1, &vao);
-		glGenBuffers(1, &vbo);
-		glGenBuffers(1, &ebo);
-  
-		glBindVertexArray(vao);
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		glBufferData(GL_ARRAY_BUFFER, 24 * sizeof(GLfloat), &SkyBox::skyCubeVertices[0], GL_STATIC_DRAW);  
+// The last FRAME_STATS_WINDOW samples of one frame time, with a histogram
+// of them kept alongside so percentiles are a walk over the bins
+struct FrameSeries {
+	FrameSeries() : next(0), count(0) {
+		std::memset(samples, 0, sizeof(samples));
+		std::memset(bins, 0, sizeof(bins));
+	}
 
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, 36 * sizeof(GLuint), &SkyBox::skyCubeIndices[0], GL_STATIC_DRAW);
+	static GLuint bin(float ms) {
+		return std::min((GLuint)std::max(ms / FRAME_STATS_BIN_MS, 0.0f), (GLuint)FRAME_STATS_BINS - 1);
+	}
 
-		glEnableVertexAttribArray(0);	
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (GLvoid*)0);
+	void add(float ms) {
+		if (count == FRAME_STATS_WINDOW) {
+			bins[bin(samples[next])]--;
+		} else {
+			count++;
+		}
+		samples[next] = ms;
+		bins[bin(ms)]++;
+		next = (next + 1) % FRAME_STATS_WINDOW;
+	}
 
-		glBindVertexArray(0);
+	// Upper edge of the bin the sample at fraction p falls in, so never
+	// more than a bin over, and capped at the max
+	float percentile(float p) const {
+		GLuint rank = std::max((GLuint)std::ceil(p * count), 1u), seen = 0;
+		for (GLuint b = 0; b < FRAME_STATS_BINS - 1; ++b) {
+			seen += bins[b];
+			if (seen >= rank) return std::min((b + 1) * FRAME_STATS_BIN_MS, max());
+		}
+		return max();
 	}
 
-	void draw(Camera &camera) {
-		camera.preDraw(skyShader, true);
-		glBindVertexArray(vao);
-		glActiveTexture(GL_TEXTURE0);
-		glUniform1i(texId, 0);
-		glBindTexture(GL_TEXTURE_CUBE_MAP, cubeMap.getTid());
-		glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, NULL);
-		glBindVertexArray(0);
+	float max() const {
+		float most = 0.0f;
+		for (GLuint i = 0; i < count; ++i) most = std::max(most, samples[i]);
+		return most;
 	}
 
-	Shader skyShader;
+	GLuint size() const {
+		return count;
+	}
 
 private:
-	static GLfloat skyCubeVertices[];
-	static GLuint skyCubeIndices[];
-	
-	CubeMap cubeMap;
-	GLint texId;
-	GLuint vao, vbo, ebo;
-};
-
-GLfloat SkyBox::skyCubeVertices[] = {
-	-1.0f, -1.0f, -1.0f,
-	-1.0f, 1.0f, -1.0f,
-	1.0f, 1.0f, -1.0f,
-	1.0f, -1.0f, -1.0f,
-
-	-1.0f, -1.0f, 1.0f,
-	-1.0f, 1.0f, 1.0f,
-	1.0f, 1.0f, 1.0f,
-	1.0f, -1.0f, 1.0f,
-};
-
-GLuint SkyBox::skyCubeIndices[] = {
-	0, 1, 2, 0, 2, 3,
-	4, 5, 6, 4, 6, 7,
-	0, 1, 5, 0, 5, 4,
-	2, 3, 7, 2, 7, 6,
-	1, 2, 6, 1, 6, 5,
-	0, 3, 7, 0, 7, 4
+	float samples[FRAME_STATS_WINDOW];
+	GLuint bins[FRAME_STATS_BINS];
+	GLuint next, count;
 };
 
-class Program {
-	static char *skyBoxList[];
-	Shader defaultShader, shadowShader;
-	Light light;
-	Camera camera;
-	SkyBox skyBox;
-	Mesh floor;
-	Model goku, vegeta, portrait;
-	float rotation;
-	GLint edgeWidthId, extendId, nonsenseId, vId, gId, sMapId, sMatId;
-	glm::mat4 floorModel;
-	GLuint depthMapId, depthMapFbo;
+enum FrameSeriesKind {FRAME_INTERVAL, FRAME_CPU, FRAME_GPU, FRAME_SWAP, FRAME_SERIES};
 
-public:
-	
-	Program() : 
-		skyBox(Program::skyBoxList),
-		shadowShader(2,
-			"../a1/shadow.vert", GL_VERTEX_SHADER,
-			"../a1/shadow.frag", GL_FRAGMENT_SHADER),
-		defaultShader(3,
-			"../a1/simple.vert", GL_VERTEX_SHADER,
-			"../a1/simple.frag", GL_FRAGMENT_SHADER,
-			"../a1/simple.geom", GL_GEOMETRY_SHADER),
-		rotation(0.0f),
-		goku("../Debug/Goku.obj", false),
-		vegeta("../Debug/Vegeta.obj", true),
-		portrait("../Debug/model.obj", false) {
+// Frame times for the title and FRAME_STATS_LOG: the interval between
+// presents, the CPU time of the loop body less the swap, the GPU time
+// between timestamps around drawFrame, read FRAME_STATS_LATENCY frames
+// late, and the swap.
+// A frame is a hitch when its interval is over FRAME_STATS_HITCH times the
+// median, and missed vsync when it's more than one and a half refreshes.
+struct FrameStats {
+	FrameStats() : frame(0), refreshMs(0.0f), hitches(0), missed(0) {
+		std::memset(flags, 0, sizeof(flags));
+		std::memset(issued, 0, sizeof(issued));
+	}
 
-		Vertex floorVertices[] = {
-			{
-				glm::vec3(-10000.0f, -0.0f, -10000.0f),
-				glm::vec3(0.0f, 1.0f, 0.0f),
-				glm::vec3(0.0f, 0.0f, 0.0f)
-			},
-			{
-				glm::vec3(-10000.0f, -0.0f, 10000.0f),
-				glm::vec3(0.0f, 1.0f, 0.0f),
-				glm::vec3(0.0f, 600.0f, 0.0f)
-			},
-						{
-				glm::vec3(10000.0f, -0.0f, 10000.0f),
-				glm::vec3(0.0f, 1.0f, 0.0f),
-				glm::vec3(600.0f, 600.0f, 0.0f)
-			},
-						{
-				glm::vec3(10000.0f, -0.0f, -10000.0f),
-				glm::vec3(0.0f, 1.0f, 0.0f),
-				glm::vec3(600.0f, 0.0f, 0.0f)
+	void init(bool vsync) {
+		glGenQueries(QUERY_SETS * 2, &queries[0][0]);
+		const GLFWvidmode *mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+		if (vsync && mode && mode->refreshRate > 0) refreshMs = 1000.0f / mode->refreshRate;
+		log.open(FRAME_STATS_LOG);
+		if (log.is_open()) {
+			log << "time_s,frames";
+			for (GLuint s = 0; s < FRAME_SERIES; ++s) {
+				log << "," << names[s] << "_p50," << names[s] << "_p95," << names[s] << "_p99," << names[s] << "_max";
 			}
-		};
-
-		GLuint floorIndices[] = {
-			0, 0, 1, 1, 2, 2,
-			0, 0, 2, 2, 3, 3
-		};
-
-		floor.vertices = std::vector<Vertex>(floorVertices, floorVertices + sizeof(floorVertices) / sizeof(Vertex));
-		floor.indices = std::vector<GLuint>(floorIndices, floorIndices + sizeof(floorIndices) / sizeof(GLuint));
-		floor.textures = std::vector<Texture>();
-		floorModel = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -40.0f, 0.0f));
-
-		GLuint a = TextureFromFile("../Debug/floor.bmp", ".");
-		Texture aa = {
-			a, "texture_diffuse", aiString()
-		};
-		floor.textures.push_back(aa);
-		floor.setupMesh();
-
-		goku.modelMatrix = 
-			glm::rotate(
-			glm::scale(
-			glm::translate(
-			glm::mat4(1.0f), glm::vec3(-20.0f, -40.0f, 0.0f)), 
-			glm::vec3(1.6f)),
-			glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-
-		vegeta.modelMatrix = 
-			glm::rotate(
-			glm::scale(
-			glm::translate(
-			glm::mat4(1.0f), glm::vec3(20.0f, -40.0f, 0.0f)), 
-			glm::vec3(1.0f)),
-			glm::radians(270.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-
-		portrait.modelMatrix = 
-			glm::rotate(
-			glm::scale(
-			glm::translate(
-			glm::mat4(1.0f), glm::vec3(-45.0f, -35.0f, -45.0f)), 
-			glm::vec3(20.0f)),
-			glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-
-		light.position = glm::vec3(-CAMERA_DIST, CAMERA_DIST, -CAMERA_DIST);
-		edgeWidthId = glGetUniformLocation(defaultShader.getProgId(), "edgeWidth");
-		extendId = glGetUniformLocation(defaultShader.getProgId(), "extend");
-		nonsenseId = glGetUniformLocation(defaultShader.getProgId(), "nonsenseOff");
-		vId = glGetUniformLocation(defaultShader.getProgId(), "vegetaLoc");
-		gId = glGetUniformLocation(defaultShader.getProgId(), "gokuLoc");
-		sMapId = glGetUniformLocation(defaultShader.getProgId(), "shadowMap");
-		sMatId = glGetUniformLocation(defaultShader.getProgId(), "shadowMatrix");
-		glUniform3fv(vId, 1, glm::value_ptr(glm::vec3(20.0f, -40.0f, 0.0f)));
-		glUniform3fv(gId, 1, glm::value_ptr(glm::vec3(-20.0f, -40.0f, 0.0f)));
-
-		glGenFramebuffers(1, &depthMapFbo);  
+			log << ",hitches,missed_vsync,missed_frames" << std::endl;
+		}
+	}
 
-		GLfloat border[] = {1.0f, 0.0f, 0.0f, 0.0f};
-		glGenTextures(1, &depthMapId);
-		glBindTexture(GL_TEXTURE_2D, depthMapId);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, 
-					 WIDTH, HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER); 
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);  
-		glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border);
+	void beginGpu() {
+		glQueryCounter(queries[frame % QUERY_SETS][0], GL_TIMESTAMP);
+	}
 
-		glBindFramebuffer(GL_FRAMEBUFFER, depthMapFbo);
-		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthMapId, 0);
-		glDrawBuffer(GL_NONE);
-		glReadBuffer(GL_NONE);
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);  
-		glEnable(GL_DEPTH_TEST);
-		glDepthFunc(GL_LESS);
+	void endGpu() {
+		glQueryCounter(queries[frame % QUERY_SETS][1], GL_TIMESTAMP);
+		issued[frame % QUERY_SETS] = true;
 	}
 
-	void update(bool isAnimating, double diff) {
-		rotation += isAnimating ? 0.005f : 0.0f;
-		rotation = std::fmod(rotation, 3.14159f * 2.0f);
-		camera.lookFrom.x = CAMERA_DIST * std::sin(rotation);
-		camera.lookFrom.z = CAMERA_DIST * std::cos(rotation);
-		camera.lookFrom.y = std::max(CAMERA_DIST * std::sin(rotation), 0.0f);
+	void endFrame(float intervalMs, float cpuMs, float swapMs) {
+		GLuint row = frame % FRAME_STATS_WINDOW;
+		if (frame >= FRAME_STATS_WINDOW) {
+			if (flags[row] & FRAME_HITCH) hitches--;
+			if (flags[row] & FRAME_MISSED) missed--;
+		}
+		flags[row] = 0;
+		// The first frame's interval includes loading
+		if (frame > 0) {
+			if (series[FRAME_INTERVAL].size() && intervalMs > FRAME_STATS_HITCH * series[FRAME_INTERVAL].percentile(0.5f)) {
+				flags[row] |= FRAME_HITCH;
+				hitches++;
+			}
+			if (refreshMs > 0.0f && intervalMs > refreshMs * 1.5f) {
+				flags[row] |= FRAME_MISSED;
+				missed++;
+				missedFrames.push_back(frame);
+			}
+			series[FRAME_INTERVAL].add(intervalMs);
+		}
+		series[FRAME_CPU].add(cpuMs);
+		series[FRAME_SWAP].add(swapMs);
 
-		shadowShader.use();
-		glViewport(0, 0, WIDTH, HEIGHT);
-		glBindFramebuffer(GL_FRAMEBUFFER, depthMapFbo);
-		glClear(GL_DEPTH_BUFFER_BIT);
-		Camera shadowCamera;
-		shadowCamera.lookAt = glm::vec3(0.0f);
-		shadowCamera.lookFrom = light.position;
-		goku.Draw(shadowShader, shadowCamera);
-		vegeta.Draw(shadowShader, shadowCamera);
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		// The set the next frame reuses, issued FRAME_STATS_LATENCY frames
+		// ago. Waits if the GPU is further behind rather than drop the
+		// sample, slow frames being the ones that would go missing.
+		frame++;
+		GLuint set = frame % QUERY_SETS;
+		if (!issued[set]) return;
+		issued[set] = false;
+		GLuint64 from, to;
+		glGetQueryObjectui64v(queries[set][0], GL_QUERY_RESULT, &from);
+		glGetQueryObjectui64v(queries[set][1], GL_QUERY_RESULT, &to);
+		series[FRAME_GPU].add((to - from) / 1.0e6f);
+	}
 
-		skyBox.skyShader.use();
-		glDisable(GL_DEPTH_TEST);
-		skyBox.draw(camera);
-		glEnable(GL_DEPTH_TEST);
+	std::string summary() const {
+		std::stringstream out;
+		out.precision(1);
+		out << std::fixed;
+		for (GLuint s = 0; s < FRAME_SERIES; ++s) {
+			out << (s ? " | " : "") << names[s] << " " << series[s].percentile(0.5f) << "/"
+				<< series[s].percentile(0.95f) << "/" << series[s].percentile(0.99f) << "/" << series[s].max();
+		}
+		out << " ms p50/95/99/max | " << hitches << " hitches";
+		if (refreshMs > 0.0f) out << ", " << missed << " missed vsync";
+		return out.str();
+	}
 
-		defaultShader.use();
-		light.specular = glm::vec3(0.5f);
-		light.preDraw(defaultShader);
-		glUniformMatrix4fv(sMatId, 1, false,
-			glm::value_ptr(shadowCamera.persp * shadowCamera.getViewMatrix(false)));
-		glActiveTexture(GL_TEXTURE0 + 5);
-		glUniform1i(sMapId, 5);
-		glBindTexture(GL_TEXTURE_2D, depthMapId);
-		glUniform1f(edgeWidthId, 0.005f);
-		glUniform1f(extendId, 0.00f);
-		glUniform1ui(nonsenseId, 0);
-		goku.Draw(defaultShader, camera);
-		vegeta.Draw(defaultShader, camera);
-		
-		floor.Draw(defaultShader, camera, floorModel, false);
-		glUniform1ui(nonsenseId, 1);
-		light.specular = glm::vec3(1.0f);
-		light.preDraw(defaultShader);
-		portrait.Draw(defaultShader, camera);
+	// A row per call, with the frames that missed vsync since the last one
+	void writeLog(double time) {
+		if (!log.is_open()) return;
+		log << time << "," << frame;
+		for (GLuint s = 0; s < FRAME_SERIES; ++s) {
+			log << "," << series[s].percentile(0.5f) << "," << series[s].percentile(0.95f) << ","
+				<< series[s].percentile(0.99f) << "," << series[s].max();
+		}
+		log << "," << hitches << "," << missed << ",";
+		for (size_t i = 0; i < missedFrames.size(); ++i) log << (i ? " " : "") << missedFrames[i];
+		log << std::endl;
+		missedFrames.clear();
 	}
-};
 
-char *Program::skyBoxList[] = {
-	"../Debug/side.bmp", "../Debug/side.bmp", "../Debug/up.bmp", 
-	"../Debug/down.bmp", "../Debug/side.bmp", "../Debug/side.bmp"
+private:
+	enum {FRAME_HITCH = 1, FRAME_MISSED = 2};
+	// One more than the latency, the current frame's set being in use
+	enum {QUERY_SETS = FRAME_STATS_LATENCY + 1};
+	static const char *names[FRAME_SERIES];
+	FrameSeries series[FRAME_SERIES];
+	GLuint queries[QUERY_SETS][2];
+	bool issued[QUERY_SETS];
+	unsigned char flags[FRAME_STATS_WINDOW];
+	GLuint frame;
+	float refreshMs;
+	GLuint hitches, missed;
+	std::vector<GLuint> missedFrames;
+	std::ofstream log;
 };
 
-////////////////////////////////////////////////////////////////////
-// Window code
-////////////////////////////////////////////////////////////////////
+const char *FrameStats::names[FRAME_SERIES] = {"frame", "cpu", "gpu", "swap"};
 
 void error_callback(int error, const char* description) {
 	std::cerr << description << std::endl;
 }
 bool animating = false;
+bool showPassTimes = false;
+bool exportPassTimes = false;
+bool captureTrace = false;
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
 	if (key == 'A' && action == GLFW_RELEASE) {
 		animating = !animating;
 	}
+	if (key == 'T' && action == GLFW_RELEASE) {
+		showPassTimes = !showPassTimes;
+	}
+	if (key == 'P' && action == GLFW_RELEASE) {
+		exportPassTimes = true;
+	}
+	if (key == 'R' && action == GLFW_RELEASE) {
+		captureTrace = true;
+	}
 }
 
-int main() {
+int main(int argc, char **argv) {
+#if LOAD_PROFILING
+	// Starts the load clock and routes Assimp's log through it
+	LoadProfiler::get();
+	Assimp::DefaultLogger::set(new ProfileLogger());
+#endif
+	if (argc > 3 && std::string(argv[1]) == "--encode") {
+		return encodeTexture(argv[2], argv[3], argc > 4 ? argv[4] : "bc1") ? 0 : 1;
+	}
+	if (argc > 3 && std::string(argv[1]) == "--pack") {
+		return writeAssetPack(argv[2], std::vector<std::string>(argv + 3, argv + argc)) ? 0 : 1;
+	}
+#if CPU_PROFILING
+	// --trace [first] [frames] records from startup unless first is given,
+	// and can go ahead of another mode, as in --trace 0 10 --headless
+	if (argc > 1 && std::string(argv[1]) == "--trace") {
+		int numbers = 0;
+		while (numbers < 2 && argc > 2 + numbers && argv[2 + numbers][0] >= '0' && argv[2 + numbers][0] <= '9') {
+			numbers++;
+		}
+		CpuProfiler::get().capture(numbers > 0 ? std::atoi(argv[2]) : 0,
+			numbers > 1 ? std::atoi(argv[3]) : CPU_TRACE_FRAMES, CPU_TRACE);
+		argc -= 1 + numbers;
+		argv += 1 + numbers;
+	}
+#endif
+	// Needs no window, unlike the other benchmarks
+	if (argc > 2 && std::string(argv[1]) == "--bench" && std::string(argv[2]) == "micro") {
+		return microBenchmark(argc > 3 ? argv[3] : MICRO_BENCH_REPORT) ? 0 : 1;
+	}
+	if (argc > 1 && std::string(argv[1]) == "--headless") {
+		return headlessMain(argc > 2 ? std::atoi(argv[2]) : HEADLESS_FRAMES, argc > 3 ? argv[3] : HEADLESS_REPORT);
+	}
+#if GL_CAPTURE
+	if (argc > 1 && std::string(argv[1]) == "--capture") {
+		return captureMain(argc > 2 ? std::atoi(argv[2]) : GL_CAPTURE_FRAMES, argc > 3 ? argv[3] : GL_CAPTURE_TRACE);
+	}
+	if (argc > 2 && std::string(argv[1]) == "--replay") {
+		bool paced = argc > 3 && std::string(argv[3]) == "paced";
+		return replayMain(argv[2], paced, argc > 4 ? argv[4] : GL_REPLAY_REPORT);
+	}
+#endif
 	if (!glfwInit()) {
 		exit(1);
 	}
@@ -785,7 +7897,8 @@ int main() {
 	}
 	glfwSetKeyCallback(window, key_callback);
 	glfwMakeContextCurrent(window);
-	glfwSwapInterval(1);
+	bool bench = argc > 2 && std::string(argv[1]) == "--bench";
+	glfwSwapInterval(bench ? 0 : 1);
 	glewExperimental = GL_TRUE;
 	if (glewInit() != GLEW_OK) {
 		glfwTerminate();
@@ -793,27 +7906,86 @@ int main() {
 	}
 	glViewport(0, 0, WIDTH, HEIGHT);
 
+	TextureLoader::get().setStreaming(TEXTURE_STREAMING, TEXTURE_BUDGET);
+	AssetPack::get().open(ASSET_PACK);
 	Program prog;
 
+	if (bench) {
+		prog.getPassTimer().setEnabled(false);
+		prog.finishLoading();
+		TextureLoader::get().finish();
+		std::string name(argv[2]);
+		if (name == "shadow") {
+			shadowBenchmark(prog, window);
+		} else if (name == "cull") {
+			cullBenchmark();
+		} else if (name == "crowd") {
+			crowdBenchmark(prog, window);
+		} else if (name == "decode") {
+			decodeBenchmark();
+		} else if (name == "obj") {
+			objBenchmark();
+		} else {
+			std::cerr << "unknown benchmark " << name << std::endl;
+		}
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		return 0;
+	}
+
+	FrameStats stats;
+	stats.init(true);
 	double lastTime = 0.0;
-	unsigned counter = 0;
-	
+	double lastPresent = glfwGetTime();
+
 	while (!glfwWindowShouldClose(window)) {
+		// Marked before the frame's zone opens, so a capture ends with it closed
+		PROFILE_FRAME();
+		PROFILE_ZONE("frame");
 		double x = glfwGetTime();
 		double diff = x - lastTime;
 
-		glfwPollEvents();
-		glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		prog.update(animating, diff);
-		glfwSwapBuffers(window);
+		{
+			PROFILE_ZONE("poll events");
+			glfwPollEvents();
+		}
+		stats.beginGpu();
+		drawFrame(prog, animating, diff);
+		stats.endGpu();
+		double submitted = glfwGetTime();
+		{
+			PROFILE_ZONE("swap buffers");
+			glfwSwapBuffers(window);
+		}
+		double presented = glfwGetTime();
+#if CPU_PROFILING
+		// R records the next CPU_TRACE_FRAMES frames
+		if (captureTrace) {
+			CpuProfiler::get().capture(1, CPU_TRACE_FRAMES, CPU_TRACE);
+			captureTrace = false;
+		}
+#endif
 
-		if (animating && diff > 2.0) {
-			glfwSetWindowTitle(window, std::to_string(counter).c_str());
+		if (exportPassTimes) {
+			prog.getPassTimer().writeCsv(GPU_TIMER_CSV);
+			exportPassTimes = false;
+		}
+		if (diff > FRAME_STATS_REPORT_SEC) {
+			std::stringstream title;
+			title << stats.summary() << " | frustum culled " << prog.getCulledMeshes()
+				<< " | occluded " << prog.getOccludedMeshes();
+			if (showPassTimes) {
+				title << " | " << prog.getPassTimer().summary();
+			}
+			glfwSetWindowTitle(window, title.str().c_str());
+			stats.writeLog(x);
 			lastTime = x;
-			counter = 0;
 		}
-		counter++;
+		// The CPU time is all of the above but the wait in the swap
+		double swapMs = (presented - submitted) * 1000.0;
+		stats.endFrame((float)((presented - lastPresent) * 1000.0),
+			(float)((glfwGetTime() - x) * 1000.0 - swapMs), (float)swapMs);
+		lastPresent = presented;
 	}
 	glfwDestroyWindow(window);
 	glfwTerminate();
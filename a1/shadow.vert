@@ -1,10 +1,12 @@
 #version 430 core
 
-uniform mat4 model, normalModel, view, proj;
+uniform mat4 view, proj;
 
 layout (location = 0) in vec3 position;
 layout (location = 1) in vec3 normal;
 layout (location = 2) in vec3 color;
+layout (location = 3) in mat4 model;
+layout (location = 8) in mat3 normalModel;
 
 out vec3 vNormal;
 out vec3 vPosition;
@@ -13,6 +15,6 @@ out vec3 vColor;
 void main() {
 	gl_Position = proj * view * model * vec4(position, 1.0f);
 	vPosition = vec3(view * model * vec4(position, 1.0f)); // Viewer
-	vNormal = vec3(normalModel * vec4(normal, 1.0f));
+	vNormal = normalModel * normal;
 	vColor = color;
 }  
\ No newline at end of file
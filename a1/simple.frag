@@ -12,20 +12,73 @@ struct PointLight {
 
 in vec3 gPosition, gNormal, gColor;
 in vec4 gShadowC;
+in vec4 gTint;
 flat in int gIsEdge;
+flat in uint gMaterial;
 out vec4 color;
 
 uniform uint isColor, nonsenseOff;
 uniform PointLight light;
 uniform vec3 viewerPos;
 uniform Material material;
+uniform sampler2DArray materialArray;
+uniform uint useMaterialArray;
 uniform vec3 vegetaLoc, gokuLoc;
-uniform sampler2D shadowMap;
+uniform sampler2DShadow shadowMap;
+uniform uint shadowTaps;
+uniform float shadowBias;
+uniform sampler2DArrayShadow cascadeMap;
+uniform uint shadowCascades;
+uniform mat4 cascadeMatrices[4];
+uniform vec4 cascadeSplits;
+uniform float cascadeBias;
+uniform mat4 view;
+
+const vec2 poisson[16] = vec2[](
+	vec2(-0.94201624, -0.39906216), vec2(0.94558609, -0.76890725),
+	vec2(-0.09418410, -0.92938870), vec2(0.34495938, 0.29387760),
+	vec2(-0.91588581, 0.45771432), vec2(-0.81544232, -0.87912464),
+	vec2(-0.38277543, 0.27676845), vec2(0.97484398, 0.75648379),
+	vec2(0.44323325, -0.97511554), vec2(0.53742981, -0.47373420),
+	vec2(-0.26496911, -0.41893023), vec2(0.79197514, 0.19090188),
+	vec2(-0.24188840, 0.99706507), vec2(-0.81409955, 0.91437590),
+	vec2(0.19984126, 0.78641367), vec2(0.14383161, -0.14100790)
+);
+
+float shadowLit(vec3 bndc) {
+	float t = min(bndc.z, 1.0f) - shadowBias;
+	if (shadowTaps <= 1)
+		return texture(shadowMap, vec3(bndc.xy, t));
+	vec2 texel = 1.5f / vec2(textureSize(shadowMap, 0));
+	uint taps = min(shadowTaps, 16u);
+	float lit = 0.0f;
+	for (uint i = 0; i < taps; ++i)
+		lit += texture(shadowMap, vec3(bndc.xy + poisson[i] * texel, t));
+	return lit / float(taps);
+}
+
+float cascadeLit(vec3 bndc, float layer) {
+	float t = min(bndc.z, 1.0f) - cascadeBias;
+	if (shadowTaps <= 1)
+		return texture(cascadeMap, vec4(bndc.xy, layer, t));
+	vec2 texel = 1.5f / vec2(textureSize(cascadeMap, 0));
+	uint taps = min(shadowTaps, 16u);
+	float lit = 0.0f;
+	for (uint i = 0; i < taps; ++i)
+		lit += texture(cascadeMap, vec4(bndc.xy + poisson[i] * texel, layer, t));
+	return lit / float(taps);
+}
+
+vec4 diffuseTexture(vec2 uv) {
+	if (useMaterialArray > 0)
+		return texture(materialArray, vec3(uv, float(gMaterial)));
+	return texture(material.texture_diffuse1, uv);
+}
 
 void main() {
 	if (gIsEdge == 1) {
 		if (nonsenseOff == 1) return;
-		color = texture(material.texture_diffuse1, vec2(gColor));
+		color = diffuseTexture(vec2(gColor));
 		color.x *= 0.21f;
 		color.y *= 0.21f;
 		color.z *= 0.21f;
@@ -46,19 +99,27 @@ void main() {
 		diffuseC = gColor;
 		specularC = gColor;
 	} else {
-		ambientC = vec3(texture(material.texture_diffuse1, vec2(gColor)));
-		diffuseC = vec3(texture(material.texture_diffuse1, vec2(gColor)));
-		specularC = vec3(texture(material.texture_diffuse1, vec2(gColor)));
+		ambientC = vec3(diffuseTexture(vec2(gColor)));
+		diffuseC = vec3(diffuseTexture(vec2(gColor)));
+		specularC = vec3(diffuseTexture(vec2(gColor)));
 	}
 	ambientC *= light.ambient;
 	diffuseC *= light.diffuse * diffuse;
 	specularC *= light.specular * specular;
 	vec3 ndc = gShadowC.xyz / gShadowC.w;
 	vec3 bndc = ndc / 2.0f + 0.5f;
-	float s = texture(shadowMap, bndc.xy).r;
-	float t = bndc.z > 1.0f ? 1.0f : bndc.z;
-	float c = t - s > (1.0 / 100000.0) ? 0.0f : 1.0f;
-	color = vec4(ambientC + diffuseC + specularC, 1.0f);
+	float lit;
+	if (shadowCascades > 0) {
+		float depth = -(view * vec4(gPosition, 1.0f)).z;
+		uint i = 0;
+		while (i < shadowCascades - 1 && depth > cascadeSplits[i])
+			++i;
+		vec4 sc = cascadeMatrices[i] * vec4(gPosition, 1.0f);
+		lit = cascadeLit(sc.xyz / sc.w / 2.0f + 0.5f, float(i));
+	} else {
+		lit = shadowLit(bndc);
+	}
+	color = vec4((ambientC + diffuseC + specularC) * vec3(gTint), 1.0f);
 	
 	float factor = 1.02f;
 	float gokuContrib = 1.0f / pow(factor, length(gPosition - gokuLoc));
@@ -68,6 +129,5 @@ void main() {
 
 	if (total > 0.4f)
 		color = vec4(ceil(vec3(color) * 7.0f) / 7.0f, 1.0f);
-	if (c == 0.0f)
-		color /= 5.0f;
+	color /= mix(5.0f, 1.0f, lit);
 } 
\ No newline at end of file
@@ -1,20 +1,28 @@
 #version 430 core
 
-uniform mat4 model, normalModel, view, proj, shadowMatrix;
+uniform mat4 view, proj, shadowMatrix;
 
 layout (location = 0) in vec3 position;
 layout (location = 1) in vec3 normal;
 layout (location = 2) in vec3 color;
+layout (location = 3) in mat4 model;
+layout (location = 7) in vec4 tint;
+layout (location = 8) in mat3 normalModel;
+layout (location = 11) in uint material;
 
 out vec3 vNormal;
 out vec3 vPosition;
 out vec3 vColor;
 out vec4 vShadowC;
+out vec4 vTint;
+flat out uint vMaterial;
 
 void main() {
 	gl_Position = proj * view * model * vec4(position, 1.0f);
 	vPosition = vec3(model * vec4(position, 1.0f));
-	vNormal = vec3(normalModel * vec4(normal, 1.0f));
+	vNormal = normalModel * normal;
 	vShadowC = shadowMatrix * model * vec4(position, 1.0f);
 	vColor = color;
+	vTint = tint;
+	vMaterial = material;
 }
\ No newline at end of file